@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Lock-free access to the MARIAN Seraph DMA ring through the hwdep device
+ *
+ * Build: gcc -O2 -Wall -I.. -c marian_ring.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "marian_ring.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()	__builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()	__asm__ volatile("yield")
+#else
+#define cpu_relax()	do { } while (0)
+#endif
+
+#define HUGE_SIZE	(2UL << 20)
+
+void *marian_map_dma(int fd, size_t bytes, size_t skew)
+{
+	uintptr_t base, addr;
+	void *p;
+
+	// Reserve enough address space to place the mapping anywhere we like
+	p = mmap(NULL, bytes + 2 * HUGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return p;
+
+	base = (uintptr_t)p;
+	addr = ((base + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1)) + skew;
+
+	if (mmap((void *)addr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+		 MARIAN_HWDEP_MMAP_DMA) == MAP_FAILED) {
+		munmap(p, bytes + 2 * HUGE_SIZE);
+		return MAP_FAILED;
+	}
+
+	if (addr > base)
+		munmap(p, addr - base);
+	munmap((void *)(addr + bytes), base + bytes + 2 * HUGE_SIZE - addr - bytes);
+
+	return (void *)addr;
+}
+
+int marian_ring_open(struct marian_ring *ring, const char *path)
+{
+	void *p;
+	int err;
+
+	memset(ring, 0, sizeof(*ring));
+
+	ring->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (ring->fd < 0)
+		return -1;
+
+	if (ioctl(ring->fd, MARIAN_HWDEP_IOCTL_INFO, &ring->info) < 0)
+		goto error;
+	if (ring->info.version != MARIAN_HWDEP_VERSION) {
+		errno = EPROTO;
+		goto error;
+	}
+
+	p = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, ring->fd,
+		 MARIAN_HWDEP_MMAP_STATUS);
+	if (p == MAP_FAILED)
+		goto error;
+	ring->status = p;
+
+	p = marian_map_dma(ring->fd, ring->info.dma_bytes, 0);
+	if (p == MAP_FAILED)
+		goto error;
+	ring->dma = p;
+
+	ring->periods = __atomic_load_n(&ring->status->periods, __ATOMIC_ACQUIRE);
+
+	return 0;
+
+error:
+	err = errno;
+	marian_ring_close(ring);
+	errno = err;
+	return -1;
+}
+
+void marian_ring_close(struct marian_ring *ring)
+{
+	if (ring->dma)
+		munmap(ring->dma, ring->info.dma_bytes);
+	if (ring->status)
+		munmap((void *)ring->status, sysconf(_SC_PAGESIZE));
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	ring->dma = NULL;
+	ring->status = NULL;
+	ring->fd = -1;
+}
+
+void marian_status_read(const struct marian_hwdep_status *page,
+			struct marian_hwdep_status *status)
+{
+	uint32_t seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			cpu_relax();
+			continue;
+		}
+
+		memcpy(status, page, sizeof(*status));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+			return;
+	}
+}
+
+void marian_ring_status(const struct marian_ring *ring, struct marian_hwdep_status *status)
+{
+	marian_status_read(ring->status, status);
+}
+
+int marian_ring_next(struct marian_ring *ring, struct marian_ring_period *period)
+{
+	struct marian_hwdep_status status;
+	unsigned int pf = ring->info.period_frames;
+
+	// Cheap check first, the full snapshot only when something happened
+	if (__atomic_load_n(&ring->status->periods, __ATOMIC_ACQUIRE) == ring->periods)
+		return 0;
+
+	marian_ring_status(ring, &status);
+
+	period->index = status.periods;
+	period->tstamp_ns = status.tstamp_ns;
+	// The pointer has just crossed into one half, so the other one is done
+	period->offset = status.hw_pointer < pf ? pf : 0;
+	period->lost = status.periods - ring->periods - 1;
+
+	ring->periods = status.periods;
+
+	return 1;
+}
+
+int marian_ring_wait(struct marian_ring *ring, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = ring->fd, .events = POLLIN };
+	uint64_t periods;
+	int n;
+
+	if (__atomic_load_n(&ring->status->periods, __ATOMIC_ACQUIRE) != ring->periods)
+		return 1;
+
+	n = poll(&pfd, 1, timeout_ms);
+	if (n <= 0)
+		return n;
+
+	// Acknowledges the wakeup, the period itself is taken by marian_ring_next()
+	if (read(ring->fd, &periods, sizeof(periods)) < 0)
+		return -1;
+
+	return 1;
+}
+
+int marian_ring_set_eventfd(struct marian_ring *ring, int eventfd)
+{
+	int32_t fd = eventfd;
+
+	return ioctl(ring->fd, MARIAN_HWDEP_IOCTL_EVENTFD, &fd);
+}
@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Lock-free access to the MARIAN Seraph DMA ring through the hwdep device
+ *
+ * The card is the only producer: at every period interrupt the driver
+ * publishes the period counter and the hardware pointer on a shared status
+ * page. The client is the only consumer and takes completed periods from
+ * that page without any system call, either by spinning on
+ * marian_ring_next() or by sleeping in marian_ring_wait() (or on the eventfd)
+ * first. With two periods in the buffer, the capture half returned for a
+ * period is also the playback half to fill for it: the card plays it after
+ * the one in flight.
+ *
+ * The streams themselves are set up and started through the PCM device, see
+ * marian_hwdep.h.
+ */
+
+#ifndef MARIAN_RING_H
+#define MARIAN_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "marian_hwdep.h"
+
+struct marian_ring {
+	int fd;
+	struct marian_hwdep_info info;
+	const struct marian_hwdep_status *status;
+	uint8_t *dma;
+	/* Last period handed out by marian_ring_next() */
+	uint64_t periods;
+};
+
+struct marian_ring_period {
+	uint64_t index;		/* period counter value */
+	unsigned int offset;	/* first frame of the period in every channel slot */
+	int64_t tstamp_ns;	/* CLOCK_MONOTONIC of its interrupt */
+	uint64_t lost;		/* periods overwritten before they could be taken */
+};
+
+int marian_ring_open(struct marian_ring *ring, const char *path);
+void marian_ring_close(struct marian_ring *ring);
+
+/*
+ * Maps the DMA buffer at an address skew bytes past a 2 MiB boundary. With
+ * a skew of 0 the driver can back it with huge pages.
+ */
+void *marian_map_dma(int fd, size_t bytes, size_t skew);
+
+/* Consistent copy of a mapped status page, from the hwdep device or status.bin */
+void marian_status_read(const struct marian_hwdep_status *page,
+			struct marian_hwdep_status *status);
+
+/* Consistent copy of the status page */
+void marian_ring_status(const struct marian_ring *ring, struct marian_hwdep_status *status);
+
+/* Takes the latest completed period: 1 if there is a new one, 0 if not */
+int marian_ring_next(struct marian_ring *ring, struct marian_ring_period *period);
+
+/* Sleeps until a period completes, -1 with errno on error */
+int marian_ring_wait(struct marian_ring *ring, int timeout_ms);
+
+/* Signal an eventfd at every period, -1 to detach */
+int marian_ring_set_eventfd(struct marian_ring *ring, int eventfd);
+
+static inline int32_t *marian_ring_capture(const struct marian_ring *ring,
+					   unsigned int channel, unsigned int frame)
+{
+	return (int32_t *)(ring->dma + ring->info.capture_offset +
+			   channel * ring->info.channel_bytes) + frame;
+}
+
+static inline int32_t *marian_ring_playback(const struct marian_ring *ring,
+					    unsigned int channel, unsigned int frame)
+{
+	return (int32_t *)(ring->dma + ring->info.playback_offset +
+			   channel * ring->info.channel_bytes) + frame;
+}
+
+#endif
@@ -10,6 +10,24 @@
 #include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/interrupt.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/kref.h>
+#include <linux/int_sqrt.h>
+#include <linux/math64.h>
+#include <linux/hrtimer.h>
+#include <linux/platform_device.h>
+#include <linux/version.h>
+#include <linux/eventfd.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-fence.h>
+#include <linux/dma-resv.h>
+#include <linux/scatterlist.h>
 #include <sound/core.h>
 #include <sound/control.h>
 #include <sound/pcm.h>
@@ -18,15 +36,52 @@
 #include <sound/pcm.h>
 #include <sound/initval.h>
 #include <sound/info.h>
+#include <sound/hwdep.h>
+#include <sound/timer.h>
+
+#include "marian_hwdep.h"
 
 #define M2_CHANNELS_COUNT	128
+#define M2_PORT_CHANNELS	64
+#define M2_PORT_CHANNELS_56	56
 
 #define M2_SPEEDMODE		2
 
 #define M2_FRAME_SIZE		(M2_CHANNELS_COUNT * 4)
-#define SUBSTREAM_PERIOD_SIZE	(2048 * M2_FRAME_SIZE)
+#define M2_PERIOD_FRAMES	2048
+#define SUBSTREAM_PERIOD_SIZE	(M2_PERIOD_FRAMES * M2_FRAME_SIZE)
 #define SUBSTREAM_BUF_SIZE	(2 * SUBSTREAM_PERIOD_SIZE)
 #define M2_DMA_BUFSIZE		(SUBSTREAM_BUF_SIZE * 2)
+// Every channel owns a fixed slice of the substream buffer, whatever the layout
+#define M2_CHANNEL_BUF_SIZE	(SUBSTREAM_BUF_SIZE / M2_CHANNELS_COUNT)
+
+// Capture readers sharing the one capture DMA buffer
+#define M2_CAPTURE_SUBSTREAMS	4
+
+// Playback subdevice 0 writes the DMA buffer, the others are mixed into it
+#define M2_PLAYBACK_SUBSTREAMS	4
+
+// Preview capture on PCM device 1: the ring low-passed and decimated, as S16
+#define M2_PREVIEW_DECIMATION	4
+#define M2_PREVIEW_TAPS		48
+#define M2_PREVIEW_PERIOD	(M2_PERIOD_FRAMES / M2_PREVIEW_DECIMATION)
+#define M2_PREVIEW_PERIODS_MAX	8
+#define M2_PREVIEW_BUF_SIZE	(M2_PREVIEW_PERIODS_MAX * M2_PREVIEW_PERIOD * M2_CHANNELS_COUNT * 2)
+
+// Flight recorder events kept, a power of two
+#define M2_REC_ENTRIES		512
+#define M2_REC_CARD		0xFF
+
+#define M2_DMA_DEBUG		0x244
+
+/*
+ * PMD mappings of raw PFNs need THP and the special PMD bit. Before 6.12,
+ * huge faults on VM_PFNMAP mappings never reach the driver at all.
+ */
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && defined(CONFIG_ARCH_SUPPORTS_PMD_PFNMAP) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#define M2_HUGE_DMA_MMAP
+#endif
 
 #define SERAPH_RD_IRQ_STATUS      0x00
 #define SERAPH_RD_HWPOINTER       0x8C
@@ -40,6 +95,10 @@
 #define SERAPH_WR_DMA_ENABLE      0x84
 #define SERAPH_WR_IE_ENABLE       0xAC
 
+// Channel arm masks, 32 channels per register
+#define M2_ARM_BASE		0x20
+#define M2_ARM_REGS		8
+
 #define PCI_VENDOR_ID_MARIAN            0x1382
 #define PCI_DEVICE_ID_MARIAN_SERAPH_M2  0x5021
 
@@ -48,6 +107,31 @@
 #define FREQ_MIN	28000
 #define FREQ_MAX	108000
 
+// Measured external rates this close to a standard rate are snapped to it
+#define M2_RATE_TOLERANCE	30
+
+#define M2_MONITOR_INTERVAL_MS	250
+// Frames a timed start may come after the engine got to the substream
+#define M2_START_SLACK		(M2_PERIOD_FRAMES / 4)
+// Least time between two reads of the inputs' sync state while streaming
+#define M2_SYNC_POLL_MS		20
+
+// Clock sources in the failover list, and monitor passes a preferred source
+// has to stay usable before it is switched back to
+#define M2_CLOCK_PRIORITIES	4
+#define M2_FAILBACK_POLLS	8
+// Monitor passes a sync bus measurement is good for while it isn't in use
+#define M2_SYNCBUS_POLLS	4
+
+// Input to output monitor routes, each with its own gain (1.0 = 1 << 16)
+#define M2_MONITOR_ROUTES	64
+#define M2_ROUTE_GAIN_SHIFT	16
+#define M2_ROUTE_GAIN_MAX	(2 << M2_ROUTE_GAIN_SHIFT)
+
+// Length of one sample clock vs system clock comparison
+#define M2_DRIFT_WINDOW_NS	(10 * NSEC_PER_SEC)
+#define M2_DRIFT_MAX_PPB	1000000
+
 #define SPEEDMODE_SLOW	1
 #define SPEEDMODE_FAST	2
 
@@ -117,9 +201,83 @@
 
 #define M2_CARD_NAME		"Seraph M2"
 
+// Software model
+#define M2_SIM_REGS		0x100
+#define M2_SIM_IRQ_PERIOD	0x00000800
+#define M2_SIM_FIRMWARE		0x00005100
+#define M2_SIM_FPGA_FIRMWARE	0x01
+#define M2_SIM_RATE_MHZ		48000000ULL
+
+struct marian_route {
+	/* Input channel (DMA slot), -1 if the route is unused */
+	int src;
+	/* Output channel (DMA slot) */
+	int dst;
+	u32 gain;
+};
+
+enum marian_rec_event {
+	M2_REC_IRQ,
+	M2_REC_POINTER,
+	M2_REC_TRIGGER,
+	M2_REC_XRUN,
+};
+
+/*
+ * One flight recorder event. states holds the state of every substream,
+ * 4 bits each, playback 0..3 then capture 0..3, 0xF if it isn't open.
+ */
+struct marian_rec_entry {
+	u32 seq;		/* index + 1, written last */
+	u8 event;		/* enum marian_rec_event */
+	u8 substream;		/* stream * 16 + number, M2_REC_CARD for the card */
+	u8 cmd;			/* trigger command */
+	u8 pad;
+	u64 tstamp_ns;
+	u32 irq_status;
+	u32 hw_pointer;
+	u32 dma_debug;		/* M2_DMA_DEBUG register */
+	u32 states;
+};
+
+/*
+ * Software model of the card for testing without hardware. The DMA engine
+ * runs off the system clock at the DCO rate, an hrtimer raises the period
+ * interrupts, and the MADI FPGA behind the SPI bus has both inputs cabled to
+ * its own outputs.
+ */
+struct marian_sim {
+	struct marian_card *marian;
+	struct hrtimer timer;
+	spinlock_t lock;
+
+	/* Stands in for the interrupt thread */
+	struct work_struct irq_work;
+
+	/* Last value written to every register */
+	u32 regs[M2_SIM_REGS];
+
+	/* MADI FPGA registers and the result of the last SPI read */
+	u8 fpga[128];
+	u32 spi_data;
+
+	/* Sample rate set through the DCO (millihertz) */
+	u64 rate_mhz;
+
+	u32 irq_status;
+	bool dma;
+
+	/* The DMA position was origin_frames at origin */
+	ktime_t origin;
+	u64 origin_frames;
+
+	/* Periods completed since the DMA engine was started */
+	u64 periods;
+};
+
 struct marian_card {
-	struct snd_pcm_substream *playback_substream;
-	struct snd_pcm_substream *capture_substream;
+	struct snd_pcm_substream *playback_substream[M2_PLAYBACK_SUBSTREAMS];
+	struct snd_pcm_substream *capture_substream[M2_CAPTURE_SUBSTREAMS];
 
 	struct snd_card *card;
 	struct snd_pcm *pcm;
@@ -133,6 +291,9 @@ struct marian_card {
 	void __iomem *iobase;
 	int irq;
 
+	/* Software model standing in for the hardware, NULL on real cards */
+	struct marian_sim *sim;
+
 	unsigned int idx;
 
 	/* hardware registers lock */
@@ -144,15 +305,163 @@ struct marian_card {
 	/* mutex for frequency measurement */
 	struct mutex freq_mutex;
 
+	/* protects state shared with the interrupt handler and its thread */
+	spinlock_t lock;
+
 	/* Enables or disables hardware loopback */
 	int loopback;
 
+	/*
+	 * DMA engine started, and the number of started substreams keeping it
+	 * on. A started period timer counts as one of them. started has the
+	 * marian_hw_bit() of every started substream, so each direction can
+	 * tell whether it is in use. All under lock.
+	 */
+	bool running;
+	unsigned int active;
+	u32 started;
+
+	/* Time and DMA position of the last period interrupt, under lock */
+	u64 period_ns;
+	u32 period_ptr;
+
+	/*
+	 * Substreams with hw_params set, one bit each (see marian_hw_bit()),
+	 * and the rate and format they share. Protected by reg_mutex.
+	 */
+	u32 hw_holders;
+	unsigned int hw_rate;
+	snd_pcm_format_t hw_format;
+
+	/* Period clock as an ALSA timer, ticking while timer_running */
+	struct snd_timer *timer;
+	bool timer_running;
+
+	/* Monitor routes, protected by lock */
+	struct marian_route routes[M2_MONITOR_ROUTES];
+
+	/*
+	 * Outputs of routes since dropped, under lock. They are silenced by the
+	 * next render that owns the ring, so nothing else writes them.
+	 */
+	DECLARE_BITMAP(routes_dropped, M2_CHANNELS_COUNT);
+
+	/* Playback frames up to here have the monitor routes mixed in */
+	snd_pcm_uframes_t routed_appl_ptr;
+
+	/*
+	 * Halves of the playback ring still holding what the last playback
+	 * stream left, to be silenced while the engine keeps running for
+	 * capture. Under lock.
+	 */
+	unsigned int playback_stale;
+
+	/*
+	 * Playback subdevices above 0 write their own buffers, summed into the
+	 * ring at every period. While subdevice 0 owns the ring, the sum goes to
+	 * mix_buf instead and is added as subdevice 0 commits each half;
+	 * mix_live tells which halves hold one.
+	 */
+	struct snd_dma_buffer client_buf[M2_PLAYBACK_SUBSTREAMS];
+	struct snd_dma_buffer mix_buf;
+	bool mix_live[2];
+	unsigned int mix_pos[M2_PLAYBACK_SUBSTREAMS];
+
+	/* Per-channel input meters over the last captured period */
+	bool meters_enabled;
+	struct work_struct meter_work;
+	unsigned int meter_offset;
+	u32 meter_peak[M2_CHANNELS_COUNT];
+	u32 meter_rms[M2_CHANNELS_COUNT];
+
+	/*
+	 * Preview capture, filled by preview_work after every period from the
+	 * half of the ring at preview_offset. preview_due is the card frame
+	 * that half ends at, both set under lock, and preview_done where the
+	 * work got to, 0 until the first period after prepare. The preview
+	 * has a channel layout of its own, preview_ports, taken at open.
+	 * The filter keeps the tail of the previous period of each slot in
+	 * preview_hist.
+	 */
+	struct snd_pcm *preview_pcm;
+	struct snd_pcm_substream *preview_substream;
+	struct snd_dma_buffer preview_buf;
+	struct work_struct preview_work;
+	unsigned int preview_ports[2];
+	unsigned int preview_offset;
+	u64 preview_due;
+	u64 preview_done;
+	unsigned int preview_pos;
+	s16 preview_hist[M2_CHANNELS_COUNT][M2_PREVIEW_TAPS - 1];
+	s16 preview_in[M2_PREVIEW_TAPS - 1 + M2_PERIOD_FRAMES];
+
+	/* Expose only the channels carried by the current MADI port modes */
+	int compact;
+
+	/*
+	 * Channels per MADI port exposed to the PCM, and the channels each port
+	 * carried when that layout was taken, indexed by stream and port
+	 */
+	unsigned int port_channels[2][2];
+	unsigned int port_modes[2][2];
+
+	/*
+	 * Both inputs carry the same channels, capture exposes port 1's slots
+	 * and they hold whichever port is in sync, 0 or 1. The port is picked
+	 * by sync_work, at most every M2_SYNC_POLL_MS while periods come in,
+	 * switchovers counted under lock.
+	 * Capture only gets to see whole periods then, up to redundant_pos,
+	 * the end of the last one copied.
+	 */
+	bool redundant;
+	unsigned int redundant_port;
+	u32 redundant_pos;
+	u64 switchovers;
+	struct delayed_work sync_work;
+	struct snd_kcontrol *redundant_port_control;
+
 	/* 0..15, meaning depending on the card type */
 	unsigned int clock_source;
 
+	/* Sources to fall back on when the selected one is lost, M2_CLOCK_SRC_* */
+	bool clock_failover;
+	u8 clock_priority[M2_CLOCK_PRIORITIES];
+	unsigned int failback_polls;
+
+	/*
+	 * The sync bus can only be measured, which takes milliseconds, so the
+	 * rate last measured is kept with the monitor pass it was taken in.
+	 */
+	unsigned int monitor_passes;
+	unsigned int syncbus_rate;
+	unsigned int syncbus_pass;
+
+	/*
+	 * Between monitor passes, sync_work watches the lock of the source in
+	 * use, and the watchdog runs the monitor at once if the periods stop
+	 * coming. sync_work is queued from the interrupt thread, and reads the
+	 * sync state once for this and the redundant input.
+	 */
+	bool period_locked;
+	struct delayed_work clock_watchdog;
+
 	/* Frequency of the internal oscillator (Hertz) */
 	unsigned int dco;
 
+	/* Frequency of the internal oscillator (millihertz) */
+	unsigned int dco_mhz;
+
+	/* Frames transferred since the DMA engine was started */
+	u64 frames;
+
+	/* Current drift measurement window, restarted on DMA start and DCO changes */
+	bool drift_restart;
+	u64 drift_start_ns;
+	u64 drift_start_frames;
+
+	/* Sample clock deviation from its nominal rate against the system clock */
+	s64 drift_ppb;
+
 	/* Clock settings mask */
 	u8 shadow_40;
 
@@ -167,6 +476,79 @@ struct marian_card {
 
 	bool is_controls_initialized;
 	struct snd_kcontrol *dco_control;
+	struct snd_kcontrol *dco_mhz_control;
+	struct snd_kcontrol *sync_control[2];
+	struct snd_kcontrol *ext_rate_control;
+	struct snd_kcontrol *clock_source_control;
+
+	/* Polls the sync state and the rate of the selected clock source */
+	struct delayed_work monitor_work;
+
+	/* Last seen MADI FPGA register 0x00 (sync state of both inputs) */
+	u8 sync_state;
+
+	/* Measured rate of the external clock source, 0 if internal or unlocked */
+	unsigned int ext_rate;
+
+	/* Last seen MADI FPGA register 0x01 (channel and frame mode of both inputs) */
+	u8 input_modes;
+
+	/* Measured rate of each MADI input (Hertz), 0 without signal */
+	unsigned int input_rate[2];
+
+	/* Firmware versions, read once at init */
+	u32 firmware;
+	u8 fpga_firmware;
+
+	/* Interrupt handler calls and streams stopped by xruns, under lock */
+	u64 irqs;
+	u64 xruns;
+	u64 monitor_ns;
+
+	/* Period state published to userspace, written under lock */
+	struct marian_hwdep_status *status;
+
+	/* Direct DMA access, NULL unless loaded with hwdep=1 */
+	struct snd_hwdep *hwdep;
+	wait_queue_head_t hwdep_wait;
+
+	/* Last period handed out by read() on the hwdep device */
+	u64 hwdep_periods;
+
+	/* Signalled at every period interrupt, protected by lock */
+	struct eventfd_ctx *eventfd;
+
+	/* Timed start through the hwdep device, result under lock */
+	struct hrtimer start_timer;
+	bool start_pending;
+	bool start_done;
+	u64 start_ns;
+	u64 start_frame;
+	unsigned int start_groups;
+
+	/*
+	 * Flight recorder, always on. Appenders reserve an entry from rec_head
+	 * and write it inside an RCU read section, so emptying it and releasing
+	 * a substream it looks at only wait for them, see marian_rec(). Nothing
+	 * is appended once it is frozen. Dumping it needs no lock.
+	 */
+	struct marian_rec_entry *rec;
+	atomic_t rec_head;
+	bool rec_frozen;
+	u32 rec_xruns;
+	struct dentry *debugfs;
+
+	/*
+	 * The memory behind dmabuf, shared with the rings exported as dma-bufs
+	 * and listing them. The fence of the period in progress is set and
+	 * taken under lock. It only exists while the engine runs, so no fence
+	 * waits on a stopped card.
+	 */
+	struct marian_dma_mem *dma_mem;
+	struct work_struct export_work;
+	u64 fence_context;
+	atomic64_t fence_seqno;
+	struct dma_fence *period_fence;
 };
 
 enum CLOCK_SOURCE {
@@ -201,12 +583,43 @@ MODULE_PARM_DESC(index, "Index value for MARIAN PCI soundcard");
 module_param_array(id, charp, NULL, 0444);
 MODULE_PARM_DESC(id, "ID string for MARIAN PCI soundcard");
 
+static int sim_cards;
+
+module_param_named(sim, sim_cards, int, 0444);
+MODULE_PARM_DESC(sim, "Number of software modelled Seraph M2 cards to create");
+
+static bool hwdep_enable;
+
+module_param_named(hwdep, hwdep_enable, bool, 0444);
+MODULE_PARM_DESC(hwdep, "Create a hwdep device for direct DMA buffer access");
+
+static unsigned int marian_devs;
+
+static u32 marian_sim_read(struct marian_card *marian, unsigned int reg);
+static void marian_sim_write(struct marian_card *marian, unsigned int reg, u32 val);
+
+static inline u32 marian_read(struct marian_card *marian, unsigned int reg)
+{
+	if (unlikely(marian->sim))
+		return marian_sim_read(marian, reg);
+
+	return ioread32(marian->iobase + reg);
+}
+
+static inline void marian_write(struct marian_card *marian, unsigned int reg, u32 val)
+{
+	if (unlikely(marian->sim))
+		marian_sim_write(marian, reg, val);
+	else
+		iowrite32(val, marian->iobase + reg);
+}
+
 static int spi_wait_for_ar(struct marian_card *marian)
 {
 	int tries = 10;
 
 	while (tries > 0) {
-		if (ioread32(marian->iobase + M2_SPI_STATE) == SPI_ALL_READY)
+		if (marian_read(marian, M2_SPI_STATE) == SPI_ALL_READY)
 			break;
 		udelay(M2_SPI_DELAY);
 		tries--;
@@ -226,11 +639,11 @@ static int marian_spi_transfer(struct marian_card *marian, uint16_t cs, uint16_t
 	spin_lock(&marian->spi_lock);
 
 	if (spi_wait_for_ar(marian) < 0)
-		iowrite32(0x1234, marian->iobase + M2_SPI_RESET); // Resetting SPI bus
+		marian_write(marian, M2_SPI_RESET, 0x1234); // Resetting SPI bus
 
-	iowrite32(cs, marian->iobase + M2_SPI_CHIP_SELECT);
-	iowrite32(bits_write, marian->iobase + M2_SPI_BITS_TO_WRITE);
-	iowrite32(bits_read, marian->iobase + M2_SPI_BITS_TO_READ);
+	marian_write(marian, M2_SPI_CHIP_SELECT, cs);
+	marian_write(marian, M2_SPI_BITS_TO_WRITE, bits_write);
+	marian_write(marian, M2_SPI_BITS_TO_READ, bits_read);
 
 	if (bits_write <= 32) {
 		// left-align data
@@ -239,7 +652,7 @@ static int marian_spi_transfer(struct marian_card *marian, uint16_t cs, uint16_t
 		else if (bits_write <= 16)
 			buf = data_write[0] << 24 | data_write[1] << (32 - bits_write);
 
-		iowrite32(buf, marian->iobase + M2_SPI_WRITE_DATA);
+		marian_write(marian, M2_SPI_WRITE_DATA, buf);
 	}
 	if (bits_read > 0 && bits_read <= 32) {
 		if (spi_wait_for_ar(marian) < 0) {
@@ -249,7 +662,7 @@ static int marian_spi_transfer(struct marian_card *marian, uint16_t cs, uint16_t
 			goto unlock_exit;
 		}
 
-		buf = ioread32(marian->iobase + MARIAN_SPI_CLOCK_DIVIDER);
+		buf = marian_read(marian, MARIAN_SPI_CLOCK_DIVIDER);
 
 		buf <<= 32 - bits_read;
 		i = 0;
@@ -293,7 +706,7 @@ static int marian_m2_spi_write(struct marian_card *marian, u8 adr, u8 val)
  * The measurement is triggered and the FPGA's ready
  * signal polled (normally takes up to 2ms). The measurement
  * has only a certainty of 10-20Hz, this function rounds it up
- * to the nearest 10Hz step (in 1FS).
+ * to the nearest 10Hz step (in 1FS). Sleeps, so process context only.
  */
 static unsigned int marian_measure_freq(struct marian_card *marian, unsigned int source)
 {
@@ -301,16 +714,16 @@ static unsigned int marian_measure_freq(struct marian_card *marian, unsigned int
 	int tries = 5;
 
 	mutex_lock(&marian->freq_mutex);
-	iowrite32(source, marian->iobase + M2_CLOCK_SRC_SELECT);
+	marian_write(marian, M2_CLOCK_SRC_SELECT, source);
 
-	mdelay(2);
+	usleep_range(2000, 2500);
 
 	while (tries > 0) {
-		val = ioread32(marian->iobase + M2_WORD_CLOCK_REG);
+		val = marian_read(marian, M2_WORD_CLOCK_REG);
 		if (val & WCLOCK_NEW_VAL)
 			break;
 
-		mdelay(1);
+		usleep_range(1000, 1200);
 		tries--;
 	}
 
@@ -323,6 +736,23 @@ static unsigned int marian_measure_freq(struct marian_card *marian, unsigned int
 	return 0;
 }
 
+static const unsigned int marian_standard_rates[] = {
+	32000, 44100, 48000, 64000, 88200, 96000,
+};
+
+// Snap a measured frequency to the standard rate it most likely is
+static unsigned int marian_snap_rate(unsigned int freq)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(marian_standard_rates); i++) {
+		if (abs((int)freq - (int)marian_standard_rates[i]) <= M2_RATE_TOLERANCE)
+			return marian_standard_rates[i];
+	}
+
+	return freq;
+}
+
 static int marian_generic_frequency_info(struct snd_kcontrol *kcontrol,
 					 struct snd_ctl_elem_info *uinfo)
 {
@@ -339,7 +769,8 @@ static int marian_generic_frequency_get(struct snd_kcontrol *kcontrol,
 {
 	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
 
-	ucontrol->value.integer.value[0] = marian_measure_freq(marian, kcontrol->private_value);
+	ucontrol->value.integer.value[0] =
+		READ_ONCE(marian->input_rate[kcontrol->private_value - M2_CLOCK_SRC_MADI1]);
 	return 0;
 }
 
@@ -357,19 +788,38 @@ static int marian_generic_frequency_create(struct marian_card *marian, char *lab
 	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
 }
 
-static void marian_generic_set_dco(struct marian_card *marian, unsigned int freq)
+/*
+ * The DCO takes a phase increment relative to its 80 MHz reference, one step
+ * is about 1.2 mHz. A single register write, so safe while streaming.
+ */
+static void marian_generic_set_dco_mhz(struct marian_card *marian, unsigned int mhz)
 {
+	unsigned long flags;
 	u64 val;
 
-	val = freq;
+	val = mhz;
 	val <<= 36;
-	val /= 80000000;
+	val = div64_u64(val, 80000000ULL * 1000);
 
-	iowrite32((u32)val, marian->iobase + M2_SET_DCO);
+	marian_write(marian, M2_SET_DCO, (u32)val);
 
-	if (marian->is_controls_initialized)
+	spin_lock_irqsave(&marian->lock, flags);
+	marian->drift_restart = true;
+	spin_unlock_irqrestore(&marian->lock, flags);
+
+	marian->dco = DIV_ROUND_CLOSEST(mhz, 1000);
+	marian->dco_mhz = mhz;
+
+	if (marian->is_controls_initialized) {
 		snd_ctl_notify(marian->card, SNDRV_CTL_EVENT_MASK_VALUE, &marian->dco_control->id);
-	marian->dco = freq;
+		snd_ctl_notify(marian->card, SNDRV_CTL_EVENT_MASK_VALUE,
+			       &marian->dco_mhz_control->id);
+	}
+}
+
+static void marian_generic_set_dco(struct marian_card *marian, unsigned int freq)
+{
+	marian_generic_set_dco_mhz(marian, freq * 1000);
 }
 
 static int marian_generic_dco_int_info(struct snd_kcontrol *kcontrol,
@@ -420,6 +870,95 @@ static int marian_generic_dco_int_create(struct marian_card *marian, char *label
 	return snd_ctl_add(marian->card, marian->dco_control);
 }
 
+static int marian_generic_dco_mhz_info(struct snd_kcontrol *kcontrol,
+				       struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = FREQ_MIN * 1000;
+	uinfo->value.integer.max = FREQ_MAX * 1000;
+	uinfo->value.integer.step = 1;
+	return 0;
+}
+
+static int marian_generic_dco_mhz_get(struct snd_kcontrol *kcontrol,
+				      struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = marian->dco_mhz;
+
+	return 0;
+}
+
+// Only the DCO is touched, so the rate can be steered while streaming
+static int marian_generic_dco_mhz_put(struct snd_kcontrol *kcontrol,
+				      struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	long mhz = clamp(ucontrol->value.integer.value[0], (long)FREQ_MIN * 1000,
+			 (long)FREQ_MAX * 1000);
+
+	mutex_lock(&marian->reg_mutex);
+	marian_generic_set_dco_mhz(marian, mhz);
+	mutex_unlock(&marian->reg_mutex);
+
+	return 0;
+}
+
+static int marian_generic_dco_mhz_create(struct marian_card *marian, char *label)
+{
+	struct snd_kcontrol_new c = {
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = label,
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = marian_generic_dco_mhz_info,
+		.get = marian_generic_dco_mhz_get,
+		.put = marian_generic_dco_mhz_put
+	};
+	marian->dco_mhz_control = snd_ctl_new1(&c, marian);
+
+	return snd_ctl_add(marian->card, marian->dco_mhz_control);
+}
+
+static int marian_generic_drift_info(struct snd_kcontrol *kcontrol,
+				     struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = -M2_DRIFT_MAX_PPB;
+	uinfo->value.integer.max = M2_DRIFT_MAX_PPB;
+	uinfo->value.integer.step = 1;
+	return 0;
+}
+
+static int marian_generic_drift_get(struct snd_kcontrol *kcontrol,
+				    struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	unsigned long flags;
+
+	spin_lock_irqsave(&marian->lock, flags);
+	ucontrol->value.integer.value[0] = clamp_t(s64, marian->drift_ppb,
+						   -M2_DRIFT_MAX_PPB, M2_DRIFT_MAX_PPB);
+	spin_unlock_irqrestore(&marian->lock, flags);
+
+	return 0;
+}
+
+static int marian_generic_drift_create(struct marian_card *marian, char *label)
+{
+	struct snd_kcontrol_new c = {
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = label,
+		.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+		.info = marian_generic_drift_info,
+		.get = marian_generic_drift_get
+	};
+
+	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
+}
+
 static int marian_control_pcm_loopback_info(struct snd_kcontrol *kcontrol,
 					    struct snd_ctl_elem_info *uinfo)
 {
@@ -443,6 +982,13 @@ static int marian_control_pcm_loopback_put(struct snd_kcontrol *kcontrol,
 
 	marian->loopback = !!ucontrol->value.integer.value[0];
 
+	// Apply right away instead of waiting for the next start
+	spin_lock_irq(&marian->lock);
+	if (marian->running)
+		marian_write(marian, SERAPH_WR_IE_ENABLE,
+			     M2_DISABLE_PLAY_IRQ | (marian->loopback ? M2_ENABLE_LOOPBACK : 0));
+	spin_unlock_irq(&marian->lock);
+
 	return 0;
 }
 
@@ -472,23 +1018,32 @@ static void marian_m2_write_port_frame(struct marian_card *marian)
 	marian_m2_spi_write(marian, 0x42, marian->shadow_42);
 }
 
-static void marian_generic_set_speedmode(struct marian_card *marian, unsigned int rate)
+static void marian_generic_set_clock_range(struct marian_card *marian, unsigned int rate)
 {
-	iowrite32(0x02, marian->iobase + M2_CLOCK_MODE);
+	marian_write(marian, M2_CLOCK_MODE, 0x02);
 
 	if (rate <= 41000)
-		iowrite32(0x02, marian->iobase + M2_VCO_CLOCK_RANGE);
+		marian_write(marian, M2_VCO_CLOCK_RANGE, 0x02);
 	else if (rate <= 82000)
-		iowrite32(0x01, marian->iobase + M2_VCO_CLOCK_RANGE);
+		marian_write(marian, M2_VCO_CLOCK_RANGE, 0x01);
 	else
-		iowrite32(0x00, marian->iobase + M2_VCO_CLOCK_RANGE);
+		marian_write(marian, M2_VCO_CLOCK_RANGE, 0x00);
+}
 
+static void marian_generic_set_speedmode(struct marian_card *marian, unsigned int rate)
+{
+	marian_generic_set_clock_range(marian, rate);
 	marian_generic_set_dco(marian, rate);
 }
 
 static void marian_m2_set_speedmode(struct marian_card *marian, unsigned int rate)
 {
-	marian_generic_set_speedmode(marian, rate);
+	// When slaved the card follows the incoming clock, leave the DCO alone
+	if (marian->clock_source == M2_CLOCK_SRC_DCO)
+		marian_generic_set_speedmode(marian, rate);
+	else
+		marian_generic_set_clock_range(marian, rate);
+
 	marian_m2_write_port_frame(marian);
 }
 
@@ -503,7 +1058,7 @@ static int marian_m2_sync_state_get(struct snd_kcontrol *kcontrol,
 				    struct snd_ctl_elem_value *ucontrol)
 {
 	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
-	u8 v = marian_m2_spi_read(marian, 0x00);
+	u8 v = READ_ONCE(marian->sync_state);
 
 	v = (v >> (kcontrol->private_value * 2)) & 0x3;
 	if (v == 3)
@@ -524,8 +1079,44 @@ static int marian_m2_sync_state_create(struct marian_card *marian, char *label,
 		.info = marian_m2_sync_state_info,
 		.get = marian_m2_sync_state_get
 	};
+	marian->sync_control[idx] = snd_ctl_new1(&c, marian);
 
-	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
+	return snd_ctl_add(marian->card, marian->sync_control[idx]);
+}
+
+static int marian_m2_ext_rate_get(struct snd_kcontrol *kcontrol,
+				  struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = marian->ext_rate;
+
+	return 0;
+}
+
+static int marian_m2_ext_rate_info(struct snd_kcontrol *kcontrol,
+				   struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = FREQ_MAX;
+	uinfo->value.integer.step = 1;
+	return 0;
+}
+
+static int marian_m2_ext_rate_create(struct marian_card *marian)
+{
+	struct snd_kcontrol_new c = {
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "External Rate",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ,
+		.info = marian_m2_ext_rate_info,
+		.get = marian_m2_ext_rate_get
+	};
+	marian->ext_rate_control = snd_ctl_new1(&c, marian);
+
+	return snd_ctl_add(marian->card, marian->ext_rate_control);
 }
 
 static int marian_m2_channel_mode_info(struct snd_kcontrol *kcontrol,
@@ -540,7 +1131,7 @@ static int marian_m2_input_channel_mode_get(struct snd_kcontrol *kcontrol,
 					    struct snd_ctl_elem_value *ucontrol)
 {
 	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
-	u8 v = marian_m2_spi_read(marian, 0x01);
+	u8 v = READ_ONCE(marian->input_modes);
 
 	v = (v >> (kcontrol->private_value * 2)) & 0x1;
 	ucontrol->value.enumerated.item[0] = v;
@@ -574,7 +1165,7 @@ static int marian_m2_input_frame_mode_get(struct snd_kcontrol *kcontrol,
 					  struct snd_ctl_elem_value *ucontrol)
 {
 	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
-	u8 v = marian_m2_spi_read(marian, 0x01);
+	u8 v = READ_ONCE(marian->input_modes);
 
 	v = (v >> ((kcontrol->private_value * 2) + 1)) & 0x1;
 	ucontrol->value.enumerated.item[0] = v;
@@ -604,124 +1195,465 @@ static u8 marian_m2_get_port_mode(struct marian_card *marian, unsigned int port)
 		return (marian->shadow_42 >> M2_PORT1_MODE) & 1;
 }
 
-static int marian_m2_output_channel_mode_get(struct snd_kcontrol *kcontrol,
-					     struct snd_ctl_elem_value *ucontrol)
+/*
+ * Number of channels a MADI port actually carries in the given direction.
+ * Inputs follow the mode detected by the MADI FPGA, outputs the mode we send.
+ */
+static unsigned int marian_m2_port_mode_channels(struct marian_card *marian, int stream,
+						 unsigned int port)
 {
-	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
-
-	ucontrol->value.enumerated.item[0] = marian_m2_get_port_mode(marian,
-								     kcontrol->private_value);
-
-	return 0;
-}
+	u8 v;
 
-static void marian_m2_set_port_mode(struct marian_card *marian, unsigned int port, u8 state)
-{
-	if (port)
-		marian->shadow_42 = (marian->shadow_42 & ~(1 << M2_PORT2_MODE))
-				| state << M2_PORT2_MODE;
+	if (stream == SNDRV_PCM_STREAM_CAPTURE)
+		v = (marian_m2_spi_read(marian, 0x01) >> (port * 2)) & 0x1;
 	else
-		marian->shadow_42 = (marian->shadow_42 & ~(1 << M2_PORT1_MODE))
-				| state << M2_PORT1_MODE;
+		v = marian_m2_get_port_mode(marian, port);
 
-	marian_m2_spi_write(marian, 0x42, marian->shadow_42);
+	return v ? M2_PORT_CHANNELS : M2_PORT_CHANNELS_56;
 }
 
-static int marian_m2_output_channel_mode_put(struct snd_kcontrol *kcontrol,
-					     struct snd_ctl_elem_value *ucontrol)
+// Channels a port takes in the layout, given the channels it carries
+static unsigned int marian_m2_layout_channels(struct marian_card *marian, int stream,
+					      unsigned int port, unsigned int mode)
 {
-	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
-
-	mutex_lock(&marian->reg_mutex);
-	marian_m2_set_port_mode(marian, kcontrol->private_value,
-				ucontrol->value.enumerated.item[0]);
-	mutex_unlock(&marian->reg_mutex);
+	// Port 2 is a copy of port 1, it never reaches the PCM
+	if (stream == SNDRV_PCM_STREAM_CAPTURE && port && marian->redundant)
+		return 0;
 
-	return 0;
+	return marian->compact ? mode : M2_PORT_CHANNELS;
 }
 
-static int marian_m2_output_channel_mode_create(struct marian_card *marian,
-						char *label, u32 idx)
+static void marian_m2_update_layout(struct marian_card *marian, int stream)
 {
-	struct snd_kcontrol_new c = {
-		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
-		.name = label,
-		.private_value = idx,
-		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
-		.info = marian_m2_channel_mode_info,
-		.get = marian_m2_output_channel_mode_get,
-		.put = marian_m2_output_channel_mode_put
-	};
-
-	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
+	unsigned int port;
+
+	for (port = 0; port < 2; port++) {
+		marian->port_modes[stream][port] = marian_m2_port_mode_channels(marian, stream,
+										 port);
+		marian->port_channels[stream][port] =
+			marian_m2_layout_channels(marian, stream, port,
+						  marian->port_modes[stream][port]);
+	}
 }
 
-static int marian_m2_output_frame_mode_info(struct snd_kcontrol *kcontrol,
-					    struct snd_ctl_elem_info *uinfo)
+static unsigned int marian_m2_stream_channels(struct marian_card *marian, int stream)
 {
-	return snd_ctl_boolean_mono_info(kcontrol, uinfo);
+	return marian->port_channels[stream][0] + marian->port_channels[stream][1];
 }
 
-static int marian_m2_output_frame_mode_get(struct snd_kcontrol *kcontrol,
-					   struct snd_ctl_elem_value *ucontrol)
+// Map a PCM channel to its slot in the DMA buffer (port 2 always starts at slot 64)
+static unsigned int marian_m2_channel_slot(struct marian_card *marian, int stream,
+					   unsigned int channel)
 {
-	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	unsigned int port1 = marian->port_channels[stream][0];
 
-	ucontrol->value.enumerated.item[0] = (marian->frame >> kcontrol->private_value) & 1;
+	if (channel < port1)
+		return channel;
 
-	return 0;
+	return M2_PORT_CHANNELS + channel - port1;
 }
 
-static void marian_m2_set_port_frame(struct marian_card *marian, unsigned int port, u8 state)
+// True if a substream of the direction is open, the preview aside
+static bool marian_stream_open(struct marian_card *marian, int stream)
 {
-	marian->frame = (marian->frame & ~(1 << port)) | (state << port);
+	unsigned int i;
 
-	marian_m2_write_port_frame(marian);
+	if (stream == SNDRV_PCM_STREAM_CAPTURE) {
+		for (i = 0; i < M2_CAPTURE_SUBSTREAMS; i++) {
+			if (marian->capture_substream[i])
+				return true;
+		}
+	} else {
+		for (i = 0; i < M2_PLAYBACK_SUBSTREAMS; i++) {
+			if (marian->playback_substream[i])
+				return true;
+		}
+	}
+
+	return false;
 }
 
-static int marian_m2_output_frame_mode_put(struct snd_kcontrol *kcontrol,
-					   struct snd_ctl_elem_value *ucontrol)
+// Playback subdevices above 0 have their own buffer, summed by the driver
+static bool marian_mixed_client(struct snd_pcm_substream *substream)
 {
-	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	return substream->stream == SNDRV_PCM_STREAM_PLAYBACK && substream->number;
+}
 
-	mutex_lock(&marian->reg_mutex);
-	marian_m2_set_port_frame(marian, kcontrol->private_value,
-				 ucontrol->value.enumerated.item[0]);
-	mutex_unlock(&marian->reg_mutex);
+static bool marian_preview(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
 
-	return 0;
+	return substream->pcm == marian->preview_pcm;
 }
 
-static int marian_m2_output_frame_mode_create(struct marian_card *marian, char *label, u32 idx)
+// Substreams numbered across the card, the preview right after the capture subdevices
+static unsigned int marian_substream_index(struct snd_pcm_substream *substream)
 {
-	struct snd_kcontrol_new c = {
-		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
-		.name = label,
-		.private_value = idx,
-		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
-		.info = marian_m2_output_frame_mode_info,
-		.get = marian_m2_output_frame_mode_get,
-		.put = marian_m2_output_frame_mode_put,
-	};
+	if (marian_preview(substream))
+		return SNDRV_PCM_STREAM_CAPTURE * 16 + M2_CAPTURE_SUBSTREAMS;
 
-	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
+	return substream->stream * 16 + substream->number;
 }
 
-static void marian_m2_set_clock_source(struct marian_card *marian, u8 source)
+// Started by the trigger and not stopped since, a cheap check for the interrupt thread
+static bool marian_started(struct marian_card *marian, struct snd_pcm_substream *substream)
 {
-	mutex_lock(&marian->reg_mutex);
-	iowrite32(source, marian->iobase + M2_SET_CLOCK_SRC);
-	marian->clock_source = source;
-	mutex_unlock(&marian->reg_mutex);
+	return READ_ONCE(marian->started) & BIT(marian_substream_index(substream));
 }
 
-static int marian_m2_clock_source_info(struct snd_kcontrol *kcontrol,
-				       struct snd_ctl_elem_info *uinfo)
+/*
+ * Arm mask for one of the M2_ARM_REGS registers. In the compact layout the
+ * upper 8 slots of a 56ch port are left unarmed unless an open stream in
+ * the other direction still uses them.
+ */
+static u32 marian_m2_arm_mask(struct marian_card *marian, unsigned int reg)
 {
-	static const char * const texts[] = {"Internal", "Sync Bus",
-					      "Input Port 1", "Input Port 2"};
+	unsigned int group = reg % (M2_CHANNELS_COUNT / 32);
+	unsigned int port = group / 2;
+	unsigned int limit = 0;
 
-	return snd_ctl_enum_info(uinfo, 1, ARRAY_SIZE(texts), texts);
+	if (!(group & 1))
+		return 0xFFFFFFFF;
+
+	if (marian_stream_open(marian, SNDRV_PCM_STREAM_PLAYBACK))
+		limit = max(limit, marian->port_channels[SNDRV_PCM_STREAM_PLAYBACK][port]);
+	if (marian_stream_open(marian, SNDRV_PCM_STREAM_CAPTURE))
+		limit = max(limit, marian->port_channels[SNDRV_PCM_STREAM_CAPTURE][port]);
+	if (marian->preview_substream)
+		limit = max(limit, marian->preview_ports[port]);
+
+	if (!limit || limit == M2_PORT_CHANNELS)
+		return 0xFFFFFFFF;
+
+	return GENMASK(limit - 32 - 1, 0);
+}
+
+// Channels beyond what their port carried when the layout was taken are silent
+static int marian_m2_chmap_pos(struct marian_card *marian, int stream, unsigned int channel)
+{
+	unsigned int slot = marian_m2_channel_slot(marian, stream, channel);
+
+	if (slot % M2_PORT_CHANNELS >= marian->port_modes[stream][slot / M2_PORT_CHANNELS])
+		return SNDRV_CHMAP_NA;
+
+	return SNDRV_CHMAP_UNKNOWN;
+}
+
+static int marian_m2_chmap_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = M2_CHANNELS_COUNT;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = SNDRV_CHMAP_LAST;
+	return 0;
+}
+
+static int marian_m2_chmap_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	int stream = kcontrol->private_value;
+	unsigned int i;
+
+	memset(ucontrol->value.integer.value, 0, sizeof(long) * M2_CHANNELS_COUNT);
+	for (i = 0; i < marian_m2_stream_channels(marian, stream); i++)
+		ucontrol->value.integer.value[i] = marian_m2_chmap_pos(marian, stream, i);
+
+	return 0;
+}
+
+// The map is fixed by the layout, so advertise exactly the current one
+static int marian_m2_chmap_tlv(struct snd_kcontrol *kcontrol, int op_flag,
+			       unsigned int size, unsigned int __user *tlv)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	int stream = kcontrol->private_value;
+	unsigned int channels = marian_m2_stream_channels(marian, stream);
+	unsigned int i;
+
+	if (size < (channels + 4) * sizeof(unsigned int))
+		return -ENOMEM;
+
+	if (put_user(SNDRV_CTL_TLVT_CONTAINER, tlv) ||
+	    put_user((channels + 2) * sizeof(unsigned int), tlv + 1) ||
+	    put_user(SNDRV_CTL_TLVT_CHMAP_FIXED, tlv + 2) ||
+	    put_user(channels * sizeof(unsigned int), tlv + 3))
+		return -EFAULT;
+
+	for (i = 0; i < channels; i++) {
+		if (put_user(marian_m2_chmap_pos(marian, stream, i), tlv + 4 + i))
+			return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int marian_m2_chmap_create(struct marian_card *marian, char *label, int stream)
+{
+	struct snd_kcontrol_new c = {
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = label,
+		.private_value = stream,
+		.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE
+			| SNDRV_CTL_ELEM_ACCESS_TLV_READ | SNDRV_CTL_ELEM_ACCESS_TLV_CALLBACK,
+		.info = marian_m2_chmap_info,
+		.get = marian_m2_chmap_get,
+		.tlv.c = marian_m2_chmap_tlv,
+	};
+
+	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
+}
+
+static int marian_control_compact_layout_get(struct snd_kcontrol *kcontrol,
+					     struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = marian->compact;
+
+	return 0;
+}
+
+// Takes effect when a substream opens with none of its direction open
+static int marian_control_compact_layout_put(struct snd_kcontrol *kcontrol,
+					     struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	bool on = !!ucontrol->value.integer.value[0];
+	int changed = on != marian->compact;
+
+	marian->compact = on;
+
+	return changed;
+}
+
+static int marian_control_compact_layout_create(struct marian_card *marian)
+{
+	struct snd_kcontrol_new c = {
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "Compact Channel Layout Switch",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = snd_ctl_boolean_mono_info,
+		.get = marian_control_compact_layout_get,
+		.put = marian_control_compact_layout_put,
+	};
+
+	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
+}
+
+static int marian_control_redundant_get(struct snd_kcontrol *kcontrol,
+					struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = READ_ONCE(marian->redundant);
+
+	return 0;
+}
+
+/*
+ * The capture layout and pointer change with it, so it can only be switched
+ * while nothing captures.
+ */
+static int marian_control_redundant_put(struct snd_kcontrol *kcontrol,
+					struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	bool on = !!ucontrol->value.integer.value[0];
+	int err = 1;
+
+	if (on == marian->redundant)
+		return 0;
+
+	mutex_lock(&marian->pcm->open_mutex);
+	mutex_lock(&marian->preview_pcm->open_mutex);
+	if (marian_stream_open(marian, SNDRV_PCM_STREAM_CAPTURE) || marian->preview_substream) {
+		err = -EBUSY;
+		goto unlock;
+	}
+
+	if (!on) {
+		WRITE_ONCE(marian->redundant, false);
+		cancel_delayed_work_sync(&marian->sync_work);
+	}
+	// Port 1 to start with, nothing to copy up to the period the engine is in
+	WRITE_ONCE(marian->redundant_port, 0);
+	WRITE_ONCE(marian->redundant_pos, READ_ONCE(marian->running) ?
+		   rounddown(marian_read(marian, SERAPH_RD_HWPOINTER), M2_PERIOD_FRAMES) : 0);
+	WRITE_ONCE(marian->redundant, on);
+	snd_ctl_notify(marian->card, SNDRV_CTL_EVENT_MASK_VALUE,
+		       &marian->redundant_port_control->id);
+
+unlock:
+	mutex_unlock(&marian->preview_pcm->open_mutex);
+	mutex_unlock(&marian->pcm->open_mutex);
+
+	return err;
+}
+
+static int marian_control_redundant_port_info(struct snd_kcontrol *kcontrol,
+					      struct snd_ctl_elem_info *uinfo)
+{
+	static const char * const texts[] = {"Off", "Input Port 1", "Input Port 2"};
+
+	return snd_ctl_enum_info(uinfo, 1, ARRAY_SIZE(texts), texts);
+}
+
+static int marian_control_redundant_port_get(struct snd_kcontrol *kcontrol,
+					     struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.enumerated.item[0] =
+		READ_ONCE(marian->redundant) ? READ_ONCE(marian->redundant_port) + 1 : 0;
+
+	return 0;
+}
+
+static int marian_control_redundant_create(struct marian_card *marian)
+{
+	struct snd_kcontrol_new sw = {
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "Redundant Input Switch",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = snd_ctl_boolean_mono_info,
+		.get = marian_control_redundant_get,
+		.put = marian_control_redundant_put,
+	};
+	struct snd_kcontrol_new port = {
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "Redundant Input Port",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+		.info = marian_control_redundant_port_info,
+		.get = marian_control_redundant_port_get,
+	};
+	int err;
+
+	marian->redundant_port_control = snd_ctl_new1(&port, marian);
+	err = snd_ctl_add(marian->card, marian->redundant_port_control);
+	if (err < 0)
+		return err;
+
+	return snd_ctl_add(marian->card, snd_ctl_new1(&sw, marian));
+}
+
+static int marian_m2_output_channel_mode_get(struct snd_kcontrol *kcontrol,
+					     struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.enumerated.item[0] = marian_m2_get_port_mode(marian,
+								     kcontrol->private_value);
+
+	return 0;
+}
+
+static void marian_m2_set_port_mode(struct marian_card *marian, unsigned int port, u8 state)
+{
+	if (port)
+		marian->shadow_42 = (marian->shadow_42 & ~(1 << M2_PORT2_MODE))
+				| state << M2_PORT2_MODE;
+	else
+		marian->shadow_42 = (marian->shadow_42 & ~(1 << M2_PORT1_MODE))
+				| state << M2_PORT1_MODE;
+
+	marian_m2_spi_write(marian, 0x42, marian->shadow_42);
+}
+
+static int marian_m2_output_channel_mode_put(struct snd_kcontrol *kcontrol,
+					     struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+
+	mutex_lock(&marian->reg_mutex);
+	marian_m2_set_port_mode(marian, kcontrol->private_value,
+				ucontrol->value.enumerated.item[0]);
+	mutex_unlock(&marian->reg_mutex);
+
+	return 0;
+}
+
+static int marian_m2_output_channel_mode_create(struct marian_card *marian,
+						char *label, u32 idx)
+{
+	struct snd_kcontrol_new c = {
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = label,
+		.private_value = idx,
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = marian_m2_channel_mode_info,
+		.get = marian_m2_output_channel_mode_get,
+		.put = marian_m2_output_channel_mode_put
+	};
+
+	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
+}
+
+static int marian_m2_output_frame_mode_info(struct snd_kcontrol *kcontrol,
+					    struct snd_ctl_elem_info *uinfo)
+{
+	return snd_ctl_boolean_mono_info(kcontrol, uinfo);
+}
+
+static int marian_m2_output_frame_mode_get(struct snd_kcontrol *kcontrol,
+					   struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.enumerated.item[0] = (marian->frame >> kcontrol->private_value) & 1;
+
+	return 0;
+}
+
+static void marian_m2_set_port_frame(struct marian_card *marian, unsigned int port, u8 state)
+{
+	marian->frame = (marian->frame & ~(1 << port)) | (state << port);
+
+	marian_m2_write_port_frame(marian);
+}
+
+static int marian_m2_output_frame_mode_put(struct snd_kcontrol *kcontrol,
+					   struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+
+	mutex_lock(&marian->reg_mutex);
+	marian_m2_set_port_frame(marian, kcontrol->private_value,
+				 ucontrol->value.enumerated.item[0]);
+	mutex_unlock(&marian->reg_mutex);
+
+	return 0;
+}
+
+static int marian_m2_output_frame_mode_create(struct marian_card *marian, char *label, u32 idx)
+{
+	struct snd_kcontrol_new c = {
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = label,
+		.private_value = idx,
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = marian_m2_output_frame_mode_info,
+		.get = marian_m2_output_frame_mode_get,
+		.put = marian_m2_output_frame_mode_put,
+	};
+
+	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
+}
+
+static void marian_m2_set_clock_source(struct marian_card *marian, u8 source)
+{
+	mutex_lock(&marian->reg_mutex);
+	marian_write(marian, M2_SET_CLOCK_SRC, source);
+	marian->clock_source = source;
+	mutex_unlock(&marian->reg_mutex);
+}
+
+static int marian_m2_clock_source_info(struct snd_kcontrol *kcontrol,
+				       struct snd_ctl_elem_info *uinfo)
+{
+	static const char * const texts[] = {"Internal", "Sync Bus",
+					      "Input Port 1", "Input Port 2"};
+
+	return snd_ctl_enum_info(uinfo, 1, ARRAY_SIZE(texts), texts);
 }
 
 static int marian_m2_clock_source_get(struct snd_kcontrol *kcontrol,
@@ -771,6 +1703,10 @@ static int marian_m2_clock_source_put(struct snd_kcontrol *kcontrol,
 		marian_m2_set_clock_source(marian, M2_CLOCK_SRC_MADI2);
 		break;
 	}
+	marian->failback_polls = 0;
+
+	// Pick up the rate of the new source right away
+	mod_delayed_work(system_wq, &marian->monitor_work, 0);
 
 	return 0;
 }
@@ -785,500 +1721,3773 @@ static int marian_m2_clock_source_create(struct marian_card *marian)
 		.get = marian_m2_clock_source_get,
 		.put = marian_m2_clock_source_put,
 	};
+	marian->clock_source_control = snd_ctl_new1(&c, marian);
 
-	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
+	return snd_ctl_add(marian->card, marian->clock_source_control);
 }
 
-static void marian_m2_set_float(struct marian_card *marian, enum m2_num_mode state)
+// Clock source enum items, in the order of marian_m2_clock_source_info()
+static const u8 marian_m2_clock_sources[] = {
+	[CLOCK_SRC_INTERNAL] = M2_CLOCK_SRC_DCO,
+	[CLOCK_SRC_SYNCBUS] = M2_CLOCK_SRC_SYNCBUS,
+	[CLOCK_SRC_INP1] = M2_CLOCK_SRC_MADI1,
+	[CLOCK_SRC_INP2] = M2_CLOCK_SRC_MADI2,
+};
+
+static int marian_m2_clock_priority_info(struct snd_kcontrol *kcontrol,
+					 struct snd_ctl_elem_info *uinfo)
 {
-	marian->shadow_41 = (marian->shadow_41 & ~(1 << M2_INT_FLOAT)) | state << M2_INT_FLOAT;
-	marian_m2_spi_write(marian, 0x41, marian->shadow_41);
+	static const char * const texts[] = {"Internal", "Sync Bus",
+					      "Input Port 1", "Input Port 2"};
+
+	return snd_ctl_enum_info(uinfo, M2_CLOCK_PRIORITIES, ARRAY_SIZE(texts), texts);
 }
 
-static void marian_m2_set_endianness(struct marian_card *marian, enum m2_endianness_mode state)
+static int marian_m2_clock_priority_get(struct snd_kcontrol *kcontrol,
+					struct snd_ctl_elem_value *ucontrol)
 {
-	marian->shadow_41 = (marian->shadow_41 & ~(1 << M2_ENDIANNESS)) | state << M2_ENDIANNESS;
-	marian_m2_spi_write(marian, 0x41, marian->shadow_41);
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	unsigned int i, item;
+
+	mutex_lock(&marian->reg_mutex);
+	for (i = 0; i < M2_CLOCK_PRIORITIES; i++) {
+		for (item = 0; item < ARRAY_SIZE(marian_m2_clock_sources); item++) {
+			if (marian_m2_clock_sources[item] == marian->clock_priority[i])
+				break;
+		}
+		ucontrol->value.enumerated.item[i] = item;
+	}
+	mutex_unlock(&marian->reg_mutex);
+
+	return 0;
+}
+
+static int marian_m2_clock_priority_put(struct snd_kcontrol *kcontrol,
+					struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	u8 priority[M2_CLOCK_PRIORITIES];
+	unsigned int i, item;
+	int changed;
+
+	for (i = 0; i < M2_CLOCK_PRIORITIES; i++) {
+		item = ucontrol->value.enumerated.item[i];
+		if (item >= ARRAY_SIZE(marian_m2_clock_sources))
+			return -EINVAL;
+		priority[i] = marian_m2_clock_sources[item];
+	}
+
+	mutex_lock(&marian->reg_mutex);
+	changed = memcmp(priority, marian->clock_priority, sizeof(priority)) != 0;
+	memcpy(marian->clock_priority, priority, sizeof(priority));
+	marian->failback_polls = 0;
+	mutex_unlock(&marian->reg_mutex);
+
+	return changed;
+}
+
+static int marian_m2_clock_failover_get(struct snd_kcontrol *kcontrol,
+					struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = READ_ONCE(marian->clock_failover);
+
+	return 0;
+}
+
+static int marian_m2_clock_failover_put(struct snd_kcontrol *kcontrol,
+					struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	bool on = !!ucontrol->value.integer.value[0];
+
+	if (on == READ_ONCE(marian->clock_failover))
+		return 0;
+
+	WRITE_ONCE(marian->clock_failover, on);
+	mod_delayed_work(system_wq, &marian->monitor_work, 0);
+
+	return 1;
+}
+
+static int marian_m2_clock_failover_create(struct marian_card *marian)
+{
+	struct snd_kcontrol_new priority = {
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "Sample Clock Priority",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = marian_m2_clock_priority_info,
+		.get = marian_m2_clock_priority_get,
+		.put = marian_m2_clock_priority_put,
+	};
+	struct snd_kcontrol_new failover = {
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "Sample Clock Failover Switch",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = snd_ctl_boolean_mono_info,
+		.get = marian_m2_clock_failover_get,
+		.put = marian_m2_clock_failover_put,
+	};
+	int err;
+
+	err = snd_ctl_add(marian->card, snd_ctl_new1(&priority, marian));
+	if (err < 0)
+		return err;
+
+	return snd_ctl_add(marian->card, snd_ctl_new1(&failover, marian));
+}
+
+static void marian_m2_set_float(struct marian_card *marian, enum m2_num_mode state)
+{
+	marian->shadow_41 = (marian->shadow_41 & ~(1 << M2_INT_FLOAT)) | state << M2_INT_FLOAT;
+	marian_m2_spi_write(marian, 0x41, marian->shadow_41);
+}
+
+static void marian_m2_set_endianness(struct marian_card *marian, enum m2_endianness_mode state)
+{
+	marian->shadow_41 = (marian->shadow_41 & ~(1 << M2_ENDIANNESS)) | state << M2_ENDIANNESS;
+	marian_m2_spi_write(marian, 0x41, marian->shadow_41);
 }
 
 /*
- * Controls:
+ * Monitor routing
  *
- * RO:
- *   - Input 1 sync state (no signal, lock, sync)
- *   - Input 1 channel mode (56/64ch)
- *   - Input 1 frame mode (48/96kHz)
- *   - Input 1 frequency
- *   - Input 2 sync state (no signal, lock, sync)
- *   - Input 2 channel mode (56/64ch)
- *   - Input 2 frame mode (48/96kHz)
- *   - Input 2 frequency
+ * Each route adds an input channel, scaled by its gain, to an output channel.
+ * If a playback stream is running, the routes are mixed into the frames it
+ * commits (from the ack callback), so both end up on the output. Otherwise
+ * the interrupt thread renders the period the hardware just finished with.
+ * Either way a capture frame comes out exactly one buffer later.
  *
- * RW:
- *   - Output 1 channel mode (56/64ch)
- *   - Output 1 frame mode (48/96kHz)
- *   - Output 2 channel mode (56/64ch)
- *   - Output 2 frame mode (48/96kHz)
- *   - Word clock source (Port 1, Port 2, Internal, Sync port, WCK input)
- *   - Speed mode (1, 2, 4FS)
- *   - DCO frequency (1 Hertz)
- *   - DCO frequency (1/1000th)
+ * The mix is a scalar integer loop, so only the integer sample formats are
+ * routed. In float mode the routes are inactive.
  */
-static void marian_m2_create_controls(struct marian_card *marian)
+static bool marian_route_format_ok(struct marian_card *marian)
 {
-	marian_m2_sync_state_create(marian, "Input 1 Sync", M2_INP1_SYNC_CTL_ID);
-	marian_m2_sync_state_create(marian, "Input 2 Sync", M2_INP2_SYNC_CTL_ID);
-	marian_m2_input_channel_mode_create(marian, "Input 1 Channel Mode",
-					    M2_INP1_CM_CTL_ID);
-	marian_m2_input_channel_mode_create(marian, "Input 2 Channel Mode",
-					    M2_INP2_CM_CTL_ID);
-	marian_m2_input_frame_mode_create(marian, "Input 1 Frame Mode",
-					  M2_INP1_FM_CTL_ID);
-	marian_m2_input_frame_mode_create(marian, "Input 2 Frame Mode",
-					  M2_INP2_FM_CTL_ID);
-	marian_generic_frequency_create(marian, "Input 1 Frequency",
-					M2_INP1_FREQ_CTL_ID);
-	marian_generic_frequency_create(marian, "Input 2 Frequency",
-					M2_INP2_FREQ_CTL_ID);
-	marian_m2_output_channel_mode_create(marian, "Output 1 Channel Mode",
-					     M2_OUT1_CM_CTL_ID);
-	marian_m2_output_channel_mode_create(marian, "Output 2 Channel Mode",
-					     M2_OUT2_CM_CTL_ID);
-	marian_m2_output_frame_mode_create(marian, "Output 1 96kHz Frame",
-					   M2_OUT1_FM_CTL_ID);
-	marian_m2_output_frame_mode_create(marian, "Output 2 96kHz Frame",
-					   M2_OUT2_FM_CTL_ID);
-	marian_m2_clock_source_create(marian);
-	marian_generic_dco_int_create(marian, "DCO Freq (Hz)");
-	marian_control_pcm_loopback_create(marian);
+	return !(marian->shadow_41 & (1 << M2_INT_FLOAT));
+}
+
+static inline s32 marian_sample_get(const s32 *p, bool be)
+{
+	return be ? (s32)be32_to_cpu((__force __be32)*p) : (s32)le32_to_cpu((__force __le32)*p);
+}
+
+static inline void marian_sample_put(s32 *p, s32 v, bool be)
+{
+	*p = be ? (__force s32)cpu_to_be32(v) : (__force s32)cpu_to_le32(v);
+}
+
+// dst += src * gain, saturating, four frames at a time
+static void marian_mix_s32(s32 *dst, const s32 *src, unsigned int frames, u32 gain, bool be)
+{
+	s64 acc[4];
+	unsigned int i, j;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		for (j = 0; j < 4; j++)
+			acc[j] = marian_sample_get(dst + i + j, be) +
+				 (((s64)marian_sample_get(src + i + j, be) * gain) >>
+				  M2_ROUTE_GAIN_SHIFT);
+		for (j = 0; j < 4; j++)
+			marian_sample_put(dst + i + j, clamp_t(s64, acc[j], S32_MIN, S32_MAX), be);
+	}
+
+	for (; i < frames; i++) {
+		acc[0] = marian_sample_get(dst + i, be) +
+			 (((s64)marian_sample_get(src + i, be) * gain) >> M2_ROUTE_GAIN_SHIFT);
+		marian_sample_put(dst + i, clamp_t(s64, acc[0], S32_MIN, S32_MAX), be);
+	}
+}
+
+// dst += src, saturating; the same scalar loop as above, without the multiply
+static void marian_add_s32(s32 *dst, const s32 *src, unsigned int frames, bool be)
+{
+	s64 acc[4];
+	unsigned int i, j;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		for (j = 0; j < 4; j++)
+			acc[j] = (s64)marian_sample_get(dst + i + j, be) +
+				 marian_sample_get(src + i + j, be);
+		for (j = 0; j < 4; j++)
+			marian_sample_put(dst + i + j, clamp_t(s64, acc[j], S32_MIN, S32_MAX), be);
+	}
+
+	for (; i < frames; i++) {
+		acc[0] = (s64)marian_sample_get(dst + i, be) + marian_sample_get(src + i, be);
+		marian_sample_put(dst + i, clamp_t(s64, acc[0], S32_MIN, S32_MAX), be);
+	}
+}
+
+/*
+ * Copy the live routes. If dropped is given, the caller owns the ring and
+ * takes over the outputs left to silence as well.
+ */
+static unsigned int marian_routes_snapshot(struct marian_card *marian,
+					   struct marian_route *routes, unsigned long *dropped)
+{
+	unsigned long flags;
+	unsigned int i, n = 0;
+
+	spin_lock_irqsave(&marian->lock, flags);
+	for (i = 0; i < M2_MONITOR_ROUTES; i++) {
+		if (marian->routes[i].src >= 0 && marian->routes[i].gain)
+			routes[n++] = marian->routes[i];
+	}
+	if (dropped) {
+		bitmap_copy(dropped, marian->routes_dropped, M2_CHANNELS_COUNT);
+		bitmap_zero(marian->routes_dropped, M2_CHANNELS_COUNT);
+	}
+	spin_unlock_irqrestore(&marian->lock, flags);
+
+	return n;
+}
+
+static s32 *marian_slot_ptr(struct snd_dma_buffer *buf, unsigned int slot, unsigned int frame)
+{
+	return (s32 *)(buf->area + slot * M2_CHANNEL_BUF_SIZE) + frame;
+}
+
+/*
+ * Mix the monitor routes into playback frames [offset, offset + frames) of
+ * the ring. If clear is set, the ring is the driver's: the routed outputs
+ * are silenced first, and outputs of dropped routes all the way.
+ */
+static void marian_route_render(struct marian_card *marian, unsigned int offset,
+				unsigned int frames, bool clear)
+{
+	struct marian_route routes[M2_MONITOR_ROUTES];
+	DECLARE_BITMAP(dropped, M2_CHANNELS_COUNT);
+	bool be = !(marian->shadow_41 & (1 << M2_ENDIANNESS));
+	unsigned int i, n;
+
+	n = marian_routes_snapshot(marian, routes, clear ? dropped : NULL);
+
+	if (clear) {
+		for_each_set_bit(i, dropped, M2_CHANNELS_COUNT)
+			memset(marian_slot_ptr(&marian->playback_buf, i, 0), 0,
+			       M2_CHANNEL_BUF_SIZE);
+	}
+
+	if (!marian_route_format_ok(marian))
+		return;
+
+	if (clear) {
+		for (i = 0; i < n; i++)
+			memset(marian_slot_ptr(&marian->playback_buf, routes[i].dst, offset), 0,
+			       frames * sizeof(s32));
+	}
+
+	for (i = 0; i < n; i++)
+		marian_mix_s32(marian_slot_ptr(&marian->playback_buf, routes[i].dst, offset),
+			       marian_slot_ptr(&marian->capture_buf, routes[i].src, offset),
+			       frames, routes[i].gain, be);
+}
+
+// Add the staged sum of the mixed clients to frames the direct client committed
+static void marian_mix_bus_add(struct marian_card *marian, unsigned int offset,
+			       unsigned int frames)
+{
+	bool be = !(marian->shadow_41 & (1 << M2_ENDIANNESS));
+	unsigned int ch, slot, chunk, channels;
+
+	channels = marian_m2_stream_channels(marian, SNDRV_PCM_STREAM_PLAYBACK);
+
+	while (frames > 0) {
+		chunk = min_t(unsigned int, frames, M2_PERIOD_FRAMES - offset % M2_PERIOD_FRAMES);
+		if (READ_ONCE(marian->mix_live[offset / M2_PERIOD_FRAMES])) {
+			for (ch = 0; ch < channels; ch++) {
+				slot = marian_m2_channel_slot(marian, SNDRV_PCM_STREAM_PLAYBACK, ch);
+				if (slot >= M2_CHANNELS_COUNT)
+					break;
+				marian_add_s32(marian_slot_ptr(&marian->playback_buf, slot, offset),
+					       marian_slot_ptr(&marian->mix_buf, slot, offset),
+					       chunk, be);
+			}
+		}
+		offset += chunk;
+		frames -= chunk;
+	}
+}
+
+// Mix the routes into whatever the playback stream committed since last time
+static void marian_route_playback_ack(struct marian_card *marian,
+				      struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	snd_pcm_uframes_t appl = runtime->control->appl_ptr;
+	snd_pcm_sframes_t frames = appl - marian->routed_appl_ptr;
+	unsigned int offset, chunk;
+
+	if (frames < 0)
+		frames += runtime->boundary;
+
+	// Rewound, or more than a buffer behind: only the newest data matters
+	if (frames > runtime->buffer_size) {
+		if (frames > runtime->boundary / 2) {
+			marian->routed_appl_ptr = appl;
+			return;
+		}
+		frames = runtime->buffer_size;
+	}
+
+	offset = (appl - frames) % runtime->buffer_size;
+	while (frames > 0) {
+		chunk = min_t(unsigned int, frames, runtime->buffer_size - offset);
+		marian_mix_bus_add(marian, offset, chunk);
+		marian_route_render(marian, offset, chunk, false);
+		offset = 0;
+		frames -= chunk;
+	}
+
+	marian->routed_appl_ptr = appl;
+}
+
+/*
+ * Sum the period of a mixed client into frames [offset, offset + period) of
+ * dst. A client without a full period left underruns: it is skipped and
+ * still advanced, so the core stops it at period_elapsed() with an xrun of
+ * its own while the others keep playing. Its format is the card's, see
+ * snd_marian_hw_params().
+ */
+static void marian_mix_client(struct marian_card *marian, struct snd_pcm_substream *substream,
+			      struct snd_dma_buffer *dst, unsigned int offset)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct snd_dma_buffer *src = &marian->client_buf[substream->number];
+	unsigned int pos = marian->mix_pos[substream->number];
+	bool be = snd_pcm_format_big_endian(runtime->format) > 0;
+	unsigned int ch, slot;
+
+	if (snd_pcm_playback_hw_avail(runtime) >= M2_PERIOD_FRAMES) {
+		for (ch = 0; ch < runtime->channels; ch++) {
+			slot = marian_m2_channel_slot(marian, SNDRV_PCM_STREAM_PLAYBACK, ch);
+			if (slot >= M2_CHANNELS_COUNT)
+				break;
+			marian_add_s32(marian_slot_ptr(dst, slot, offset),
+				       marian_slot_ptr(src, slot, pos), M2_PERIOD_FRAMES, be);
+		}
+	}
+
+	WRITE_ONCE(marian->mix_pos[substream->number],
+		   (pos + M2_PERIOD_FRAMES) % runtime->buffer_size);
+}
+
+// Silence frames [offset, offset + period) of every slot in the playback layout
+static void marian_mix_clear(struct marian_card *marian, struct snd_dma_buffer *buf,
+			     unsigned int offset)
+{
+	unsigned int ch, channels = marian_m2_stream_channels(marian, SNDRV_PCM_STREAM_PLAYBACK);
+
+	for (ch = 0; ch < channels; ch++)
+		memset(marian_slot_ptr(buf, marian_m2_channel_slot(marian, SNDRV_PCM_STREAM_PLAYBACK,
+								   ch), offset),
+		       0, M2_PERIOD_FRAMES * sizeof(s32));
+}
+
+/*
+ * Sum the running mixed clients into the period at offset of buf. Returns
+ * false without touching buf if none of them is running.
+ */
+static bool marian_mix_clients(struct marian_card *marian, struct snd_dma_buffer *buf,
+			       unsigned int offset)
+{
+	struct snd_pcm_substream *substream;
+	bool cleared = false;
+	unsigned int i;
+
+	for (i = 1; i < M2_PLAYBACK_SUBSTREAMS; i++) {
+		substream = READ_ONCE(marian->playback_substream[i]);
+		if (!substream || !marian_started(marian, substream))
+			continue;
+
+		if (!cleared) {
+			marian_mix_clear(marian, buf, offset);
+			cleared = true;
+		}
+		marian_mix_client(marian, substream, buf, offset);
+	}
+
+	return cleared;
+}
+
+/*
+ * The hardware has just left one half of the ring, which it plays again
+ * after the one it entered. Without a direct client the driver owns that
+ * half and fills it with the mixed clients and the monitor routes. With one,
+ * the mix is staged in mix_buf and added by the direct client's ack, since
+ * it writes that half only from now on.
+ */
+static void marian_playback_period(struct marian_card *marian, u32 ptr)
+{
+	struct snd_pcm_substream *direct = READ_ONCE(marian->playback_substream[0]);
+	unsigned int left = ptr < M2_PERIOD_FRAMES ? M2_PERIOD_FRAMES : 0;
+	unsigned int slot;
+	bool mixed, stale;
+
+	if (direct && marian_started(marian, direct)) {
+		mixed = marian_mix_clients(marian, &marian->mix_buf, left);
+		WRITE_ONCE(marian->mix_live[left / M2_PERIOD_FRAMES], mixed);
+		return;
+	}
+
+	mixed = marian_mix_clients(marian, &marian->playback_buf, left);
+
+	spin_lock_irq(&marian->lock);
+	stale = marian->playback_stale;
+	if (stale)
+		marian->playback_stale--;
+	spin_unlock_irq(&marian->lock);
+
+	// Otherwise the hardware would play the last buffer over and over
+	if (!mixed && stale) {
+		for (slot = 0; slot < M2_CHANNELS_COUNT; slot++)
+			memset(marian_slot_ptr(&marian->playback_buf, slot, left), 0,
+			       M2_PERIOD_FRAMES * sizeof(s32));
+	}
+
+	marian_route_render(marian, left, M2_PERIOD_FRAMES, !mixed);
+}
+
+static int marian_control_route_info(struct snd_kcontrol *kcontrol,
+				     struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 3;
+	uinfo->value.integer.min = -1;
+	uinfo->value.integer.max = M2_ROUTE_GAIN_MAX;
+	uinfo->value.integer.step = 1;
+	return 0;
+}
+
+static int marian_control_route_get(struct snd_kcontrol *kcontrol,
+				    struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	unsigned int idx = snd_ctl_get_ioffidx(kcontrol, &ucontrol->id);
+
+	spin_lock_irq(&marian->lock);
+	ucontrol->value.integer.value[0] = marian->routes[idx].src;
+	ucontrol->value.integer.value[1] = marian->routes[idx].dst;
+	ucontrol->value.integer.value[2] = marian->routes[idx].gain;
+	spin_unlock_irq(&marian->lock);
+
+	return 0;
+}
+
+static int marian_control_route_put(struct snd_kcontrol *kcontrol,
+				    struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	unsigned int idx = snd_ctl_get_ioffidx(kcontrol, &ucontrol->id);
+	long src = ucontrol->value.integer.value[0];
+	long dst = ucontrol->value.integer.value[1];
+	long gain = ucontrol->value.integer.value[2];
+	struct marian_route old;
+
+	if (src < -1 || src >= M2_CHANNELS_COUNT || dst < 0 || dst >= M2_CHANNELS_COUNT ||
+	    gain < 0 || gain > M2_ROUTE_GAIN_MAX)
+		return -EINVAL;
+
+	spin_lock_irq(&marian->lock);
+	old = marian->routes[idx];
+	marian->routes[idx].src = src;
+	marian->routes[idx].dst = dst;
+	marian->routes[idx].gain = gain;
+	// Only live routes are rendered, so a dropped output has to be silenced
+	if (old.src >= 0 && (old.dst != dst || src < 0))
+		__set_bit(old.dst, marian->routes_dropped);
+	spin_unlock_irq(&marian->lock);
+
+	return old.src != src || old.dst != dst || old.gain != gain;
+}
+
+static int marian_control_route_create(struct marian_card *marian)
+{
+	struct snd_kcontrol_new c = {
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "Monitor Route",
+		.count = M2_MONITOR_ROUTES,
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = marian_control_route_info,
+		.get = marian_control_route_get,
+		.put = marian_control_route_put,
+	};
+
+	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
+}
+
+/*
+ * Input metering
+ *
+ * Peak and RMS of every input slot over the period just captured, scaled to
+ * a full scale of S32_MAX. Scanning 128 periods is too much for the interrupt
+ * handler, so it only notes the period and leaves the scan to a work item.
+ */
+
+// |x| of an IEEE single as a 1.31 fixed point value, saturated at 1.0
+static u32 marian_float_abs_q31(u32 bits)
+{
+	int exp = (bits >> 23) & 0xFF;
+	u32 mant = (bits & 0x7FFFFF) | 0x800000;
+
+	if (exp >= 127)
+		return S32_MAX;
+	if (exp >= 119)
+		return mant << (exp - 119);
+	if (exp < 119 - 23)
+		return 0;
+	return mant >> (119 - exp);
+}
+
+static u32 marian_sample_abs(const s32 *p, bool be, bool fl)
+{
+	u32 v = be ? be32_to_cpu((__force __be32)*p) : le32_to_cpu((__force __le32)*p);
+
+	if (fl)
+		return marian_float_abs_q31(v);
+
+	return (s32)v == S32_MIN ? S32_MAX : abs((s32)v);
+}
+
+static void marian_meter_work(struct work_struct *work)
+{
+	struct marian_card *marian = container_of(work, struct marian_card, meter_work);
+	bool be = !(marian->shadow_41 & (1 << M2_ENDIANNESS));
+	bool fl = marian->shadow_41 & (1 << M2_INT_FLOAT);
+	unsigned int offset = READ_ONCE(marian->meter_offset);
+	unsigned int ch, i;
+	const s32 *p;
+	u32 peak, v;
+	u64 sum;
+
+	for (ch = 0; ch < M2_CHANNELS_COUNT; ch++) {
+		p = marian_slot_ptr(&marian->capture_buf, ch, offset);
+		peak = 0;
+		sum = 0;
+
+		for (i = 0; i < M2_PERIOD_FRAMES; i++) {
+			v = marian_sample_abs(p + i, be, fl);
+			peak = max(peak, v);
+			// 23 bits squared, so 2048 of them can't overflow
+			sum += (u64)(v >> 8) * (v >> 8);
+		}
+
+		WRITE_ONCE(marian->meter_peak[ch], peak);
+		WRITE_ONCE(marian->meter_rms[ch],
+			   int_sqrt64(div_u64(sum, M2_PERIOD_FRAMES)) << 8);
+	}
+}
+
+static void marian_meter_period(struct marian_card *marian, u32 ptr)
+{
+	if (!marian->meters_enabled)
+		return;
+
+	WRITE_ONCE(marian->meter_offset, ptr < M2_PERIOD_FRAMES ? M2_PERIOD_FRAMES : 0);
+
+	/*
+	 * A scan not yet started takes this period instead of the previous
+	 * one. A scan still running gets queued again, for this period.
+	 */
+	queue_work(system_highpri_wq, &marian->meter_work);
+}
+
+/*
+ * Preview capture
+ *
+ * A reduced copy of the capture ring for monitoring: every period of every
+ * channel goes through a 48 tap low-pass at 0.1 of the card rate, of which
+ * every fourth output is kept, rounded to 16 bit. That is an eighth of the
+ * bandwidth of the ring. The filter is a scalar integer loop, run in a
+ * work item so the interrupt thread doesn't pay for it.
+ */
+
+// Q15, symmetric: the first half, summing to 0.5 with the second
+static const s16 marian_preview_taps[M2_PREVIEW_TAPS / 2] = {
+	0, 1, 3, 2, -5, -21, -42, -51, -28, 40, 145, 243,
+	262, 131, -170, -575, -912, -947, -468, 617, 2203, 3985, 5534, 6437,
+};
+
+// A sample as signed 1.31 fixed point, floats converted as for the meters
+static s32 marian_sample_q31(const s32 *p, bool be, bool fl)
+{
+	u32 v = be ? be32_to_cpu((__force __be32)*p) : le32_to_cpu((__force __le32)*p);
+
+	if (!fl)
+		return v;
+
+	return v & BIT(31) ? -(s32)marian_float_abs_q31(v) : marian_float_abs_q31(v);
+}
+
+/*
+ * One channel of a period through the filter. in holds the last inputs of
+ * the previous period followed by this one; out is interleaved, stride
+ * samples apart. Each pair of inputs sharing a tap takes one multiply.
+ */
+static void marian_preview_fir(const s16 *in, s16 *out, unsigned int stride)
+{
+	const s16 *w;
+	unsigned int n, k;
+	s32 acc;
+
+	for (n = 0; n < M2_PREVIEW_PERIOD; n++) {
+		w = in + n * M2_PREVIEW_DECIMATION + M2_PREVIEW_DECIMATION - 1;
+		acc = 1 << 14;
+		for (k = 0; k < M2_PREVIEW_TAPS / 2; k++)
+			acc += marian_preview_taps[k] * (w[k] + w[M2_PREVIEW_TAPS - 1 - k]);
+		out[n * stride] = clamp(acc >> 15, S16_MIN, S16_MAX);
+	}
+}
+
+static void marian_preview_work(struct work_struct *work)
+{
+	struct marian_card *marian = container_of(work, struct marian_card, preview_work);
+	struct snd_pcm_substream *substream = READ_ONCE(marian->preview_substream);
+	bool be = !(marian->shadow_41 & (1 << M2_ENDIANNESS));
+	bool fl = marian->shadow_41 & (1 << M2_INT_FLOAT);
+	unsigned int port1 = marian->preview_ports[0];
+	unsigned int offset;
+	struct snd_pcm_runtime *runtime;
+	u64 due;
+	unsigned int ch, slot, i;
+	s16 *in = marian->preview_in;
+	const s32 *p;
+	s16 *out;
+
+	if (!substream || !snd_pcm_running(substream))
+		return;
+
+	spin_lock_irq(&marian->lock);
+	offset = marian->preview_offset;
+	due = marian->preview_due;
+	spin_unlock_irq(&marian->lock);
+
+	/*
+	 * The interrupt thread and the work both run once for however many
+	 * periods came meanwhile. Only the last of them is still in the ring,
+	 * the others are lost to the preview.
+	 */
+	if (due == marian->preview_done)
+		return;
+	if (marian->preview_done && due - marian->preview_done > M2_PERIOD_FRAMES) {
+		marian->preview_done = due;
+		snd_pcm_stop_xrun(substream);
+		return;
+	}
+	marian->preview_done = due;
+
+	runtime = substream->runtime;
+	out = (s16 *)runtime->dma_area + marian->preview_pos * runtime->channels;
+
+	for (ch = 0; ch < runtime->channels; ch++) {
+		slot = ch < port1 ? ch : M2_PORT_CHANNELS + ch - port1;
+		p = marian_slot_ptr(&marian->capture_buf, slot, offset);
+
+		memcpy(in, marian->preview_hist[slot], sizeof(marian->preview_hist[slot]));
+		for (i = 0; i < M2_PERIOD_FRAMES; i++)
+			in[M2_PREVIEW_TAPS - 1 + i] = marian_sample_q31(p + i, be, fl) >> 16;
+		memcpy(marian->preview_hist[slot], in + M2_PERIOD_FRAMES,
+		       sizeof(marian->preview_hist[slot]));
+
+		marian_preview_fir(in, out + ch, runtime->channels);
+	}
+
+	WRITE_ONCE(marian->preview_pos,
+		   (marian->preview_pos + M2_PREVIEW_PERIOD) % runtime->buffer_size);
+
+	// A preview reader falling behind is its own xrun, not one of the card
+	snd_pcm_period_elapsed(substream);
+}
+
+// Takes the latest period afresh, so the half and its frame go together
+static void marian_preview_period(struct marian_card *marian)
+{
+	struct snd_pcm_substream *substream = READ_ONCE(marian->preview_substream);
+
+	if (!substream || !marian_started(marian, substream))
+		return;
+
+	spin_lock_irq(&marian->lock);
+	marian->preview_offset = marian->period_ptr < M2_PERIOD_FRAMES ? M2_PERIOD_FRAMES : 0;
+	marian->preview_due = marian->frames;
+	spin_unlock_irq(&marian->lock);
+	queue_work(system_highpri_wq, &marian->preview_work);
+}
+
+static int marian_control_meter_info(struct snd_kcontrol *kcontrol,
+				     struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = M2_CHANNELS_COUNT;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = S32_MAX;
+	uinfo->value.integer.step = 1;
+	return 0;
+}
+
+static int marian_control_meter_get(struct snd_kcontrol *kcontrol,
+				    struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	u32 *values = kcontrol->private_value ? marian->meter_rms : marian->meter_peak;
+	unsigned int i;
+
+	for (i = 0; i < M2_CHANNELS_COUNT; i++)
+		ucontrol->value.integer.value[i] = READ_ONCE(values[i]);
+
+	return 0;
+}
+
+static int marian_control_meter_create(struct marian_card *marian, char *label, u32 rms)
+{
+	struct snd_kcontrol_new c = {
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = label,
+		.private_value = rms,
+		.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+		.info = marian_control_meter_info,
+		.get = marian_control_meter_get,
+	};
+
+	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
+}
+
+static int marian_control_meter_switch_get(struct snd_kcontrol *kcontrol,
+					   struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = marian->meters_enabled;
+
+	return 0;
+}
+
+static int marian_control_meter_switch_put(struct snd_kcontrol *kcontrol,
+					   struct snd_ctl_elem_value *ucontrol)
+{
+	struct marian_card *marian = snd_kcontrol_chip(kcontrol);
+	bool enable = !!ucontrol->value.integer.value[0];
+
+	if (!enable && marian->meters_enabled) {
+		WRITE_ONCE(marian->meters_enabled, false);
+		cancel_work_sync(&marian->meter_work);
+		memset(marian->meter_peak, 0, sizeof(marian->meter_peak));
+		memset(marian->meter_rms, 0, sizeof(marian->meter_rms));
+	}
+	WRITE_ONCE(marian->meters_enabled, enable);
+
+	return 0;
+}
+
+static int marian_control_meter_switch_create(struct marian_card *marian)
+{
+	struct snd_kcontrol_new c = {
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "Input Meter Switch",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = snd_ctl_boolean_mono_info,
+		.get = marian_control_meter_switch_get,
+		.put = marian_control_meter_switch_put,
+	};
+
+	return snd_ctl_add(marian->card, snd_ctl_new1(&c, marian));
+}
+
+/*
+ * Controls:
+ *
+ * RO:
+ *   - Input 1 sync state (no signal, lock, sync)
+ *   - Input 1 channel mode (56/64ch)
+ *   - Input 1 frame mode (48/96kHz)
+ *   - Input 1 frequency
+ *   - Input 2 sync state (no signal, lock, sync)
+ *   - Input 2 channel mode (56/64ch)
+ *   - Input 2 frame mode (48/96kHz)
+ *   - Input 2 frequency
+ *   - External rate (snapped rate of the selected clock source, 0 if internal)
+ *   - Sample clock drift against the system clock (ppb)
+ *   - Input peak and RMS per channel over the last period
+ *
+ * RW:
+ *   - Output 1 channel mode (56/64ch)
+ *   - Output 1 frame mode (48/96kHz)
+ *   - Output 2 channel mode (56/64ch)
+ *   - Output 2 frame mode (48/96kHz)
+ *   - Word clock source (Port 1, Port 2, Internal, Sync port, WCK input)
+ *   - Clock failover on/off and the sources it may use, in order of preference
+ *   - Speed mode (1, 2, 4FS)
+ *   - DCO frequency (1 Hertz)
+ *   - DCO frequency (1/1000th)
+ *   - Compact channel layout (follow the 56/64ch port modes)
+ *   - Redundant input on/off, and the port capture is taken from
+ *   - Monitor routes (input channel, output channel, gain), 64 of them
+ *   - Input metering on/off
+ *
+ * PCM:
+ *   - Playback/capture channel maps
+ */
+static void marian_m2_create_controls(struct marian_card *marian)
+{
+	marian_m2_sync_state_create(marian, "Input 1 Sync", M2_INP1_SYNC_CTL_ID);
+	marian_m2_sync_state_create(marian, "Input 2 Sync", M2_INP2_SYNC_CTL_ID);
+	marian_m2_input_channel_mode_create(marian, "Input 1 Channel Mode",
+					    M2_INP1_CM_CTL_ID);
+	marian_m2_input_channel_mode_create(marian, "Input 2 Channel Mode",
+					    M2_INP2_CM_CTL_ID);
+	marian_m2_input_frame_mode_create(marian, "Input 1 Frame Mode",
+					  M2_INP1_FM_CTL_ID);
+	marian_m2_input_frame_mode_create(marian, "Input 2 Frame Mode",
+					  M2_INP2_FM_CTL_ID);
+	marian_generic_frequency_create(marian, "Input 1 Frequency",
+					M2_INP1_FREQ_CTL_ID);
+	marian_generic_frequency_create(marian, "Input 2 Frequency",
+					M2_INP2_FREQ_CTL_ID);
+	marian_m2_output_channel_mode_create(marian, "Output 1 Channel Mode",
+					     M2_OUT1_CM_CTL_ID);
+	marian_m2_output_channel_mode_create(marian, "Output 2 Channel Mode",
+					     M2_OUT2_CM_CTL_ID);
+	marian_m2_output_frame_mode_create(marian, "Output 1 96kHz Frame",
+					   M2_OUT1_FM_CTL_ID);
+	marian_m2_output_frame_mode_create(marian, "Output 2 96kHz Frame",
+					   M2_OUT2_FM_CTL_ID);
+	marian_m2_clock_source_create(marian);
+	marian_m2_clock_failover_create(marian);
+	marian_m2_ext_rate_create(marian);
+	marian_generic_dco_int_create(marian, "DCO Freq (Hz)");
+	marian_generic_dco_mhz_create(marian, "DCO Freq (mHz)");
+	marian_generic_drift_create(marian, "DCO Drift (ppb)");
+	marian_control_pcm_loopback_create(marian);
+	marian_control_compact_layout_create(marian);
+	marian_control_redundant_create(marian);
+	marian_control_route_create(marian);
+	marian_control_meter_switch_create(marian);
+	marian_control_meter_create(marian, "Input Peak", 0);
+	marian_control_meter_create(marian, "Input RMS", 1);
+	marian_m2_chmap_create(marian, "Playback Channel Map", SNDRV_PCM_STREAM_PLAYBACK);
+	marian_m2_chmap_create(marian, "Capture Channel Map", SNDRV_PCM_STREAM_CAPTURE);
+
+	marian->is_controls_initialized = true;
+}
+
+/*
+ * Period fences of the exported rings. A fence may outlive the card in an
+ * importer's hands, so each carries its own lock.
+ */
+struct marian_fence {
+	struct dma_fence base;
+	spinlock_t lock;
+};
+
+/*
+ * The DMA buffer, refcounted apart from the card: an exported ring keeps it
+ * until the importer lets go, without holding up snd_card_free(). Exports
+ * are listed under lock and know nothing of the card, so there is nothing
+ * to revoke when it goes.
+ */
+struct marian_dma_mem {
+	struct kref ref;
+	struct snd_dma_buffer buf;
+	struct mutex lock;
+	struct list_head exports;
+	unsigned int export_count;
+};
+
+struct marian_export {
+	struct marian_dma_mem *mem;
+	struct dma_buf *dmabuf;
+	struct snd_dma_buffer buf;
+	int stream;
+	struct list_head list;
+};
+
+static void marian_dma_mem_release(struct kref *ref)
+{
+	struct marian_dma_mem *mem = container_of(ref, struct marian_dma_mem, ref);
+
+	if (mem->buf.area)
+		snd_dma_free_pages(&mem->buf);
+	kfree(mem);
+}
+
+static void marian_dma_mem_put(struct marian_dma_mem *mem)
+{
+	if (mem)
+		kref_put(&mem->ref, marian_dma_mem_release);
+}
+
+static const char *marian_fence_driver_name(struct dma_fence *fence)
+{
+	return "marian";
+}
+
+static const char *marian_fence_timeline_name(struct dma_fence *fence)
+{
+	return "period";
+}
+
+static const struct dma_fence_ops marian_fence_ops = {
+	.get_driver_name = marian_fence_driver_name,
+	.get_timeline_name = marian_fence_timeline_name,
+};
+
+/*
+ * Signal the fence of the period in progress, if any. This is the fence
+ * signalling path: it neither allocates nor takes a reservation lock, an
+ * importer may hold one while it waits for the fence.
+ */
+static void marian_fence_signal(struct marian_card *marian)
+{
+	struct dma_fence *fence;
+	unsigned long flags;
+	bool cookie;
+
+	cookie = dma_fence_begin_signalling();
+	spin_lock_irqsave(&marian->lock, flags);
+	fence = marian->period_fence;
+	marian->period_fence = NULL;
+	spin_unlock_irqrestore(&marian->lock, flags);
+
+	if (fence)
+		dma_fence_signal(fence);
+	dma_fence_end_signalling(cookie);
+
+	if (fence)
+		dma_fence_put(fence);
+}
+
+static struct dma_fence *marian_fence_create(struct marian_card *marian)
+{
+	struct marian_fence *fence;
+
+	fence = kzalloc(sizeof(*fence), GFP_KERNEL);
+	if (!fence)
+		return NULL;
+	spin_lock_init(&fence->lock);
+	dma_fence_init(&fence->base, &marian_fence_ops, &fence->lock, marian->fence_context,
+		       atomic64_inc_return(&marian->fence_seqno));
+
+	return &fence->base;
+}
+
+// Put a fence on the reservation object of every exported ring
+static void marian_fence_install(struct marian_card *marian, struct dma_fence *fence)
+{
+	struct marian_dma_mem *mem = marian->dma_mem;
+	struct marian_export *exp;
+	struct dma_resv *resv;
+
+	mutex_lock(&mem->lock);
+	list_for_each_entry(exp, &mem->exports, list) {
+		resv = exp->dmabuf->resv;
+		dma_resv_lock(resv, NULL);
+		if (!dma_resv_reserve_fences(resv, 1))
+			dma_resv_add_fence(resv, fence, exp->stream == SNDRV_PCM_STREAM_CAPTURE ?
+					   DMA_RESV_USAGE_WRITE : DMA_RESV_USAGE_READ);
+		dma_resv_unlock(resv);
+	}
+	mutex_unlock(&mem->lock);
+}
+
+static bool marian_fence_needed(struct marian_card *marian)
+{
+	bool needed;
+
+	spin_lock_irq(&marian->lock);
+	needed = marian->running && !marian->period_fence;
+	spin_unlock_irq(&marian->lock);
+
+	return needed;
+}
+
+/*
+ * Create the fence of the period in progress if there is none yet, and put
+ * it on every exported ring. Queued at every period, at the engine start
+ * and for a new export, so the allocation and the reservation locks stay
+ * out of the signalling path. A fence signalled meanwhile is harmless to
+ * add, the period after it gets one of its own.
+ */
+static void marian_export_work(struct work_struct *work)
+{
+	struct marian_card *marian = container_of(work, struct marian_card, export_work);
+	struct dma_fence *fence, *new = NULL;
+
+	if (marian_fence_needed(marian))
+		new = marian_fence_create(marian);
+
+	spin_lock_irq(&marian->lock);
+	if (new && marian->running && !marian->period_fence) {
+		marian->period_fence = new;
+		new = NULL;
+	}
+	fence = marian->period_fence ? dma_fence_get(marian->period_fence) : NULL;
+	spin_unlock_irq(&marian->lock);
+
+	// Lost the race, never seen by anyone, so it needn't be signalled
+	if (new)
+		dma_fence_put(new);
+
+	if (fence) {
+		marian_fence_install(marian, fence);
+		dma_fence_put(fence);
+	}
+}
+
+/*
+ * The period just completed is signalled first; the fence of the next one
+ * follows from export_work. A waiter polling again in between finds the
+ * ring ready for the same period once more, the status page tells.
+ */
+static void marian_export_period(struct marian_card *marian)
+{
+	marian_fence_signal(marian);
+
+	if (READ_ONCE(marian->dma_mem->export_count))
+		queue_work(system_highpri_wq, &marian->export_work);
+}
+
+static void snd_marian_card_free(struct snd_card *card)
+{
+	struct marian_card *marian = card->private_data;
+	unsigned int i;
+
+	if (!marian)
+		return;
+
+	cancel_delayed_work_sync(&marian->clock_watchdog);
+	cancel_delayed_work_sync(&marian->monitor_work);
+	cancel_work_sync(&marian->meter_work);
+	cancel_delayed_work_sync(&marian->sync_work);
+	cancel_work_sync(&marian->preview_work);
+	// An importer waiting under its reservation lock would hold up the work
+	marian_fence_signal(marian);
+	cancel_work_sync(&marian->export_work);
+	marian_fence_signal(marian);
+
+	debugfs_remove_recursive(marian->debugfs);
+	kfree(marian->rec);
+
+	if (marian->hwdep)
+		hrtimer_cancel(&marian->start_timer);
+
+	if (marian->sim) {
+		hrtimer_cancel(&marian->sim->timer);
+		cancel_work_sync(&marian->sim->irq_work);
+		kfree(marian->sim);
+	}
+
+	// Exported rings may keep the memory a while longer
+	marian_dma_mem_put(marian->dma_mem);
+	for (i = 0; i < M2_PLAYBACK_SUBSTREAMS; i++) {
+		if (marian->client_buf[i].area)
+			snd_dma_free_pages(&marian->client_buf[i]);
+	}
+	if (marian->mix_buf.area)
+		snd_dma_free_pages(&marian->mix_buf);
+	if (marian->preview_buf.area)
+		snd_dma_free_pages(&marian->preview_buf);
+	free_page((unsigned long)marian->status);
+
+	if (marian->irq >= 0)
+		free_irq(marian->irq, (void *)marian);
+
+	if (marian->iobase)
+		pci_iounmap(marian->pci, marian->iobase);
+
+	if (marian->port)
+		pci_release_regions(marian->pci);
+
+	if (marian->pci)
+		pci_disable_device(marian->pci);
+}
+
+static void marian_proc_status_generic(struct marian_card *marian, struct snd_info_buffer *buffer)
+{
+	snd_iprintf(buffer, "*** Card registers\n");
+	snd_iprintf(buffer, "RD 0x064: %08x (SPI bits written)\n", marian_read(marian, 0x64));
+	snd_iprintf(buffer, "RD 0x068: %08x (SPI bits read)\n", marian_read(marian, 0x68));
+	snd_iprintf(buffer, "RD 0x070: %08x (SPI bits status)\n", marian_read(marian, 0x70));
+	snd_iprintf(buffer, "RD 0x088: %08x (Super clock measurement)\n",
+		    marian_read(marian, 0x88));
+	snd_iprintf(buffer, "RD 0x08C: %08x (HW Pointer)\n",
+		    marian_read(marian, SERAPH_RD_HWPOINTER));
+	snd_iprintf(buffer, "RD 0x094: %08x (Word clock measurement)\n",
+		    marian_read(marian, 0x88));
+	snd_iprintf(buffer, "RD 0x0F8: %08x (Extension board)\n",
+		    marian_read(marian, 0xF8));
+	snd_iprintf(buffer, "RD 0x244: %08x (DMA debug)\n",
+		    marian_read(marian, M2_DMA_DEBUG));
+
+	snd_iprintf(buffer, "\n*** Card status\n");
+	snd_iprintf(buffer, "Firmware build: %08x\n", marian->firmware);
+	snd_iprintf(buffer, "Clock master : %s\n", (marian->clock_source == 1) ? "yes" : "no");
+	snd_iprintf(buffer, "DCO frequency: %u.%03u Hz\n", marian->dco_mhz / 1000,
+		    marian->dco_mhz % 1000);
+	snd_iprintf(buffer, "Clock drift  : %lld ppb\n", marian->drift_ppb);
+	snd_iprintf(buffer, "Interrupts   : %llu\n", marian->irqs);
+	snd_iprintf(buffer, "Xruns        : %llu\n", marian->xruns);
+}
+
+static void snd_marian_proc_status(struct snd_info_entry *entry, struct snd_info_buffer *buffer)
+{
+	struct marian_card *marian = entry->private_data;
+	u8 v1 = READ_ONCE(marian->sync_state);
+	u8 v2 = READ_ONCE(marian->input_modes);
+
+	marian_proc_status_generic(marian, buffer);
+
+	// Inputs as of the last clock monitor pass, no SPI traffic here
+	snd_iprintf(buffer, "\n*** MADI FPGA registers\n");
+	snd_iprintf(buffer, "M2 MADI 00h: %02x\n", v1);
+	snd_iprintf(buffer, "M2 MADI 01h: %02x\n", v2);
+	snd_iprintf(buffer, "M2 MADI 02h: %02x\n", marian->fpga_firmware);
+	snd_iprintf(buffer, "M2 MADI 40h: %02x\n", marian->shadow_40);
+	snd_iprintf(buffer, "M2 MADI 41h: %02x\n", marian->shadow_41);
+	snd_iprintf(buffer, "M2 MADI 42h: %02x\n", marian->shadow_42);
+
+	snd_iprintf(buffer, "\n*** MADI FPGA status\n");
+	snd_iprintf(buffer, "MADI FPGA firmware: 0x%02x\n", marian->fpga_firmware);
+
+	snd_iprintf(buffer, "Clock source: ");
+	switch (marian->clock_source) {
+	case 1:
+		snd_iprintf(buffer, "Internal DCO\n");
+		break;
+	case 2:
+		snd_iprintf(buffer, "Sync bus\n");
+		break;
+	case 4:
+		snd_iprintf(buffer, "MADI Input 1\n");
+		break;
+	case 5:
+		snd_iprintf(buffer, "MADI Input 2\n");
+		break;
+	default:
+		snd_iprintf(buffer, "UNKNOWN\n");
+		break;
+	}
+
+	snd_iprintf(buffer, "Sample format: %s, %s Endian, %s first\n",
+		    (marian->shadow_41 & (1 << M2_INT_FLOAT)) ? "Float" : "Integer",
+		    (marian->shadow_41 & (1 << M2_ENDIANNESS)) ? "Little" : "Big",
+		    (marian->shadow_41 & (1 << M2_BIT_ORDER)) ? "LSB" : "MSB");
+
+	snd_iprintf(buffer, "MADI port 1 input: ");
+	if (!(v1 & 0x03))
+		snd_iprintf(buffer, "No signal\n");
+	else
+		snd_iprintf(buffer, "%s, %dch, %dkHz frame, %u Hz\n",
+			    (v1 & 0x02) ? "sync" : "lock", (v2 & 0x01) ? 64 : 56,
+			    (v2 & 0x02) ? 96 : 48, READ_ONCE(marian->input_rate[0]));
+
+	snd_iprintf(buffer, "MADI port 2 input: ");
+	if (!(v1 & 0x0C))
+		snd_iprintf(buffer, "No signal\n");
+	else
+		snd_iprintf(buffer, "%s, %dch, %dkHz frame, %u Hz\n",
+			    (v1 & 0x08) ? "sync" : "lock",
+			    (v2 & 0x04) ? 64 : 56, (v2 & 0x08) ? 96 : 48,
+			    READ_ONCE(marian->input_rate[1]));
+}
+
+static void marian_m2_proc_ports(struct marian_card *marian,
+				 struct snd_info_buffer *buffer, unsigned int type)
+{
+	int stream = (type == MARIAN_PORTS_TYPE_INPUT) ? SNDRV_PCM_STREAM_CAPTURE
+						       : SNDRV_PCM_STREAM_PLAYBACK;
+	unsigned int i, slot;
+
+	for (i = 0; i < marian_m2_stream_channels(marian, stream); i++) {
+		slot = marian_m2_channel_slot(marian, stream, i);
+		snd_iprintf(buffer, "%d=MADI p%dch%02d\n", i + 1, slot / 64 + 1, slot % 64 + 1);
+	}
+}
+
+static void snd_marian_proc_ports_in(struct snd_info_entry *entry, struct snd_info_buffer *buffer)
+{
+	struct marian_card *marian = entry->private_data;
+
+	snd_iprintf(buffer, "# generated by MARIAN Seraph driver\n");
+	marian_m2_proc_ports(marian, buffer, MARIAN_PORTS_TYPE_INPUT);
+}
+
+static void snd_marian_proc_ports_out(struct snd_info_entry *entry, struct snd_info_buffer *buffer)
+{
+	struct marian_card *marian = entry->private_data;
+
+	snd_iprintf(buffer, "# generated by MARIAN Seraph driver\n");
+	marian_m2_proc_ports(marian, buffer, MARIAN_PORTS_TYPE_OUTPUT);
+}
+
+// Rate we expect the sample clock to run at, in millihertz
+static unsigned int marian_nominal_mhz(struct marian_card *marian)
+{
+	if (marian->clock_source == M2_CLOCK_SRC_DCO)
+		return marian->dco_mhz;
+
+	return marian->ext_rate * 1000;
+}
+
+/*
+ * Compare the frames transferred against CLOCK_MONOTONIC over a window.
+ * The hardware pointer is read with the timestamp, so interrupt latency
+ * doesn't show up as drift.
+ */
+static void marian_update_drift(struct marian_card *marian, u64 now, u32 ptr)
+{
+	unsigned int nominal;
+	u64 pos, rate;
+
+	spin_lock(&marian->lock);
+	marian->frames += M2_PERIOD_FRAMES;
+	pos = marian->frames + ptr % M2_PERIOD_FRAMES;
+
+	if (marian->drift_restart || now - marian->drift_start_ns >= M2_DRIFT_WINDOW_NS) {
+		nominal = marian_nominal_mhz(marian);
+		if (!marian->drift_restart && nominal) {
+			rate = div64_u64((pos - marian->drift_start_frames) * 1000 * NSEC_PER_SEC,
+					 now - marian->drift_start_ns);
+			marian->drift_ppb = div_s64(((s64)rate - nominal) * NSEC_PER_SEC, nominal);
+		}
+
+		marian->drift_restart = false;
+		marian->drift_start_ns = now;
+		marian->drift_start_frames = pos;
+	}
+
+	marian->period_ns = now;
+	marian->period_ptr = ptr;
+	spin_unlock(&marian->lock);
+}
+
+/*
+ * The status page is read locklessly from userspace, so every update is
+ * bracketed by an odd sequence count. Called with lock held.
+ */
+static void marian_status_update(struct marian_card *marian, u64 now, u32 ptr, bool period)
+{
+	struct marian_hwdep_status *status = marian->status;
+	unsigned int port, v;
+
+	WRITE_ONCE(status->seq, status->seq + 1);
+	smp_wmb();
+
+	if (period) {
+		status->periods++;
+		status->tstamp_ns = now;
+		status->hw_pointer = ptr;
+	}
+	status->frames = marian->frames;
+	status->running = marian->running;
+	status->irqs = marian->irqs;
+	status->xruns = marian->xruns;
+	status->monitor_tstamp_ns = marian->monitor_ns;
+	status->rate_mhz = marian_nominal_mhz(marian);
+	status->clock_source = marian->clock_source;
+	status->dco_mhz = marian->dco_mhz;
+	status->ext_rate = marian->ext_rate;
+	status->drift_ppb = marian->drift_ppb;
+
+	for (port = 0; port < 2; port++) {
+		v = (marian->sync_state >> (port * 2)) & 0x3;
+		status->sync[port] = v == 3 ? 2 : v;
+		status->input_channels[port] = marian->input_modes & BIT(port * 2) ? 64 : 56;
+		status->input_frame[port] = marian->input_modes & BIT(port * 2 + 1) ? 96 : 48;
+		status->output_channels[port] = marian->shadow_42 & BIT(port * 2) ? 64 : 56;
+		status->output_frame[port] = marian->shadow_42 & BIT(port * 2 + 1) ? 96 : 48;
+		status->input_rate[port] = marian->input_rate[port];
+	}
+	status->firmware = marian->firmware;
+	status->fpga_firmware = marian->fpga_firmware;
+	status->redundant_port = marian->redundant ? marian->redundant_port + 1 : 0;
+	status->switchovers = marian->switchovers;
+
+	smp_wmb();
+	WRITE_ONCE(status->seq, status->seq + 1);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define marian_eventfd_signal(ctx)	eventfd_signal(ctx)
+#else
+#define marian_eventfd_signal(ctx)	eventfd_signal(ctx, 1)
+#endif
+
+static void marian_status_period(struct marian_card *marian, u64 now, u32 ptr)
+{
+	spin_lock_irq(&marian->lock);
+	marian_status_update(marian, now, ptr, true);
+	if (marian->eventfd)
+		marian_eventfd_signal(marian->eventfd);
+	spin_unlock_irq(&marian->lock);
+
+	if (marian->hwdep)
+		wake_up_interruptible(&marian->hwdep_wait);
+}
+
+/*
+ * Has sync_work read the inputs' sync state within M2_SYNC_POLL_MS. While it
+ * is pending, the read it waits for serves this period as well.
+ */
+static void marian_sync_poll(struct marian_card *marian)
+{
+	queue_delayed_work(system_highpri_wq, &marian->sync_work,
+			   msecs_to_jiffies(M2_SYNC_POLL_MS));
+}
+
+/*
+ * Redundant input. An input counts as usable while its sync bit is set; the
+ * one in use is kept until it loses sync and the other one has it, so two
+ * flaky inputs don't make capture flip between them at every poll.
+ */
+static void marian_redundancy_update(struct marian_card *marian, u8 sync)
+{
+	unsigned int port = READ_ONCE(marian->redundant_port);
+	unsigned int other = !port;
+
+	if ((sync >> (port * 2)) & 0x2 || !((sync >> (other * 2)) & 0x2))
+		return;
+
+	WRITE_ONCE(marian->redundant_port, other);
+
+	spin_lock_irq(&marian->lock);
+	marian->switchovers++;
+	spin_unlock_irq(&marian->lock);
+
+	dev_info(marian->card->dev, "Redundant input: switched to port %u\n", other + 1);
+	snd_ctl_notify(marian->card, SNDRV_CTL_EVENT_MASK_VALUE,
+		       &marian->redundant_port_control->id);
+}
+
+/*
+ * Called before anyone looks at the period just captured. While port 2 is
+ * in use, its half of the ring is copied over port 1's, the hardware is
+ * busy with the other half. Port 1 in use costs nothing.
+ */
+static void marian_redundant_period(struct marian_card *marian, u32 ptr)
+{
+	unsigned int offset = ptr < M2_PERIOD_FRAMES ? M2_PERIOD_FRAMES : 0;
+	unsigned int ch;
+
+	if (!READ_ONCE(marian->redundant))
+		return;
+
+	marian_sync_poll(marian);
+
+	if (READ_ONCE(marian->redundant_port)) {
+		for (ch = 0; ch < M2_PORT_CHANNELS; ch++)
+			memcpy(marian_slot_ptr(&marian->capture_buf, ch, offset),
+			       marian_slot_ptr(&marian->capture_buf, M2_PORT_CHANNELS + ch, offset),
+			       M2_PERIOD_FRAMES * sizeof(s32));
+	}
+
+	WRITE_ONCE(marian->redundant_pos, (offset + M2_PERIOD_FRAMES) % (2 * M2_PERIOD_FRAMES));
+}
+
+/*
+ * DMA position as a substream gets to see it. In redundant mode, capture
+ * stops at the last period copied, the live pointer may be ahead of it.
+ */
+static u32 marian_dma_pos(struct marian_card *marian, struct snd_pcm_substream *substream)
+{
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE && READ_ONCE(marian->redundant))
+		return READ_ONCE(marian->redundant_pos);
+
+	return marian_read(marian, SERAPH_RD_HWPOINTER);
+}
+
+/*
+ * Flight recorder
+ *
+ * The interrupt handler, the pointer callback and the trigger append one
+ * entry each time they run, so there is always a record of the last few
+ * hundred events. The first event that finds a substream in XRUN, which
+ * didn't have it before, freezes the ring with the run-up to the dropout in
+ * it. It is dumped and rearmed through debugfs.
+ */
+
+// Called under rcu_read_lock(), which keeps the runtimes from being freed
+static u32 marian_rec_states(struct marian_card *marian, u32 *xruns)
+{
+	struct snd_pcm_substream *substream;
+	struct snd_pcm_runtime *runtime;
+	u32 states = 0, state;
+	unsigned int i;
+
+	*xruns = 0;
+	for (i = 0; i < M2_PLAYBACK_SUBSTREAMS + M2_CAPTURE_SUBSTREAMS; i++) {
+		if (i < M2_PLAYBACK_SUBSTREAMS)
+			substream = READ_ONCE(marian->playback_substream[i]);
+		else
+			substream = READ_ONCE(marian->capture_substream[i - M2_PLAYBACK_SUBSTREAMS]);
+
+		runtime = substream ? READ_ONCE(substream->runtime) : NULL;
+		state = runtime ? (__force u32)READ_ONCE(runtime->status->state) : 0xF;
+		if (state == (__force u32)SNDRV_PCM_STATE_XRUN)
+			*xruns |= BIT(i);
+		states |= (state & 0xF) << (i * 4);
+	}
+
+	return states;
+}
+
+static void marian_rec(struct marian_card *marian, enum marian_rec_event event,
+		       struct snd_pcm_substream *substream, int cmd, u32 irq_status, u32 ptr)
+{
+	struct marian_rec_entry *e;
+	u32 xruns, seq;
+
+	if (!marian->rec)
+		return;
+
+	rcu_read_lock();
+	if (READ_ONCE(marian->rec_frozen)) {
+		rcu_read_unlock();
+		return;
+	}
+
+	seq = atomic_inc_return(&marian->rec_head);
+	e = &marian->rec[(seq - 1) % M2_REC_ENTRIES];
+
+	WRITE_ONCE(e->seq, 0);
+	smp_wmb();
+	e->event = event;
+	e->substream = substream ? marian_substream_index(substream) : M2_REC_CARD;
+	e->cmd = cmd;
+	e->tstamp_ns = ktime_get_ns();
+	e->irq_status = irq_status;
+	e->hw_pointer = ptr;
+	e->dma_debug = marian_read(marian, M2_DMA_DEBUG);
+	e->states = marian_rec_states(marian, &xruns);
+	smp_wmb();
+	WRITE_ONCE(e->seq, seq);
+
+	// Racing appenders may both see the new xrun, freezing twice is harmless
+	if (xruns & ~xchg(&marian->rec_xruns, xruns))
+		WRITE_ONCE(marian->rec_frozen, true);
+	rcu_read_unlock();
+}
+
+/*
+ * Forget a substream being released. Its runtime is freed once we return,
+ * so wait for the appenders that may still look at it.
+ */
+static void marian_rec_forget(struct marian_card *marian,
+			      struct snd_pcm_substream **slot)
+{
+	WRITE_ONCE(*slot, NULL);
+	synchronize_rcu();
+}
+
+static int marian_rec_show(struct seq_file *m, void *v)
+{
+	static const char * const events[] = { "irq", "pointer", "trigger", "xrun" };
+	struct marian_card *marian = m->private;
+	struct marian_rec_entry e;
+	u32 head = atomic_read(&marian->rec_head), seq, i;
+	u64 last = 0;
+
+	seq_printf(m, "# %s, %u events recorded\n",
+		   READ_ONCE(marian->rec_frozen) ? "frozen" : "recording", head);
+	seq_puts(m, "# seq time_ns delta_us event substream cmd irq_status hw_pointer dma_debug states\n");
+
+	for (i = head > M2_REC_ENTRIES ? head - M2_REC_ENTRIES : 0; i < head; i++) {
+		seq = READ_ONCE(marian->rec[i % M2_REC_ENTRIES].seq);
+		smp_rmb();
+		e = marian->rec[i % M2_REC_ENTRIES];
+		smp_rmb();
+		// Overwritten or still being written while we looked
+		if (seq != i + 1 || READ_ONCE(marian->rec[i % M2_REC_ENTRIES].seq) != seq)
+			continue;
+
+		seq_printf(m, "%u %llu %llu %s ", seq, e.tstamp_ns,
+			   last ? div_u64(e.tstamp_ns - last, NSEC_PER_USEC) : 0,
+			   e.event < ARRAY_SIZE(events) ? events[e.event] : "?");
+		if (e.substream == M2_REC_CARD)
+			seq_puts(m, "card");
+		else
+			seq_printf(m, "%c%u", e.substream / 16 ? 'c' : 'p', e.substream % 16);
+		seq_printf(m, " %u %08x %u %08x %08x\n", e.cmd, e.irq_status, e.hw_pointer,
+			   e.dma_debug, e.states);
+		last = e.tstamp_ns;
+	}
+
+	return 0;
+}
+
+static int marian_rec_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, marian_rec_show, inode->i_private);
+}
+
+// Any write empties the ring and starts recording again
+static ssize_t marian_rec_write(struct file *file, const char __user *buf, size_t count,
+				loff_t *ppos)
+{
+	struct marian_card *marian = ((struct seq_file *)file->private_data)->private;
+	u32 xruns;
+
+	// Stop appending, and let the appenders already past the check finish
+	WRITE_ONCE(marian->rec_frozen, true);
+	synchronize_rcu();
+
+	memset(marian->rec, 0, M2_REC_ENTRIES * sizeof(*marian->rec));
+	atomic_set(&marian->rec_head, 0);
+	// A substream still waiting to be recovered doesn't freeze it again
+	rcu_read_lock();
+	marian_rec_states(marian, &xruns);
+	rcu_read_unlock();
+	WRITE_ONCE(marian->rec_xruns, xruns);
+	smp_wmb();
+	WRITE_ONCE(marian->rec_frozen, false);
+
+	return count;
+}
+
+static const struct file_operations marian_rec_fops = {
+	.owner = THIS_MODULE,
+	.open = marian_rec_open,
+	.read = seq_read,
+	.write = marian_rec_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int marian_rec_create(struct marian_card *marian)
+{
+	char name[32];
+
+	marian->rec = kcalloc(M2_REC_ENTRIES, sizeof(*marian->rec), GFP_KERNEL);
+	if (!marian->rec)
+		return -ENOMEM;
+
+	snprintf(name, sizeof(name), "marian-card%d", marian->card->number);
+	marian->debugfs = debugfs_create_dir(name, NULL);
+	debugfs_create_file("events", 0600, marian->debugfs, marian, &marian_rec_fops);
+
+	return 0;
+}
+
+static bool marian_m2_source_locked(struct marian_card *marian, u8 sync)
+{
+	switch (marian->clock_source) {
+	case M2_CLOCK_SRC_MADI1:
+		return sync & 0x03;
+	case M2_CLOCK_SRC_MADI2:
+		return sync & 0x0C;
+	default:
+		// No lock indication for the sync bus, a measured rate has to do
+		return true;
+	}
+}
+
+static bool marian_failover_active(struct marian_card *marian)
+{
+	return READ_ONCE(marian->clock_failover) &&
+	       READ_ONCE(marian->clock_source) != M2_CLOCK_SRC_DCO;
+}
+
+/*
+ * Failover between monitor passes: a source losing its lock, or its clock
+ * taking the periods with it, gets the monitor to run right away instead of
+ * at its next pass.
+ */
+static void marian_failover_period(struct marian_card *marian)
+{
+	unsigned int rate = READ_ONCE(marian->ext_rate) ?: FREQ_MIN;
+
+	if (!marian_failover_active(marian))
+		return;
+
+	mod_delayed_work(system_highpri_wq, &marian->clock_watchdog,
+			 msecs_to_jiffies(2 * M2_PERIOD_FRAMES * MSEC_PER_SEC / rate + 1));
+
+	marian_sync_poll(marian);
+}
+
+/*
+ * The sync state is read over SPI, bit by bit, so it is left to a work item
+ * and read at most every M2_SYNC_POLL_MS, for both of its users at once.
+ */
+static void marian_sync_work(struct work_struct *work)
+{
+	struct marian_card *marian = container_of(to_delayed_work(work), struct marian_card,
+						  sync_work);
+	bool locked;
+	u8 sync;
+
+	// Both turned off since it was queued
+	if (!READ_ONCE(marian->redundant) && !marian_failover_active(marian))
+		return;
+
+	sync = marian_m2_spi_read(marian, 0x00);
+	if (READ_ONCE(marian->redundant))
+		marian_redundancy_update(marian, sync);
+
+	if (marian_failover_active(marian)) {
+		locked = marian_m2_source_locked(marian, sync);
+		if (!locked && marian->period_locked)
+			mod_delayed_work(system_wq, &marian->monitor_work, 0);
+		marian->period_locked = locked;
+	}
+}
+
+static void marian_clock_watchdog(struct work_struct *work)
+{
+	struct marian_card *marian = container_of(to_delayed_work(work), struct marian_card,
+						  clock_watchdog);
+
+	mod_delayed_work(system_wq, &marian->monitor_work, 0);
+}
+
+// ALSA stops the stream from snd_pcm_period_elapsed() when it finds an xrun
+static void marian_period_elapsed(struct marian_card *marian, struct snd_pcm_substream *substream)
+{
+	bool running = snd_pcm_running(substream);
+
+	snd_pcm_period_elapsed(substream);
+
+	if (running && substream->runtime->status->state == SNDRV_PCM_STATE_XRUN) {
+		spin_lock_irq(&marian->lock);
+		marian->xruns++;
+		spin_unlock_irq(&marian->lock);
+
+		marian_rec(marian, M2_REC_XRUN, substream, 0, 0, 0);
+	}
+}
+
+/*
+ * The hard handler only acks the card and takes the period's time and
+ * pointer. Copying, mixing and rendering a period of 128 channels is left
+ * to the interrupt thread, where it doesn't hold off other interrupts.
+ */
+static irqreturn_t snd_marian_interrupt(int irq, void *dev_id)
+{
+	struct marian_card *marian = (struct marian_card *)dev_id;
+	unsigned int irq_status;
+	u64 now;
+	u32 ptr;
+
+	// Only this handler writes it, published with the next status update
+	marian->irqs++;
+
+	irq_status = marian_read(marian, SERAPH_RD_IRQ_STATUS);
+
+	if (irq_status & 0x00004800) {
+		// One pointer read, taken with the timestamp, serves every consumer
+		now = ktime_get_ns();
+		ptr = marian_read(marian, SERAPH_RD_HWPOINTER);
+		marian_rec(marian, M2_REC_IRQ, NULL, 0, irq_status, ptr);
+
+		marian_update_drift(marian, now, ptr);
+
+		if (READ_ONCE(marian->timer_running))
+			snd_timer_interrupt(marian->timer, 1);
+
+		return IRQ_WAKE_THREAD;
+	}
+
+	marian_rec(marian, M2_REC_IRQ, NULL, 0, irq_status, 0);
+
+	return IRQ_NONE;
+}
+
+/*
+ * Runs once for one or more period interrupts, so it works on the latest
+ * one. Substreams stopped meanwhile are skipped; the sync_stop callback
+ * keeps their runtime from going away under it.
+ */
+static irqreturn_t marian_irq_thread(int irq, void *dev_id)
+{
+	struct marian_card *marian = (struct marian_card *)dev_id;
+	struct snd_pcm_substream *substream;
+	unsigned int i;
+	u64 now;
+	u32 ptr;
+
+	spin_lock_irq(&marian->lock);
+	now = marian->period_ns;
+	ptr = marian->period_ptr;
+	spin_unlock_irq(&marian->lock);
+
+	marian_redundant_period(marian, ptr);
+	marian_status_period(marian, now, ptr);
+	marian_export_period(marian);
+	marian_playback_period(marian, ptr);
+	marian_meter_period(marian, ptr);
+	marian_preview_period(marian);
+	marian_failover_period(marian);
+
+	for (i = 0; i < M2_PLAYBACK_SUBSTREAMS; i++) {
+		substream = READ_ONCE(marian->playback_substream[i]);
+		if (substream && marian_started(marian, substream))
+			marian_period_elapsed(marian, substream);
+	}
+
+	for (i = 0; i < M2_CAPTURE_SUBSTREAMS; i++) {
+		substream = READ_ONCE(marian->capture_substream[i]);
+		if (substream && marian_started(marian, substream))
+			marian_period_elapsed(marian, substream);
+	}
+
+	return IRQ_HANDLED;
+}
+
+static const struct snd_pcm_hardware m2_info_playback = {
+	.info = SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_NONINTERLEAVED
+		| SNDRV_PCM_INFO_JOINT_DUPLEX | SNDRV_PCM_INFO_SYNC_START,
+	.formats = SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_S32_BE
+		| SNDRV_PCM_FMTBIT_FLOAT_LE | SNDRV_PCM_FMTBIT_FLOAT_BE,
+	.rates = (SNDRV_PCM_RATE_CONTINUOUS | SNDRV_PCM_RATE_44100
+		| SNDRV_PCM_RATE_48000 | SNDRV_PCM_RATE_88200
+		| SNDRV_PCM_RATE_96000),
+	.rate_min = FREQ_MIN,
+	.rate_max = FREQ_MAX,
+	.channels_min = M2_CHANNELS_COUNT,
+	.channels_max = M2_CHANNELS_COUNT,
+	.buffer_bytes_max = SUBSTREAM_BUF_SIZE,
+	.period_bytes_min = SUBSTREAM_PERIOD_SIZE,
+	.period_bytes_max = SUBSTREAM_PERIOD_SIZE,
+	.periods_min = 2,
+	.periods_max = 2
+};
+
+static const struct snd_pcm_hardware m2_info_capture = {
+	.info = SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_NONINTERLEAVED
+		| SNDRV_PCM_INFO_SYNC_START | SNDRV_PCM_INFO_JOINT_DUPLEX,
+	.formats = SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_S32_BE
+		| SNDRV_PCM_FMTBIT_FLOAT_LE | SNDRV_PCM_FMTBIT_FLOAT_BE,
+	.rates = (SNDRV_PCM_RATE_CONTINUOUS | SNDRV_PCM_RATE_44100
+		| SNDRV_PCM_RATE_48000 | SNDRV_PCM_RATE_88200
+		| SNDRV_PCM_RATE_96000),
+	.rate_min = FREQ_MIN,
+	.rate_max = FREQ_MAX,
+	.channels_min = M2_CHANNELS_COUNT,
+	.channels_max = M2_CHANNELS_COUNT,
+	.buffer_bytes_max = SUBSTREAM_BUF_SIZE,
+	.period_bytes_min = SUBSTREAM_PERIOD_SIZE,
+	.period_bytes_max = SUBSTREAM_PERIOD_SIZE,
+	.periods_min = 2,
+	.periods_max = 2
+};
+
+/*
+ * Shrink the hardware description to the layout's channel count. The period
+ * and buffer stay at the same number of frames as with the full layout.
+ * The interrupt thread walks the open substreams by the layout, so it is
+ * only taken anew when the first substream of the direction opens; the
+ * others get the one in use. Called with the open mutex held.
+ */
+static int marian_m2_set_hw_channels(struct marian_card *marian,
+				     struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	unsigned int channels;
+
+	if (!marian_stream_open(marian, substream->stream))
+		marian_m2_update_layout(marian, substream->stream);
+	channels = marian_m2_stream_channels(marian, substream->stream);
+
+	if (channels == M2_CHANNELS_COUNT)
+		return 0;
+
+	runtime->hw.channels_min = channels;
+	runtime->hw.channels_max = channels;
+	runtime->hw.buffer_bytes_max = channels * M2_CHANNEL_BUF_SIZE;
+	runtime->hw.period_bytes_min = SUBSTREAM_PERIOD_SIZE / M2_CHANNELS_COUNT * channels;
+	runtime->hw.period_bytes_max = runtime->hw.period_bytes_min;
+
+	// The core's read/write copy assumes evenly spaced channels, so mmap only
+	return snd_pcm_hw_constraint_mask(runtime, SNDRV_PCM_HW_PARAM_ACCESS,
+					  1 << (__force int)SNDRV_PCM_ACCESS_MMAP_NONINTERLEAVED);
+}
+
+static u32 marian_hw_bit(struct snd_pcm_substream *substream)
+{
+	return BIT(marian_substream_index(substream));
+}
+
+// True if a substream other than this one has set the shared rate and format
+static bool marian_hw_pinned(struct marian_card *marian, struct snd_pcm_substream *substream)
+{
+	return READ_ONCE(marian->hw_holders) & ~marian_hw_bit(substream);
+}
+
+/*
+ * While slaved to an external clock the only rate that works is the one
+ * coming in, so offer nothing else, and nothing at all while none is
+ * coming in. Once another substream has set its parameters, its rate is
+ * the only one left as well.
+ */
+static int marian_hw_rule_rate(struct snd_pcm_hw_params *params, struct snd_pcm_hw_rule *rule)
+{
+	struct snd_pcm_substream *substream = rule->private;
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+	struct snd_interval *rate = hw_param_interval(params, SNDRV_PCM_HW_PARAM_RATE);
+	unsigned int ext_rate = READ_ONCE(marian->ext_rate);
+	unsigned int div = marian_preview(substream) ? M2_PREVIEW_DECIMATION : 1;
+	struct snd_interval pin = {
+		.integer = 1,
+	};
+
+	if (marian_hw_pinned(marian, substream))
+		pin.min = pin.max = READ_ONCE(marian->hw_rate) / div;
+	else if (marian->clock_source != M2_CLOCK_SRC_DCO && ext_rate)
+		pin.min = pin.max = ext_rate / div;
+	else if (marian->clock_source != M2_CLOCK_SRC_DCO)
+		return -EINVAL;
+	else
+		return 0;
+
+	return snd_interval_refine(rate, &pin);
+}
+
+// Register 0x41 holds one sample format for both directions
+static int marian_hw_rule_format(struct snd_pcm_hw_params *params, struct snd_pcm_hw_rule *rule)
+{
+	struct snd_pcm_substream *substream = rule->private;
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+	struct snd_mask pin;
+
+	if (!marian_hw_pinned(marian, substream))
+		return 0;
+
+	snd_mask_none(&pin);
+	snd_mask_set_format(&pin, READ_ONCE(marian->hw_format));
+
+	return snd_mask_refine(hw_param_mask(params, SNDRV_PCM_HW_PARAM_FORMAT), &pin);
+}
+
+/*
+ * The period and buffer geometry is fixed by the hardware description, so
+ * rate and format are all there is to agree on.
+ */
+static int marian_add_hw_rules(struct snd_pcm_substream *substream)
+{
+	int err;
+
+	err = snd_pcm_hw_rule_add(substream->runtime, 0, SNDRV_PCM_HW_PARAM_RATE,
+				  marian_hw_rule_rate, substream, SNDRV_PCM_HW_PARAM_RATE, -1);
+	if (err < 0)
+		return err;
+
+	return snd_pcm_hw_rule_add(substream->runtime, 0, SNDRV_PCM_HW_PARAM_FORMAT,
+				   marian_hw_rule_format, substream,
+				   SNDRV_PCM_HW_PARAM_FORMAT, -1);
+}
+
+/*
+ * The buffers of the mixed clients take 2 MiB each, so they are only
+ * allocated once a mixed client is opened, and kept from then on. Called
+ * with the open mutex held.
+ */
+static int marian_mix_alloc(struct marian_card *marian, unsigned int client)
+{
+	int err;
+
+	// Same slot layout as the ring, so CHANNEL_INFO holds for mixed clients too
+	if (!marian->client_buf[client].area) {
+		err = snd_dma_alloc_pages(SNDRV_DMA_TYPE_VMALLOC, NULL, SUBSTREAM_BUF_SIZE,
+					  &marian->client_buf[client]);
+		if (err < 0)
+			return err;
+	}
+
+	if (!marian->mix_buf.area)
+		return snd_dma_alloc_pages(SNDRV_DMA_TYPE_VMALLOC, NULL, SUBSTREAM_BUF_SIZE,
+					   &marian->mix_buf);
+
+	return 0;
+}
+
+static int snd_marian_playback_open(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = substream->private_data;
+	int err;
+
+	substream->runtime->hw = m2_info_playback;
+	err = marian_m2_set_hw_channels(marian, substream);
+	if (err < 0)
+		return err;
+
+	err = marian_add_hw_rules(substream);
+	if (err < 0)
+		return err;
+
+	// Mixed clients are summed by a scalar integer loop, so S32 only
+	if (substream->number) {
+		err = snd_pcm_hw_constraint_mask64(substream->runtime, SNDRV_PCM_HW_PARAM_FORMAT,
+						   SNDRV_PCM_FMTBIT_S32_LE |
+						   SNDRV_PCM_FMTBIT_S32_BE);
+		if (err < 0)
+			return err;
+
+		err = marian_mix_alloc(marian, substream->number);
+		if (err < 0)
+			return err;
+	}
+
+	WRITE_ONCE(marian->playback_substream[substream->number], substream);
+
+	snd_pcm_set_sync(substream);
+
+	return 0;
+}
+
+static int snd_marian_capture_open(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = substream->private_data;
+	int err;
+
+	substream->runtime->hw = m2_info_capture;
+	err = marian_m2_set_hw_channels(marian, substream);
+	if (err < 0)
+		return err;
+
+	err = marian_add_hw_rules(substream);
+	if (err < 0)
+		return err;
+
+	WRITE_ONCE(marian->capture_substream[substream->number], substream);
+
+	snd_pcm_set_sync(substream);
+
+	return 0;
+}
+
+static int snd_marian_capture_release(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+
+	marian_rec_forget(marian, &marian->capture_substream[substream->number]);
+
+	return 0;
+}
+
+static int snd_marian_playback_release(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+
+	marian_rec_forget(marian, &marian->playback_substream[substream->number]);
+
+	return 0;
+}
+
+// Called with reg_mutex held
+static void marian_m2_set_format(struct marian_card *marian, snd_pcm_format_t format)
+{
+	switch (format) {
+	case SNDRV_PCM_FORMAT_FLOAT_BE:
+		marian_m2_set_float(marian, M2_NUM_MODE_FLOAT);
+		marian_m2_set_endianness(marian, M2_BE);
+		break;
+	case SNDRV_PCM_FORMAT_FLOAT_LE:
+		marian_m2_set_float(marian, M2_NUM_MODE_FLOAT);
+		marian_m2_set_endianness(marian, M2_LE);
+		break;
+	case SNDRV_PCM_FORMAT_S32_BE:
+		marian_m2_set_float(marian, M2_NUM_MODE_INT);
+		marian_m2_set_endianness(marian, M2_BE);
+		break;
+	case SNDRV_PCM_FORMAT_S32_LE:
+		marian_m2_set_float(marian, M2_NUM_MODE_INT);
+		marian_m2_set_endianness(marian, M2_LE);
+		break;
+	}
+}
+
+/*
+ * Rate and sample format are shared by every substream. The first one to
+ * set its parameters programs them, the others are held to the same values
+ * by the hw rules and join without touching the registers, so a stream that
+ * is already running never hears the next one being set up.
+ */
+static int snd_marian_hw_params(struct snd_pcm_substream *substream,
+				struct snd_pcm_hw_params *params)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+	unsigned int rate = params_rate(params);
+	snd_pcm_format_t format = params_format(params);
+	bool same;
+
+	// Mixed clients are summed as integers, the card is held to their format below
+	if (marian_mixed_client(substream) && format != SNDRV_PCM_FORMAT_S32_LE &&
+	    format != SNDRV_PCM_FORMAT_S32_BE)
+		return -EINVAL;
+
+	mutex_lock(&marian->reg_mutex);
+	same = marian->hw_holders && rate == marian->hw_rate && format == marian->hw_format;
+	if (!same && marian_hw_pinned(marian, substream)) {
+		mutex_unlock(&marian->reg_mutex);
+		return -EBUSY;
+	}
+
+	// Already set up like this, reprogramming would only glitch the others
+	if (!same) {
+		marian_m2_set_speedmode(marian, rate);
+		marian_m2_set_format(marian, format);
+		marian->hw_rate = rate;
+		marian->hw_format = format;
+	}
+	WRITE_ONCE(marian->hw_holders, marian->hw_holders | marian_hw_bit(substream));
+	mutex_unlock(&marian->reg_mutex);
+
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK && substream->number)
+		snd_pcm_set_runtime_buffer(substream, &marian->client_buf[substream->number]);
+	else if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		snd_pcm_set_runtime_buffer(substream, &marian->playback_buf);
+	else
+		snd_pcm_set_runtime_buffer(substream, &marian->capture_buf);
+
+	return 0;
+}
+
+static int snd_marian_hw_free(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+
+	mutex_lock(&marian->reg_mutex);
+	WRITE_ONCE(marian->hw_holders, marian->hw_holders & ~marian_hw_bit(substream));
+	mutex_unlock(&marian->reg_mutex);
+
+	return 0;
+}
+
+static int marian_m2_prepare(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+	unsigned int i;
+	bool idle;
+
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK && substream->number) {
+		marian->mix_pos[substream->number] = 0;
+	} else if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		marian->routed_appl_ptr = 0;
+		marian->mix_live[0] = false;
+		marian->mix_live[1] = false;
+
+		// Silence what's left of the last stream before it can be prefilled
+		spin_lock_irq(&marian->lock);
+		marian->playback_stale = 0;
+		idle = !(marian->started & GENMASK(M2_PLAYBACK_SUBSTREAMS - 1, 0));
+		spin_unlock_irq(&marian->lock);
+		if (idle)
+			memset(marian->playback_buf.area, 0, marian->playback_buf.bytes);
+	}
+
+	mutex_lock(&marian->reg_mutex);
+	for (i = 0; i < M2_ARM_REGS; i++)
+		marian_write(marian, M2_ARM_BASE + i * 4, marian_m2_arm_mask(marian, i));
+	mutex_unlock(&marian->reg_mutex);
+
+	return 0;
+}
+
+static int snd_marian_ioctl(struct snd_pcm_substream *substream, unsigned int cmd, void *arg)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct snd_pcm_channel_info *info = arg;
+	unsigned int slot;
+	int err;
+
+	if (cmd == SNDRV_PCM_IOCTL1_RESET) {
+		err = snd_pcm_lib_ioctl(substream, cmd, arg);
+
+		/*
+		 * Join an engine already running for others at its current
+		 * position. Mixed clients keep their own position instead.
+		 */
+		if (!err && !snd_pcm_running(substream) && READ_ONCE(marian->running) &&
+		    !marian_mixed_client(substream))
+			runtime->status->hw_ptr = marian_dma_pos(marian, substream) %
+						  runtime->buffer_size;
+
+		return err;
+	}
+
+	if (cmd != SNDRV_PCM_IOCTL1_CHANNEL_INFO)
+		return snd_pcm_lib_ioctl(substream, cmd, arg);
+
+	// Channels keep their hardware slot, even when the layout skips dead ones
+	slot = marian_m2_channel_slot(marian, substream->stream, info->channel);
+	info->offset = 0;
+	info->first = slot * M2_CHANNEL_BUF_SIZE * 8;
+	info->step = 32;
+
+	return 0;
+}
+
+/*
+ * The core would space the channels evenly over dma_bytes, which only holds
+ * for the full layout. Channels keep their hardware slot here as well.
+ */
+static int snd_marian_fill_silence(struct snd_pcm_substream *substream, int channel,
+				   unsigned long pos, unsigned long bytes)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+	unsigned int slot = marian_m2_channel_slot(marian, substream->stream, channel);
+
+	memset(substream->runtime->dma_area + slot * M2_CHANNEL_BUF_SIZE + pos, 0, bytes);
+
+	return 0;
+}
+
+/*
+ * Every substream shares the one DMA engine: the first start switches it on,
+ * the last stop switches it off, and anything in between only joins or
+ * leaves. Substreams of different groups trigger concurrently, so the
+ * register writes stay under the lock with the count.
+ */
+static void marian_engine_get(struct marian_card *marian)
+{
+	int irq_flags;
+
+	if (marian->active++)
+		return;
+
+	marian->frames = 0;
+	marian->drift_restart = true;
+	marian->redundant_pos = 0;
+	marian->running = true;
+	marian_status_update(marian, 0, 0, false);
+	if (marian->dma_mem->export_count)
+		queue_work(system_highpri_wq, &marian->export_work);
+
+	irq_flags = M2_DISABLE_PLAY_IRQ;
+	if (marian->loopback)
+		irq_flags |= M2_ENABLE_LOOPBACK;
+
+	marian_write(marian, SERAPH_WR_DMA_ENABLE, 0x3);
+	marian_write(marian, SERAPH_WR_IE_ENABLE, irq_flags);
+}
+
+static void marian_engine_put(struct marian_card *marian)
+{
+	int irq_flags;
+
+	if (--marian->active)
+		return;
+
+	marian->running = false;
+	marian_status_update(marian, 0, 0, false);
+
+	irq_flags = M2_DISABLE_PLAY_IRQ | M2_DISABLE_CAPT_IRQ;
+	marian_write(marian, SERAPH_WR_IE_ENABLE, irq_flags);
+	marian_write(marian, SERAPH_WR_DMA_ENABLE, 0x0);
+
+	// unarm channels to inhibit playback from the FPGA's internal buffer
+	marian_write(marian, 0x08, 0);
+	marian_write(marian, 0x0C, 0);
+	marian_write(marian, 0x20, 0);
+	marian_write(marian, 0x24, 0);
+	marian_write(marian, 0x28, 0);
+	marian_write(marian, 0x2C, 0);
+	marian_write(marian, 0x30, 0);
+	marian_write(marian, 0x34, 0);
+	marian_write(marian, 0x38, 0);
+	marian_write(marian, 0x3C, 0);
+}
+
+static int snd_marian_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+
+	marian_rec(marian, M2_REC_TRIGGER, substream, cmd, 0, READ_ONCE(marian->running) ?
+		   marian_read(marian, SERAPH_RD_HWPOINTER) : 0);
+
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+		spin_lock(&marian->lock);
+		marian_engine_get(marian);
+		marian->started |= marian_hw_bit(substream);
+		spin_unlock(&marian->lock);
+		return 0;
+	case SNDRV_PCM_TRIGGER_STOP:
+		spin_lock(&marian->lock);
+		marian->started &= ~marian_hw_bit(substream);
+		// Both halves of the ring, from the next period on
+		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+			marian->playback_stale = 2;
+		marian_engine_put(marian);
+		spin_unlock(&marian->lock);
+		// No fence waits for a period that may not come
+		marian_fence_signal(marian);
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+// Wait for the interrupt thread to be done with a stopped substream
+static int snd_marian_sync_stop(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+
+	if (marian->irq >= 0)
+		synchronize_irq(marian->irq);
+	else if (marian->sim)
+		flush_work(&marian->sim->irq_work);
+
+	return 0;
+}
+
+static snd_pcm_uframes_t snd_marian_hw_pointer(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+	u32 ptr;
+
+	if (marian_mixed_client(substream))
+		ptr = READ_ONCE(marian->mix_pos[substream->number]);
+	else
+		ptr = marian_dma_pos(marian, substream);
+
+	marian_rec(marian, M2_REC_POINTER, substream, 0, 0, ptr);
+
+	return ptr;
+}
+
+static int snd_marian_playback_ack(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+
+	if (marian_mixed_client(substream))
+		return 0;
+
+	marian_route_playback_ack(marian, substream);
+
+	return 0;
+}
+
+static const struct snd_pcm_ops snd_marian_playback_ops = {
+	.open = snd_marian_playback_open,
+	.close = snd_marian_playback_release,
+	.ioctl = snd_marian_ioctl,
+	.hw_params = snd_marian_hw_params,
+	.hw_free = snd_marian_hw_free,
+	.prepare = marian_m2_prepare,
+	.trigger = snd_marian_trigger,
+	.sync_stop = snd_marian_sync_stop,
+	.pointer = snd_marian_hw_pointer,
+	.ack = snd_marian_playback_ack,
+	.fill_silence = snd_marian_fill_silence,
+};
+
+static const struct snd_pcm_ops snd_marian_capture_ops = {
+	.open = snd_marian_capture_open,
+	.close = snd_marian_capture_release,
+	.ioctl = snd_marian_ioctl,
+	.hw_params = snd_marian_hw_params,
+	.hw_free = snd_marian_hw_free,
+	.prepare = marian_m2_prepare,
+	.trigger = snd_marian_trigger,
+	.sync_stop = snd_marian_sync_stop,
+	.pointer = snd_marian_hw_pointer,
+};
+
+static const struct snd_pcm_hardware m2_info_preview = {
+	.info = SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_INTERLEAVED
+		| SNDRV_PCM_INFO_SYNC_START | SNDRV_PCM_INFO_JOINT_DUPLEX,
+	.formats = SNDRV_PCM_FMTBIT_S16_LE,
+	.rates = SNDRV_PCM_RATE_CONTINUOUS,
+	.rate_min = FREQ_MIN / M2_PREVIEW_DECIMATION,
+	.rate_max = FREQ_MAX / M2_PREVIEW_DECIMATION,
+	.channels_min = M2_CHANNELS_COUNT,
+	.channels_max = M2_CHANNELS_COUNT,
+	.buffer_bytes_max = M2_PREVIEW_BUF_SIZE,
+	.period_bytes_min = M2_PREVIEW_PERIOD * M2_CHANNELS_COUNT * 2,
+	.period_bytes_max = M2_PREVIEW_PERIOD * M2_CHANNELS_COUNT * 2,
+	.periods_min = 2,
+	.periods_max = M2_PREVIEW_PERIODS_MAX
+};
+
+// Same channels as the capture layout, at a quarter of the card rate
+static int marian_preview_open(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = substream->private_data;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	unsigned int channels, port;
+	int err;
+
+	/*
+	 * The capture layout belongs to the capture substreams, the preview
+	 * only takes one of its own from the same settings.
+	 */
+	for (port = 0; port < 2; port++)
+		marian->preview_ports[port] =
+			marian_m2_layout_channels(marian, SNDRV_PCM_STREAM_CAPTURE, port,
+						  marian_m2_port_mode_channels(marian,
+									       SNDRV_PCM_STREAM_CAPTURE,
+									       port));
+	channels = marian->preview_ports[0] + marian->preview_ports[1];
+
+	runtime->hw = m2_info_preview;
+	runtime->hw.channels_min = channels;
+	runtime->hw.channels_max = channels;
+	runtime->hw.period_bytes_min = M2_PREVIEW_PERIOD * channels * 2;
+	runtime->hw.period_bytes_max = runtime->hw.period_bytes_min;
+	runtime->hw.buffer_bytes_max = M2_PREVIEW_PERIODS_MAX * runtime->hw.period_bytes_min;
+
+	err = snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_RATE, marian_hw_rule_rate,
+				  substream, SNDRV_PCM_HW_PARAM_RATE, -1);
+	if (err < 0)
+		return err;
+
+	WRITE_ONCE(marian->preview_substream, substream);
+
+	snd_pcm_set_sync(substream);
+
+	return 0;
+}
+
+static int marian_preview_release(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+
+	WRITE_ONCE(marian->preview_substream, NULL);
+	cancel_work_sync(&marian->preview_work);
+
+	return 0;
+}
+
+/*
+ * The preview holds the card rate like any other substream. Started first,
+ * it sets integer samples, which its filter takes directly; otherwise it
+ * takes whatever format the others have set.
+ */
+static int marian_preview_hw_params(struct snd_pcm_substream *substream,
+				    struct snd_pcm_hw_params *params)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+	unsigned int rate = params_rate(params) * M2_PREVIEW_DECIMATION;
+	bool same;
+
+	mutex_lock(&marian->reg_mutex);
+	same = marian->hw_holders && rate == marian->hw_rate;
+	if (!same && marian_hw_pinned(marian, substream)) {
+		mutex_unlock(&marian->reg_mutex);
+		return -EBUSY;
+	}
+
+	if (!same) {
+		marian_m2_set_speedmode(marian, rate);
+		marian_m2_set_format(marian, SNDRV_PCM_FORMAT_S32_LE);
+		marian->hw_rate = rate;
+		marian->hw_format = SNDRV_PCM_FORMAT_S32_LE;
+	}
+	WRITE_ONCE(marian->hw_holders, marian->hw_holders | marian_hw_bit(substream));
+	mutex_unlock(&marian->reg_mutex);
+
+	snd_pcm_set_runtime_buffer(substream, &marian->preview_buf);
+
+	return 0;
+}
+
+static int marian_preview_prepare(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+
+	cancel_work_sync(&marian->preview_work);
+	marian->preview_pos = 0;
+	marian->preview_done = 0;
+	memset(marian->preview_hist, 0, sizeof(marian->preview_hist));
+
+	return marian_m2_prepare(substream);
+}
+
+static snd_pcm_uframes_t marian_preview_pointer(struct snd_pcm_substream *substream)
+{
+	struct marian_card *marian = snd_pcm_substream_chip(substream);
+
+	return READ_ONCE(marian->preview_pos);
+}
+
+static const struct snd_pcm_ops marian_preview_ops = {
+	.open = marian_preview_open,
+	.close = marian_preview_release,
+	.hw_params = marian_preview_hw_params,
+	.hw_free = snd_marian_hw_free,
+	.prepare = marian_preview_prepare,
+	.trigger = snd_marian_trigger,
+	.sync_stop = snd_marian_sync_stop,
+	.pointer = marian_preview_pointer,
+};
+
+static void construct_playback_buffer(struct marian_card *marian)
+{
+	marian->playback_buf = marian->dmabuf;
+	marian->playback_buf.area += SUBSTREAM_BUF_SIZE;
+	marian->playback_buf.addr += SUBSTREAM_BUF_SIZE;
+	marian->playback_buf.bytes = SUBSTREAM_BUF_SIZE;
+}
+
+static void construct_capture_buffer(struct marian_card *marian)
+{
+	marian->capture_buf = marian->dmabuf;
+	marian->capture_buf.bytes = SUBSTREAM_BUF_SIZE;
+}
+
+// The status page, read only, for the hwdep device and the status.bin proc file
+static int marian_status_mmap(struct marian_card *marian, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+#else
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_pfn_range(vma, vma->vm_start, virt_to_phys(marian->status) >> PAGE_SHIFT,
+			       PAGE_SIZE, vma->vm_page_prot);
+}
+
+static ssize_t marian_status_bin_read(struct snd_info_entry *entry, void *file_private_data,
+				      struct file *file, char __user *buf, size_t count,
+				      loff_t pos)
+{
+	struct marian_card *marian = entry->private_data;
+	struct marian_hwdep_status status;
+
+	if (pos >= sizeof(status))
+		return 0;
+	count = min_t(size_t, count, sizeof(status) - pos);
+
+	spin_lock_irq(&marian->lock);
+	status = *marian->status;
+	spin_unlock_irq(&marian->lock);
+
+	if (copy_to_user(buf, (u8 *)&status + pos, count))
+		return -EFAULT;
+
+	return count;
+}
+
+static int marian_status_bin_mmap(struct snd_info_entry *entry, void *file_private_data,
+				  struct inode *inode, struct file *file,
+				  struct vm_area_struct *vma)
+{
+	return marian_status_mmap(entry->private_data, vma);
+}
+
+static const struct snd_info_entry_ops marian_status_bin_ops = {
+	.read = marian_status_bin_read,
+	.mmap = marian_status_bin_mmap,
+};
+
+static bool marian_hwdep_pending(struct marian_card *marian)
+{
+	return READ_ONCE(marian->status->periods) != READ_ONCE(marian->hwdep_periods);
+}
+
+static int marian_hwdep_set_eventfd(struct marian_card *marian, int fd)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+
+	spin_lock_irq(&marian->lock);
+	old = marian->eventfd;
+	marian->eventfd = ctx;
+	spin_unlock_irq(&marian->lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+static int marian_hwdep_open(struct snd_hwdep *hw, struct file *file)
+{
+	struct marian_card *marian = hw->private_data;
+
+	// Only periods completed from now on are reported
+	spin_lock_irq(&marian->lock);
+	marian->hwdep_periods = marian->status->periods;
+	spin_unlock_irq(&marian->lock);
+
+	return 0;
+}
+
+static int marian_hwdep_release(struct snd_hwdep *hw, struct file *file)
+{
+	return marian_hwdep_set_eventfd(hw->private_data, -1);
+}
+
+// Waits for the next period and returns the period counter, like a timerfd
+static long marian_hwdep_read(struct snd_hwdep *hw, char __user *buf, long count,
+			      loff_t *offset)
+{
+	struct marian_card *marian = hw->private_data;
+	u64 periods;
+	int err;
+
+	if (count < sizeof(periods))
+		return -EINVAL;
+
+	err = wait_event_interruptible(marian->hwdep_wait, marian_hwdep_pending(marian));
+	if (err)
+		return err;
+
+	spin_lock_irq(&marian->lock);
+	periods = marian->status->periods;
+	marian->hwdep_periods = periods;
+	spin_unlock_irq(&marian->lock);
+
+	if (copy_to_user(buf, &periods, sizeof(periods)))
+		return -EFAULT;
+
+	return sizeof(periods);
+}
+
+static __poll_t marian_hwdep_poll(struct snd_hwdep *hw, struct file *file, poll_table *wait)
+{
+	struct marian_card *marian = hw->private_data;
+
+	poll_wait(file, &marian->hwdep_wait, wait);
+
+	return marian_hwdep_pending(marian) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static unsigned long marian_dma_pfn(struct marian_card *marian)
+{
+	return page_to_pfn(virt_to_page(marian->dmabuf.area));
+}
+
+// Page of the DMA buffer backing a page of the mapping
+static unsigned long marian_dma_index(struct vm_area_struct *vma, unsigned long addr)
+{
+	return vma->vm_pgoff - (MARIAN_HWDEP_MMAP_DMA >> PAGE_SHIFT) +
+	       ((addr - vma->vm_start) >> PAGE_SHIFT);
+}
+
+static vm_fault_t marian_dma_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct marian_card *marian = vma->vm_private_data;
+	unsigned long idx = marian_dma_index(vma, vmf->address & PAGE_MASK);
+
+	if (idx >= PAGE_ALIGN(marian->dmabuf.bytes) >> PAGE_SHIFT)
+		return VM_FAULT_SIGBUS;
+
+	return vmf_insert_pfn(vma, vmf->address & PAGE_MASK, marian_dma_pfn(marian) + idx);
+}
+
+#ifdef M2_HUGE_DMA_MMAP
+/*
+ * Map a whole 2 MiB block of the buffer with one PMD where the user address
+ * and the physical block line up. A period of DSP over every channel slot
+ * of a direction then stays within one TLB entry instead of a few hundred.
+ */
+static vm_fault_t marian_dma_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct marian_card *marian = vma->vm_private_data;
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long idx, pfn;
+
+	if (order != PMD_ORDER)
+		return VM_FAULT_FALLBACK;
+
+	if (addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	idx = marian_dma_index(vma, addr);
+	pfn = marian_dma_pfn(marian) + idx;
+	if (!IS_ALIGNED(pfn, PMD_SIZE >> PAGE_SHIFT) ||
+	    (idx << PAGE_SHIFT) + PMD_SIZE > PAGE_ALIGN(marian->dmabuf.bytes))
+		return VM_FAULT_FALLBACK;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+	return vmf_insert_pfn_pmd(vmf, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#else
+	return vmf_insert_pfn_pmd(vmf, __pfn_to_pfn_t(pfn, PFN_DEV), vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+#endif
+
+static const struct vm_operations_struct marian_dma_vm_ops = {
+	.fault = marian_dma_fault,
+#ifdef M2_HUGE_DMA_MMAP
+	.huge_fault = marian_dma_huge_fault,
+#endif
+};
+
+/*
+ * Pages are inserted at fault time rather than all at once, so the huge
+ * fault handler gets a chance at every 2 MiB block first. Private mappings
+ * would need copy-on-write of raw PFNs, which the fault path can't do.
+ */
+static int marian_dma_mmap(struct marian_card *marian, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (size > PAGE_ALIGN(marian->dmabuf.bytes))
+		return -EINVAL;
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_HUGEPAGE);
+#else
+	vma->vm_flags |= VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_HUGEPAGE;
+#endif
+	vma->vm_ops = &marian_dma_vm_ops;
+	vma->vm_private_data = marian;
+
+	return 0;
+}
+
+static int marian_hwdep_mmap(struct snd_hwdep *hw, struct file *file, struct vm_area_struct *vma)
+{
+	struct marian_card *marian = hw->private_data;
+
+	switch (vma->vm_pgoff << PAGE_SHIFT) {
+	case MARIAN_HWDEP_MMAP_STATUS:
+		return marian_status_mmap(marian, vma);
+	case MARIAN_HWDEP_MMAP_DMA:
+		return marian_dma_mmap(marian, vma);
+	default:
+		return -EINVAL;
+	}
+}
+
+// Card frame the DMA engine is at, as the status page counts them. Called with lock held
+static u64 marian_engine_frame(struct marian_card *marian)
+{
+	if (!marian->running)
+		return 0;
+
+	return marian->frames + marian_read(marian, SERAPH_RD_HWPOINTER) % M2_PERIOD_FRAMES;
+}
+
+/*
+ * Frames until the DMA engine gets to where a prepared substream waits, 0 if
+ * it is there or has passed it by less than M2_START_SLACK. Prepare put the
+ * pointer where the engine was then, and the prefill goes from there, so
+ * that is where the substream has to start. Called with the stream lock
+ * held.
+ */
+static snd_pcm_uframes_t marian_start_wait(struct marian_card *marian,
+					   struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	snd_pcm_uframes_t pos, passed;
+
+	// Mixed clients keep their own position
+	if (!READ_ONCE(marian->running) || marian_mixed_client(substream))
+		return 0;
+
+	pos = marian_dma_pos(marian, substream) % runtime->buffer_size;
+	passed = (pos + runtime->buffer_size - runtime->status->hw_ptr % runtime->buffer_size) %
+		 runtime->buffer_size;
+
+	return passed < M2_START_SLACK ? 0 : runtime->buffer_size - passed;
+}
+
+/*
+ * Start the substream if it is prepared and the engine is at its position.
+ * Returns the frames it still has to wait, 0 if there is nothing to wait for.
+ */
+static snd_pcm_uframes_t marian_start_substream(struct marian_card *marian,
+						struct snd_pcm_substream *substream)
+{
+	snd_pcm_uframes_t wait = 0;
+	unsigned long flags;
+
+	if (!substream)
+		return 0;
+
+	snd_pcm_stream_lock_irqsave(substream, flags);
+	if (substream->runtime && substream->runtime->status->state == SNDRV_PCM_STATE_PREPARED) {
+		wait = marian_start_wait(marian, substream);
+		if (!wait && !snd_pcm_start(substream)) {
+			spin_lock(&marian->lock);
+			if (!marian->start_groups++) {
+				marian->start_ns = ktime_get_ns();
+				marian->start_frame = marian_engine_frame(marian);
+			}
+			spin_unlock(&marian->lock);
+		}
+	}
+	snd_pcm_stream_unlock_irqrestore(substream, flags);
+
+	return wait;
+}
+
+/*
+ * A soft timer, so the stream locks may sleep on PREEMPT_RT; the start is
+ * only as late as the timer softirq. Substreams joining a running engine
+ * are started one by one as it gets to their position, within the ring,
+ * and the timer comes back for those it hasn't got to yet. Members of a
+ * linked group are already running when the loop gets to them and are
+ * skipped.
+ */
+static enum hrtimer_restart marian_start_timer_fn(struct hrtimer *timer)
+{
+	struct marian_card *marian = container_of(timer, struct marian_card, start_timer);
+	struct snd_pcm_substream *substream;
+	snd_pcm_uframes_t wait, next = 0;
+	unsigned long flags;
+	unsigned int i, mhz;
+
+	for (i = 0; i < M2_PLAYBACK_SUBSTREAMS + M2_CAPTURE_SUBSTREAMS; i++) {
+		if (i < M2_PLAYBACK_SUBSTREAMS)
+			substream = READ_ONCE(marian->playback_substream[i]);
+		else
+			substream = READ_ONCE(marian->capture_substream[i - M2_PLAYBACK_SUBSTREAMS]);
+
+		wait = marian_start_substream(marian, substream);
+		if (wait && (!next || wait < next))
+			next = wait;
+	}
+
+	if (next) {
+		// Past the position rather than short of it, at the fastest rate if unknown
+		mhz = marian_nominal_mhz(marian) ?: FREQ_MAX * 1000;
+		hrtimer_forward_now(timer, ns_to_ktime(mul_u64_u64_div_u64(next + M2_START_SLACK / 2,
+									   NSEC_PER_SEC * 1000ULL,
+									   mhz)));
+		return HRTIMER_RESTART;
+	}
+
+	spin_lock_irqsave(&marian->lock, flags);
+	if (!marian->start_groups) {
+		marian->start_ns = ktime_get_ns();
+		marian->start_frame = marian_engine_frame(marian);
+	}
+	marian->start_done = true;
+	spin_unlock_irqrestore(&marian->lock, flags);
+
+	wake_up_interruptible(&marian->hwdep_wait);
+
+	return HRTIMER_NORESTART;
+}
+
+static int marian_hwdep_start(struct marian_card *marian, struct marian_hwdep_start *start)
+{
+	struct marian_hwdep_status *status = marian->status;
+	unsigned int mhz;
+	u64 when, ref;
+	int err;
+
+	spin_lock_irq(&marian->lock);
+	if (marian->start_pending) {
+		spin_unlock_irq(&marian->lock);
+		return -EBUSY;
+	}
+
+	when = start->tstamp_ns;
+	if (!start->tstamp_ns) {
+		// Count forward from the last period at the nominal rate
+		mhz = marian_nominal_mhz(marian);
+		if (!marian->running || !mhz || !status->tstamp_ns) {
+			spin_unlock_irq(&marian->lock);
+			return -EINVAL;
+		}
+
+		ref = status->frames + status->hw_pointer % M2_PERIOD_FRAMES;
+		when = status->tstamp_ns;
+		if (start->frame > ref)
+			when += mul_u64_u64_div_u64(start->frame - ref, NSEC_PER_SEC * 1000ULL, mhz);
+	}
+
+	marian->start_pending = true;
+	marian->start_done = false;
+	marian->start_groups = 0;
+	spin_unlock_irq(&marian->lock);
+
+	hrtimer_start(&marian->start_timer, ns_to_ktime(when), HRTIMER_MODE_ABS_SOFT);
+
+	err = wait_event_interruptible(marian->hwdep_wait, READ_ONCE(marian->start_done));
+	if (err)
+		hrtimer_cancel(&marian->start_timer);
+
+	spin_lock_irq(&marian->lock);
+	marian->start_pending = false;
+	// The timer may have fired just as the wait was interrupted
+	if (marian->start_done) {
+		start->tstamp_ns = marian->start_ns;
+		start->frame = marian->start_frame;
+		start->groups = marian->start_groups;
+		err = 0;
+	}
+	spin_unlock_irq(&marian->lock);
+
+	return err;
+}
+
+/*
+ * A ring exported as a dma-buf. The export holds a reference on the DMA
+ * memory, not on the card, see struct marian_dma_mem.
+ */
+static struct sg_table *marian_export_map(struct dma_buf_attachment *attach,
+					  enum dma_data_direction dir)
+{
+	struct marian_export *exp = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int err;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	err = sg_alloc_table(sgt, 1, GFP_KERNEL);
+	if (err)
+		goto err_free;
+
+	// The DMA buffer is physically contiguous, one entry covers the ring
+	sg_set_page(sgt->sgl, virt_to_page(exp->buf.area), exp->buf.bytes, 0);
+
+	err = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (err)
+		goto err_table;
+
+	return sgt;
+
+err_table:
+	sg_free_table(sgt);
+err_free:
+	kfree(sgt);
+	return ERR_PTR(err);
+}
+
+static void marian_export_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+				enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static int marian_export_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct marian_export *exp = dmabuf->priv;
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       page_to_pfn(virt_to_page(exp->buf.area)) + vma->vm_pgoff,
+			       vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+static void marian_export_release(struct dma_buf *dmabuf)
+{
+	struct marian_export *exp = dmabuf->priv;
+	struct marian_dma_mem *mem = exp->mem;
+
+	mutex_lock(&mem->lock);
+	list_del(&exp->list);
+	WRITE_ONCE(mem->export_count, mem->export_count - 1);
+	mutex_unlock(&mem->lock);
+
+	kfree(exp);
+	marian_dma_mem_put(mem);
+}
+
+static const struct dma_buf_ops marian_export_ops = {
+	.map_dma_buf = marian_export_map,
+	.unmap_dma_buf = marian_export_unmap,
+	.mmap = marian_export_mmap,
+	.release = marian_export_release,
+};
+
+static int marian_hwdep_export(struct marian_card *marian, struct marian_hwdep_export *req)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(info);
+	struct marian_export *exp;
+	struct dma_buf *dmabuf;
+	int fd;
+
+	if (req->stream > SNDRV_PCM_STREAM_CAPTURE || req->flags & ~O_CLOEXEC)
+		return -EINVAL;
+
+	exp = kzalloc(sizeof(*exp), GFP_KERNEL);
+	if (!exp)
+		return -ENOMEM;
+	exp->mem = marian->dma_mem;
+	exp->stream = req->stream;
+	exp->buf = req->stream == SNDRV_PCM_STREAM_CAPTURE ? marian->capture_buf :
+							     marian->playback_buf;
+
+	info.ops = &marian_export_ops;
+	info.size = exp->buf.bytes;
+	info.flags = O_RDWR;
+	info.priv = exp;
+
+	dmabuf = dma_buf_export(&info);
+	if (IS_ERR(dmabuf)) {
+		kfree(exp);
+		return PTR_ERR(dmabuf);
+	}
+	exp->dmabuf = dmabuf;
+
+	kref_get(&exp->mem->ref);
+	mutex_lock(&exp->mem->lock);
+	list_add_tail(&exp->list, &exp->mem->exports);
+	WRITE_ONCE(exp->mem->export_count, exp->mem->export_count + 1);
+	mutex_unlock(&exp->mem->lock);
+
+	// Fence the period in progress rather than waiting for the next one
+	queue_work(system_highpri_wq, &marian->export_work);
+
+	fd = dma_buf_fd(dmabuf, req->flags);
+	if (fd < 0) {
+		// Goes through marian_export_release
+		dma_buf_put(dmabuf);
+		return fd;
+	}
+	req->fd = fd;
+
+	return 0;
+}
+
+static int marian_hwdep_ioctl(struct snd_hwdep *hw, struct file *file, unsigned int cmd,
+			      unsigned long arg)
+{
+	struct marian_card *marian = hw->private_data;
+	void __user *argp = (void __user *)arg;
+	struct marian_hwdep_export export;
+	struct marian_hwdep_start start;
+	struct marian_hwdep_info info;
+	int fd, err;
+
+	switch (cmd) {
+	case MARIAN_HWDEP_IOCTL_INFO:
+		memset(&info, 0, sizeof(info));
+		info.version = MARIAN_HWDEP_VERSION;
+		info.channels = M2_CHANNELS_COUNT;
+		info.period_frames = M2_PERIOD_FRAMES;
+		info.buffer_frames = SUBSTREAM_BUF_SIZE / M2_FRAME_SIZE;
+		info.sample_bytes = 4;
+		info.channel_bytes = M2_CHANNEL_BUF_SIZE;
+		info.capture_offset = marian->capture_buf.area - marian->dmabuf.area;
+		info.playback_offset = marian->playback_buf.area - marian->dmabuf.area;
+		info.dma_bytes = PAGE_ALIGN(marian->dmabuf.bytes);
+
+		return copy_to_user(argp, &info, sizeof(info)) ? -EFAULT : 0;
+	case MARIAN_HWDEP_IOCTL_EVENTFD:
+		if (get_user(fd, (int __user *)argp))
+			return -EFAULT;
+
+		return marian_hwdep_set_eventfd(marian, fd);
+	case MARIAN_HWDEP_IOCTL_START:
+		if (copy_from_user(&start, argp, sizeof(start)))
+			return -EFAULT;
+
+		err = marian_hwdep_start(marian, &start);
+		if (err)
+			return err;
+
+		return copy_to_user(argp, &start, sizeof(start)) ? -EFAULT : 0;
+	case MARIAN_HWDEP_IOCTL_EXPORT:
+		if (copy_from_user(&export, argp, sizeof(export)))
+			return -EFAULT;
+
+		err = marian_hwdep_export(marian, &export);
+		if (err)
+			return err;
+
+		// The fd is installed already, and stays so: it's the caller's now
+		return copy_to_user(argp, &export, sizeof(export)) ? -EFAULT : 0;
+	}
+
+	return -ENOIOCTLCMD;
+}
+
+static int marian_hwdep_create(struct marian_card *marian)
+{
+	struct snd_hwdep *hw;
+	int err;
+
+	err = snd_hwdep_new(marian->card, M2_CARD_NAME, 0, &hw);
+	if (err < 0)
+		return err;
+
+	// The status page carries a single read() position, so one client at a time
+	hw->exclusive = 1;
+	hw->private_data = marian;
+	hw->ops.open = marian_hwdep_open;
+	hw->ops.release = marian_hwdep_release;
+	hw->ops.read = marian_hwdep_read;
+	hw->ops.poll = marian_hwdep_poll;
+	hw->ops.mmap = marian_hwdep_mmap;
+	hw->ops.ioctl = marian_hwdep_ioctl;
+	hw->ops.ioctl_compat = marian_hwdep_ioctl;
+
+	init_waitqueue_head(&marian->hwdep_wait);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&marian->start_timer, marian_start_timer_fn, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_ABS_SOFT);
+#else
+	hrtimer_init(&marian->start_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	marian->start_timer.function = marian_start_timer_fn;
+#endif
+	marian->hwdep = hw;
+
+	return 0;
+}
+
+/*
+ * The period interrupt as a card timer, one tick per period. Starting it
+ * runs the DMA engine like a started substream would, so it ticks with no
+ * PCM open; channels stay unarmed unless a stream has been prepared.
+ */
+static unsigned long marian_timer_resolution(struct snd_timer *timer)
+{
+	struct marian_card *marian = snd_timer_chip(timer);
+	unsigned int mhz = marian_nominal_mhz(marian);
+
+	if (!mhz)
+		return timer->hw.resolution;
+
+	return div_u64((u64)M2_PERIOD_FRAMES * NSEC_PER_SEC * 1000, mhz);
+}
+
+static int marian_timer_start(struct snd_timer *timer)
+{
+	struct marian_card *marian = snd_timer_chip(timer);
 
-	marian->is_controls_initialized = true;
+	spin_lock(&marian->lock);
+	if (!marian->timer_running) {
+		WRITE_ONCE(marian->timer_running, true);
+		marian_engine_get(marian);
+	}
+	spin_unlock(&marian->lock);
+
+	return 0;
 }
 
-static void snd_marian_card_free(struct snd_card *card)
+static int marian_timer_stop(struct snd_timer *timer)
 {
-	struct marian_card *marian = card->private_data;
+	struct marian_card *marian = snd_timer_chip(timer);
 
-	if (!marian)
+	spin_lock(&marian->lock);
+	if (marian->timer_running) {
+		WRITE_ONCE(marian->timer_running, false);
+		marian_engine_put(marian);
+	}
+	spin_unlock(&marian->lock);
+	marian_fence_signal(marian);
+
+	return 0;
+}
+
+static const struct snd_timer_hardware marian_timer_hw = {
+	.flags = SNDRV_TIMER_HW_AUTO,
+	.resolution = (u64)M2_PERIOD_FRAMES * NSEC_PER_SEC / 48000,
+	.ticks = 1,
+	.c_resolution = marian_timer_resolution,
+	.start = marian_timer_start,
+	.stop = marian_timer_stop,
+};
+
+static int marian_timer_create(struct marian_card *marian)
+{
+	struct snd_timer_id tid = {
+		.dev_class = SNDRV_TIMER_CLASS_CARD,
+		.dev_sclass = SNDRV_TIMER_SCLASS_NONE,
+		.card = marian->card->number,
+		.device = 0,
+		.subdevice = 0,
+	};
+	struct snd_timer *timer;
+	int err;
+
+	err = snd_timer_new(marian->card, M2_CARD_NAME, &tid, &timer);
+	if (err < 0)
+		return err;
+
+	strscpy(timer->name, M2_CARD_NAME " period", sizeof(timer->name));
+	timer->private_data = marian;
+	timer->hw = marian_timer_hw;
+	marian->timer = timer;
+
+	return 0;
+}
+
+/*
+ * Stop streams that no longer match the incoming clock so userspace notices.
+ * Called with the open mutex of the substream's PCM held.
+ */
+static void marian_stop_mismatched(struct marian_card *marian,
+				   struct snd_pcm_substream *substream)
+{
+	unsigned int div;
+	unsigned long flags;
+
+	if (!substream)
 		return;
 
-	snd_dma_free_pages(&marian->dmabuf);
+	div = marian_preview(substream) ? M2_PREVIEW_DECIMATION : 1;
 
-	if (marian->irq >= 0)
-		free_irq(marian->irq, (void *)marian);
+	snd_pcm_stream_lock_irqsave(substream, flags);
+	if (substream->runtime && snd_pcm_running(substream) &&
+	    substream->runtime->rate * div != marian->ext_rate) {
+		snd_pcm_stop(substream, SNDRV_PCM_STATE_XRUN);
 
-	if (marian->iobase)
-		pci_iounmap(marian->pci, marian->iobase);
+		spin_lock(&marian->lock);
+		marian->xruns++;
+		spin_unlock(&marian->lock);
+	}
+	snd_pcm_stream_unlock_irqrestore(substream, flags);
+}
 
-	if (marian->port)
-		pci_release_regions(marian->pci);
+/*
+ * Rate of the sync bus. With fresh set, it is measured unless that was done
+ * in this monitor pass already, otherwise a measurement a few passes old
+ * will do.
+ */
+static unsigned int marian_m2_syncbus_rate(struct marian_card *marian, bool fresh)
+{
+	unsigned int age = marian->monitor_passes - marian->syncbus_pass;
+
+	if (!age || (!fresh && age < M2_SYNCBUS_POLLS))
+		return marian->syncbus_rate;
 
-	pci_disable_device(marian->pci);
+	marian->syncbus_rate = marian_snap_rate(marian_measure_freq(marian, M2_CLOCK_SRC_SYNCBUS));
+	marian->syncbus_pass = marian->monitor_passes;
+
+	return marian->syncbus_rate;
 }
 
-static void marian_proc_status_generic(struct marian_card *marian, struct snd_info_buffer *buffer)
+/*
+ * Rate a clock source could be switched to now, 0 if it has no usable
+ * signal. Only a fresh look will do for the source in use and for one to
+ * fail over to.
+ */
+static unsigned int marian_m2_source_rate(struct marian_card *marian, u8 source,
+					  const unsigned int *input_rate, bool fresh)
 {
-	snd_iprintf(buffer, "*** Card registers\n");
-	snd_iprintf(buffer, "RD 0x064: %08x (SPI bits written)\n", ioread32(marian->iobase + 0x64));
-	snd_iprintf(buffer, "RD 0x068: %08x (SPI bits read)\n", ioread32(marian->iobase + 0x68));
-	snd_iprintf(buffer, "RD 0x070: %08x (SPI bits status)\n", ioread32(marian->iobase + 0x70));
-	snd_iprintf(buffer, "RD 0x088: %08x (Super clock measurement)\n",
-		    ioread32(marian->iobase + 0x88));
-	snd_iprintf(buffer, "RD 0x08C: %08x (HW Pointer)\n",
-		    ioread32(marian->iobase + SERAPH_RD_HWPOINTER));
-	snd_iprintf(buffer, "RD 0x094: %08x (Word clock measurement)\n",
-		    ioread32(marian->iobase + 0x88));
-	snd_iprintf(buffer, "RD 0x0F8: %08x (Extension board)\n",
-		    ioread32(marian->iobase + 0xF8));
-	snd_iprintf(buffer, "RD 0x244: %08x (DMA debug)\n",
-		    ioread32(marian->iobase + 0x244));
+	switch (source) {
+	case M2_CLOCK_SRC_DCO:
+		return marian->dco;
+	case M2_CLOCK_SRC_MADI1:
+	case M2_CLOCK_SRC_MADI2:
+		return marian_snap_rate(input_rate[source - M2_CLOCK_SRC_MADI1]);
+	case M2_CLOCK_SRC_SYNCBUS:
+		return marian_m2_syncbus_rate(marian, fresh);
+	default:
+		return marian_snap_rate(marian_measure_freq(marian, source));
+	}
+}
 
-	snd_iprintf(buffer, "\n*** Card status\n");
-	snd_iprintf(buffer, "Firmware build: %08x\n", ioread32(marian->iobase + 0xFC));
-	snd_iprintf(buffer, "Clock master : %s\n", (marian->clock_source == 1) ? "yes" : "no");
-	snd_iprintf(buffer, "DCO frequency: %d Hz\n", marian->dco);
+/*
+ * Before falling back from an external source to the DCO, the DCO is tuned
+ * to the rate the source was last measured at, drift included. The DMA
+ * engine keeps running through the switch and the rate the streams were
+ * set up for stays the same. Another external source brings its own rate.
+ */
+static void marian_m2_failover_to(struct marian_card *marian, u8 source)
+{
+	unsigned int old = marian->clock_source;
+	s64 drift;
+	u64 mhz;
+
+	if (source == M2_CLOCK_SRC_DCO && old != M2_CLOCK_SRC_DCO && marian->ext_rate) {
+		spin_lock_irq(&marian->lock);
+		drift = marian->drift_ppb;
+		spin_unlock_irq(&marian->lock);
+
+		mhz = marian->ext_rate * 1000ULL;
+		if (abs(drift) < M2_DRIFT_MAX_PPB)
+			mhz += div_s64((s64)mhz * drift, NSEC_PER_SEC);
+
+		mutex_lock(&marian->reg_mutex);
+		marian_generic_set_dco_mhz(marian, clamp_t(u64, mhz, FREQ_MIN * 1000ULL,
+							   FREQ_MAX * 1000ULL));
+		mutex_unlock(&marian->reg_mutex);
+	}
+
+	dev_info(marian->card->dev, "Sample clock source %u -> %u\n", old, source);
+	marian_m2_set_clock_source(marian, source);
+	marian->failback_polls = 0;
+	snd_ctl_notify(marian->card, SNDRV_CTL_EVENT_MASK_VALUE,
+		       &marian->clock_source_control->id);
 }
 
-static void snd_marian_proc_status(struct snd_info_entry *entry, struct snd_info_buffer *buffer)
+/*
+ * Walks the priority list down to the source in use. If that one has lost
+ * its signal, the first usable source after it takes over right away. While
+ * it is fine, a source ahead of it is only switched back to after it has
+ * been usable at the same rate for M2_FAILBACK_POLLS passes in a row.
+ */
+static void marian_m2_clock_failover(struct marian_card *marian, const unsigned int *input_rate)
 {
-	struct marian_card *marian = entry->private_data;
-	u8 v1, v2;
+	unsigned int current_rate, rate, i;
+	u8 priority[M2_CLOCK_PRIORITIES];
+	u8 source;
 
-	marian_proc_status_generic(marian, buffer);
+	mutex_lock(&marian->reg_mutex);
+	memcpy(priority, marian->clock_priority, sizeof(priority));
+	mutex_unlock(&marian->reg_mutex);
 
-	snd_iprintf(buffer, "\n*** MADI FPGA registers\n");
-	snd_iprintf(buffer, "M2 MADI 00h: %02x\n", marian_m2_spi_read(marian, 0x00));
-	snd_iprintf(buffer, "M2 MADI 01h: %02x\n", marian_m2_spi_read(marian, 0x01));
-	snd_iprintf(buffer, "M2 MADI 02h: %02x\n", marian_m2_spi_read(marian, 0x02));
-	snd_iprintf(buffer, "M2 MADI 40h: %02x\n", marian->shadow_40);
-	snd_iprintf(buffer, "M2 MADI 41h: %02x\n", marian->shadow_41);
-	snd_iprintf(buffer, "M2 MADI 42h: %02x\n", marian->shadow_42);
+	current_rate = marian_m2_source_rate(marian, marian->clock_source, input_rate, true);
 
-	snd_iprintf(buffer, "\n*** MADI FPGA status\n");
-	snd_iprintf(buffer, "MADI FPGA firmware: 0x%02x\n", marian_m2_spi_read(marian, 0x02));
+	for (i = 0; i < M2_CLOCK_PRIORITIES; i++) {
+		source = priority[i];
+		if (source == marian->clock_source) {
+			if (current_rate)
+				break;
+			continue;
+		}
+
+		rate = marian_m2_source_rate(marian, source, input_rate, !current_rate);
+		if (!rate)
+			continue;
+
+		if (!current_rate) {
+			marian_m2_failover_to(marian, source);
+			return;
+		}
+
+		if (rate == current_rate) {
+			if (++marian->failback_polls >= M2_FAILBACK_POLLS)
+				marian_m2_failover_to(marian, source);
+			return;
+		}
+	}
+
+	marian->failback_polls = 0;
+}
+
+/*
+ * Periodically checks the inputs' sync state and, while slaved, the rate
+ * of the clock source. Changes are reported through control notifications.
+ */
+static void marian_monitor_work(struct work_struct *work)
+{
+	struct marian_card *marian = container_of(to_delayed_work(work), struct marian_card,
+						  monitor_work);
+	unsigned int input_rate[2];
+	unsigned int rate = 0;
+	unsigned int port, i;
+	u8 sync, modes;
+
+	marian->monitor_passes++;
+
+	sync = marian_m2_spi_read(marian, 0x00);
+	modes = marian_m2_spi_read(marian, 0x01);
+
+	for (port = 0; port < 2; port++) {
+		if (((sync ^ marian->sync_state) >> (port * 2)) & 0x3)
+			snd_ctl_notify(marian->card, SNDRV_CTL_EVENT_MASK_VALUE,
+				       &marian->sync_control[port]->id);
+
+		input_rate[port] = 0;
+		if ((sync >> (port * 2)) & 0x3)
+			input_rate[port] = marian_measure_freq(marian, M2_CLOCK_SRC_MADI1 + port);
+	}
+
+	if (READ_ONCE(marian->clock_failover))
+		marian_m2_clock_failover(marian, input_rate);
 
-	snd_iprintf(buffer, "Clock source: ");
 	switch (marian->clock_source) {
-	case 1:
-		snd_iprintf(buffer, "Internal DCO\n");
-		break;
-	case 2:
-		snd_iprintf(buffer, "Sync bus\n");
+	case M2_CLOCK_SRC_DCO:
 		break;
-	case 4:
-		snd_iprintf(buffer, "MADI Input 1\n");
+	case M2_CLOCK_SRC_MADI1:
+	case M2_CLOCK_SRC_MADI2:
+		rate = marian_snap_rate(input_rate[marian->clock_source - M2_CLOCK_SRC_MADI1]);
 		break;
-	case 5:
-		snd_iprintf(buffer, "MADI Input 2\n");
+	case M2_CLOCK_SRC_SYNCBUS:
+		rate = marian_m2_syncbus_rate(marian, true);
 		break;
 	default:
-		snd_iprintf(buffer, "UNKNOWN\n");
+		if (marian_m2_source_locked(marian, sync))
+			rate = marian_snap_rate(marian_measure_freq(marian, marian->clock_source));
 		break;
 	}
 
-	snd_iprintf(buffer, "Sample format: %s, %s Endian, %s first\n",
-		    (marian->shadow_41 & (1 << M2_INT_FLOAT)) ? "Float" : "Integer",
-		    (marian->shadow_41 & (1 << M2_ENDIANNESS)) ? "Little" : "Big",
-		    (marian->shadow_41 & (1 << M2_BIT_ORDER)) ? "LSB" : "MSB");
-
-	v1 = marian_m2_spi_read(marian, 0x00);
-	v2 = marian_m2_spi_read(marian, 0x01);
-
-	snd_iprintf(buffer, "MADI port 1 input: ");
-	if (!(v1 & 0x03))
-		snd_iprintf(buffer, "No signal\n");
-	else
-		snd_iprintf(buffer, "%s, %dch, %dkHz frame, %u Hz\n",
-			    (v1 & 0x02) ? "sync" : "lock", (v2 & 0x01) ? 64 : 56,
-			    (v2 & 0x02) ? 96 : 48, marian_measure_freq(marian, 4));
+	spin_lock_irq(&marian->lock);
+	WRITE_ONCE(marian->sync_state, sync);
+	WRITE_ONCE(marian->input_modes, modes);
+	WRITE_ONCE(marian->input_rate[0], input_rate[0]);
+	WRITE_ONCE(marian->input_rate[1], input_rate[1]);
+	marian->monitor_ns = ktime_get_ns();
+	marian_status_update(marian, 0, 0, false);
+	spin_unlock_irq(&marian->lock);
+
+	if (rate != marian->ext_rate) {
+		if (rate)
+			dev_dbg(marian->card->dev, "External clock at %u Hz\n", rate);
+		else if (marian->ext_rate)
+			dev_dbg(marian->card->dev, "External clock lost\n");
+
+		spin_lock_irq(&marian->lock);
+		WRITE_ONCE(marian->ext_rate, rate);
+		marian_status_update(marian, 0, 0, false);
+		spin_unlock_irq(&marian->lock);
+		snd_ctl_notify(marian->card, SNDRV_CTL_EVENT_MASK_VALUE,
+			       &marian->ext_rate_control->id);
+
+		// The open mutexes keep the substreams from being closed under us
+		if (marian->clock_source != M2_CLOCK_SRC_DCO) {
+			mutex_lock(&marian->pcm->open_mutex);
+			for (i = 0; i < M2_PLAYBACK_SUBSTREAMS; i++)
+				marian_stop_mismatched(marian, marian->playback_substream[i]);
+			for (i = 0; i < M2_CAPTURE_SUBSTREAMS; i++)
+				marian_stop_mismatched(marian, marian->capture_substream[i]);
+			mutex_unlock(&marian->pcm->open_mutex);
+
+			mutex_lock(&marian->preview_pcm->open_mutex);
+			marian_stop_mismatched(marian, marian->preview_substream);
+			mutex_unlock(&marian->preview_pcm->open_mutex);
+		}
+	}
 
-	snd_iprintf(buffer, "MADI port 2 input: ");
-	if (!(v1 & 0x0C))
-		snd_iprintf(buffer, "No signal\n");
-	else
-		snd_iprintf(buffer, "%s, %dch, %dkHz frame, %u Hz\n",
-			    (v1 & 0x08) ? "sync" : "lock",
-			    (v2 & 0x04) ? 64 : 56, (v2 & 0x08) ? 96 : 48,
-			    marian_measure_freq(marian, 5));
+	schedule_delayed_work(&marian->monitor_work, msecs_to_jiffies(M2_MONITOR_INTERVAL_MS));
 }
 
-static void marian_m2_proc_ports(struct marian_card *marian,
-				 struct snd_info_buffer *buffer, unsigned int type)
+static int marian_m2_init(struct marian_card *marian)
 {
-	int i;
+	unsigned int i;
 
-	for (i = 0; i < M2_CHANNELS_COUNT; i++)
-		snd_iprintf(buffer, "%d=MADI p%dch%02d\n", i + 1, i / 64 + 1, i % 64 + 1);
-}
+	// reset DMA engine
+	marian_write(marian, 0x00, 0x00000000);
 
-static void snd_marian_proc_ports_in(struct snd_info_entry *entry, struct snd_info_buffer *buffer)
-{
-	struct marian_card *marian = entry->private_data;
+	// disable play interrupt
+	marian_write(marian, SERAPH_WR_IE_ENABLE, M2_DISABLE_PLAY_IRQ);
 
-	snd_iprintf(buffer, "# generated by MARIAN Seraph driver\n");
-	marian_m2_proc_ports(marian, buffer, MARIAN_PORTS_TYPE_INPUT);
+	marian_generic_set_speedmode(marian, RATE_SLOW);
+
+	// init internal clock and set it as clock source
+	marian_m2_set_clock_source(marian, 1);
+
+	marian->clock_priority[0] = M2_CLOCK_SRC_MADI1;
+	marian->clock_priority[1] = M2_CLOCK_SRC_MADI2;
+	marian->clock_priority[2] = M2_CLOCK_SRC_SYNCBUS;
+	marian->clock_priority[3] = M2_CLOCK_SRC_DCO;
+
+	// init SPI clock divider
+	marian_write(marian, MARIAN_SPI_CLOCK_DIVIDER, 0x1F);
+
+	marian->shadow_40 = 0x00;
+	marian->shadow_41 = (1 << M2_TX_ENABLE);
+	marian->shadow_42 = (1 << M2_PORT1_MODE) | (1 << M2_PORT2_MODE);
+
+	marian->is_controls_initialized = false;
+
+	for (i = 0; i < M2_MONITOR_ROUTES; i++) {
+		marian->routes[i].src = -1;
+		marian->routes[i].gain = 1 << M2_ROUTE_GAIN_SHIFT;
+	}
+
+	marian->compact = 0;
+	marian_m2_update_layout(marian, SNDRV_PCM_STREAM_PLAYBACK);
+	marian_m2_update_layout(marian, SNDRV_PCM_STREAM_CAPTURE);
+
+	marian_m2_spi_write(marian, 0x40, marian->shadow_40);
+	marian_m2_spi_write(marian, 0x41, marian->shadow_41);
+	marian_m2_spi_write(marian, 0x42, marian->shadow_42);
+
+	marian->firmware = marian_read(marian, 0xFC);
+	marian->fpga_firmware = marian_m2_spi_read(marian, 0x02);
+
+	return 0;
 }
 
-static void snd_marian_proc_ports_out(struct snd_info_entry *entry, struct snd_info_buffer *buffer)
+/*
+ * Software model, see struct marian_sim. Register accesses of a simulated card
+ * end up here instead of the PCI BAR.
+ */
+static u64 marian_sim_frames(struct marian_sim *sim, ktime_t now)
 {
-	struct marian_card *marian = entry->private_data;
-
-	snd_iprintf(buffer, "# generated by MARIAN Seraph driver\n");
-	marian_m2_proc_ports(marian, buffer, MARIAN_PORTS_TYPE_OUTPUT);
+	return sim->origin_frames +
+	       mul_u64_u64_div_u64(ktime_to_ns(ktime_sub(now, sim->origin)), sim->rate_mhz,
+				   NSEC_PER_SEC * 1000ULL);
 }
 
-static irqreturn_t snd_marian_interrupt(int irq, void *dev_id)
+static ktime_t marian_sim_period_time(struct marian_sim *sim, u64 period)
 {
-	struct marian_card *marian = (struct marian_card *)dev_id;
-	unsigned int irq_status;
+	u64 frames = period * M2_PERIOD_FRAMES;
 
-	irq_status = ioread32(marian->iobase + SERAPH_RD_IRQ_STATUS);
+	if (frames <= sim->origin_frames)
+		return sim->origin;
 
-	if (irq_status & 0x00004800) {
-		if (marian->playback_substream)
-			snd_pcm_period_elapsed(marian->playback_substream);
+	return ktime_add_ns(sim->origin, mul_u64_u64_div_u64(frames - sim->origin_frames,
+							     NSEC_PER_SEC * 1000ULL,
+							     sim->rate_mhz));
+}
 
-		if (marian->capture_substream)
-			snd_pcm_period_elapsed(marian->capture_substream);
+/*
+ * The new rate is only stored: the period timer may be running its callback
+ * right now, so it is left to the callback to rearm itself at the new rate.
+ */
+static void marian_sim_set_dco(struct marian_sim *sim, u32 val)
+{
+	u64 mhz = mul_u64_u64_shr(val, 80000000ULL * 1000, 36);
+	ktime_t now;
 
-		return IRQ_HANDLED;
-	}
+	if (!mhz)
+		return;
 
-	return IRQ_NONE;
+	if (sim->dma) {
+		// Frames up to now were clocked at the old rate
+		now = ktime_get();
+		sim->origin_frames = marian_sim_frames(sim, now);
+		sim->origin = now;
+	}
+	sim->rate_mhz = mhz;
 }
 
-static const struct snd_pcm_hardware m2_info_playback = {
-	.info = SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_NONINTERLEAVED
-		| SNDRV_PCM_INFO_JOINT_DUPLEX | SNDRV_PCM_INFO_SYNC_START,
-	.formats = SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_S32_BE
-		| SNDRV_PCM_FMTBIT_FLOAT_LE | SNDRV_PCM_FMTBIT_FLOAT_BE,
-	.rates = (SNDRV_PCM_RATE_CONTINUOUS | SNDRV_PCM_RATE_44100
-		| SNDRV_PCM_RATE_48000 | SNDRV_PCM_RATE_88200
-		| SNDRV_PCM_RATE_96000),
-	.rate_min = FREQ_MIN,
-	.rate_max = FREQ_MAX,
-	.channels_min = M2_CHANNELS_COUNT,
-	.channels_max = M2_CHANNELS_COUNT,
-	.buffer_bytes_max = SUBSTREAM_BUF_SIZE,
-	.period_bytes_min = SUBSTREAM_PERIOD_SIZE,
-	.period_bytes_max = SUBSTREAM_PERIOD_SIZE,
-	.periods_min = 2,
-	.periods_max = 2
-};
+static u32 marian_sim_word_clock(struct marian_sim *sim)
+{
+	switch (sim->regs[M2_CLOCK_SRC_SELECT / 4]) {
+	case M2_CLOCK_SRC_DCO:
+	case M2_CLOCK_SRC_MADI1:
+	case M2_CLOCK_SRC_MADI2:
+		// 640 MHz ticks per word clock period, as marian_measure_freq() expects
+		return WCLOCK_NEW_VAL | (div64_u64(640000000ULL * 1000, sim->rate_mhz) - 1);
+	default:
+		return 0;
+	}
+}
 
-static const struct snd_pcm_hardware m2_info_capture = {
-	.info = SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_NONINTERLEAVED
-		| SNDRV_PCM_INFO_SYNC_START | SNDRV_PCM_INFO_JOINT_DUPLEX,
-	.formats = SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_S32_BE
-		| SNDRV_PCM_FMTBIT_FLOAT_LE | SNDRV_PCM_FMTBIT_FLOAT_BE,
-	.rates = (SNDRV_PCM_RATE_CONTINUOUS | SNDRV_PCM_RATE_44100
-		| SNDRV_PCM_RATE_48000 | SNDRV_PCM_RATE_88200
-		| SNDRV_PCM_RATE_96000),
-	.rate_min = FREQ_MIN,
-	.rate_max = FREQ_MAX,
-	.channels_min = M2_CHANNELS_COUNT,
-	.channels_max = M2_CHANNELS_COUNT,
-	.buffer_bytes_max = SUBSTREAM_BUF_SIZE,
-	.period_bytes_min = SUBSTREAM_PERIOD_SIZE,
-	.period_bytes_max = SUBSTREAM_PERIOD_SIZE,
-	.periods_min = 2,
-	.periods_max = 2
-};
+static u8 marian_sim_fpga_read(struct marian_sim *sim, u8 adr)
+{
+	switch (adr) {
+	case 0x00:
+		// Both inputs in sync
+		return 0x0A;
+	case 0x01:
+		// Inputs receive the port modes we send
+		return sim->fpga[0x42] & 0x0F;
+	case 0x02:
+		return M2_SIM_FPGA_FIRMWARE;
+	default:
+		return sim->fpga[adr];
+	}
+}
 
-static int snd_marian_playback_open(struct snd_pcm_substream *substream)
+static void marian_sim_spi(struct marian_sim *sim, u32 data)
 {
-	struct marian_card *marian = substream->private_data;
+	u8 cmd = data >> 24;
 
-	substream->runtime->hw = m2_info_playback;
+	if (sim->regs[M2_SPI_CHIP_SELECT / 4] != 0x02)
+		return;
 
-	marian->playback_substream = substream;
+	if (cmd & 0x80)
+		sim->fpga[cmd & 0x7F] = data >> 16;
+	else if (sim->regs[M2_SPI_BITS_TO_READ / 4] == 8)
+		sim->spi_data = marian_sim_fpga_read(sim, cmd);
+}
 
-	snd_pcm_set_sync(substream);
+static bool marian_sim_armed(struct marian_sim *sim, unsigned int slot)
+{
+	unsigned int reg = M2_ARM_BASE / 4 + slot / 32;
 
-	return 0;
+	return (sim->regs[reg] | sim->regs[reg + 4]) & BIT(slot % 32);
 }
 
-static int snd_marian_capture_open(struct snd_pcm_substream *substream)
+/*
+ * DMA of one period: with loopback the played samples come straight back on
+ * the armed capture channels, otherwise the inputs are silent.
+ */
+static void marian_sim_dma_period(struct marian_sim *sim, unsigned int half)
 {
-	struct marian_card *marian = substream->private_data;
+	struct marian_card *marian = sim->marian;
+	unsigned int offset = half * M2_PERIOD_FRAMES * 4;
+	bool loopback = sim->regs[SERAPH_WR_IE_ENABLE / 4] & M2_ENABLE_LOOPBACK;
+	unsigned int slot;
+	u8 *capt, *play;
+
+	for (slot = 0; slot < M2_CHANNELS_COUNT; slot++) {
+		capt = marian->capture_buf.area + slot * M2_CHANNEL_BUF_SIZE + offset;
+		play = marian->playback_buf.area + slot * M2_CHANNEL_BUF_SIZE + offset;
+
+		if (loopback && marian_sim_armed(sim, slot))
+			memcpy(capt, play, M2_PERIOD_FRAMES * 4);
+		else
+			memset(capt, 0, M2_PERIOD_FRAMES * 4);
+	}
+}
 
-	substream->runtime->hw = m2_info_capture;
+static enum hrtimer_restart marian_sim_period(struct hrtimer *timer)
+{
+	struct marian_sim *sim = container_of(timer, struct marian_sim, timer);
+	bool raise = false;
+	ktime_t next;
+
+	spin_lock(&sim->lock);
+	// Stopped, or stopped and started again, which queued the timer anew
+	if (!sim->dma || hrtimer_is_queued(timer)) {
+		spin_unlock(&sim->lock);
+		return HRTIMER_NORESTART;
+	}
 
-	marian->capture_substream = substream;
+	// Armed at a rate the DCO has since lowered, the period isn't over yet
+	next = marian_sim_period_time(sim, sim->periods + 1);
+	if (ktime_before(ktime_get(), next)) {
+		hrtimer_set_expires(timer, next);
+		spin_unlock(&sim->lock);
+		return HRTIMER_RESTART;
+	}
 
-	snd_pcm_set_sync(substream);
+	marian_sim_dma_period(sim, sim->periods & 1);
+	sim->periods++;
 
-	return 0;
+	if (!(sim->regs[SERAPH_WR_IE_ENABLE / 4] & M2_DISABLE_CAPT_IRQ)) {
+		sim->irq_status |= M2_SIM_IRQ_PERIOD;
+		raise = true;
+	}
+
+	hrtimer_set_expires(timer, marian_sim_period_time(sim, sim->periods + 1));
+	spin_unlock(&sim->lock);
+
+	if (raise && snd_marian_interrupt(0, sim->marian) == IRQ_WAKE_THREAD)
+		queue_work(system_highpri_wq, &sim->irq_work);
+
+	return HRTIMER_RESTART;
 }
 
-static int snd_marian_capture_release(struct snd_pcm_substream *substream)
+static void marian_sim_irq_work(struct work_struct *work)
 {
-	struct marian_card *marian = snd_pcm_substream_chip(substream);
+	struct marian_sim *sim = container_of(work, struct marian_sim, irq_work);
 
-	marian->capture_substream = NULL;
-
-	return 0;
+	marian_irq_thread(0, sim->marian);
 }
 
-static int snd_marian_playback_release(struct snd_pcm_substream *substream)
+static u32 marian_sim_read(struct marian_card *marian, unsigned int reg)
 {
-	struct marian_card *marian = snd_pcm_substream_chip(substream);
+	struct marian_sim *sim = marian->sim;
+	unsigned long flags;
+	u32 val;
 
-	marian->playback_substream = NULL;
+	spin_lock_irqsave(&sim->lock, flags);
+	switch (reg) {
+	case SERAPH_RD_IRQ_STATUS:
+		val = sim->irq_status;
+		sim->irq_status = 0;
+		break;
+	case SERAPH_RD_HWPOINTER:
+		val = sim->dma ? marian_sim_frames(sim, ktime_get()) % (2 * M2_PERIOD_FRAMES) : 0;
+		break;
+	case M2_SPI_STATE:
+		val = SPI_ALL_READY;
+		break;
+	case MARIAN_SPI_CLOCK_DIVIDER:
+		val = sim->spi_data;
+		break;
+	case M2_WORD_CLOCK_REG:
+		val = marian_sim_word_clock(sim);
+		break;
+	case 0xFC:
+		val = M2_SIM_FIRMWARE;
+		break;
+	default:
+		val = reg / 4 < M2_SIM_REGS ? sim->regs[reg / 4] : 0;
+		break;
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
 
-	return 0;
+	return val;
 }
 
-static void marian_m2_constraints(struct marian_card *marian, struct snd_pcm_substream *substream,
-				  struct snd_pcm_hw_params *params)
+static void marian_sim_write(struct marian_card *marian, unsigned int reg, u32 val)
 {
-	mutex_lock(&marian->reg_mutex);
-	switch (params_format(params)) {
-	case SNDRV_PCM_FORMAT_FLOAT_BE:
-		marian_m2_set_float(marian, M2_NUM_MODE_FLOAT);
-		marian_m2_set_endianness(marian, M2_BE);
+	struct marian_sim *sim = marian->sim;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	if (reg / 4 < M2_SIM_REGS)
+		sim->regs[reg / 4] = val;
+
+	switch (reg) {
+	case 0x00:
+		// DMA engine reset
+		sim->dma = false;
+		sim->irq_status = 0;
 		break;
-	case SNDRV_PCM_FORMAT_FLOAT_LE:
-		marian_m2_set_float(marian, M2_NUM_MODE_FLOAT);
-		marian_m2_set_endianness(marian, M2_LE);
+	case M2_SPI_WRITE_DATA:
+		marian_sim_spi(sim, val);
 		break;
-	case SNDRV_PCM_FORMAT_S32_BE:
-		marian_m2_set_float(marian, M2_NUM_MODE_INT);
-		marian_m2_set_endianness(marian, M2_BE);
+	case M2_SET_DCO:
+		marian_sim_set_dco(sim, val);
 		break;
-	case SNDRV_PCM_FORMAT_S32_LE:
-		marian_m2_set_float(marian, M2_NUM_MODE_INT);
-		marian_m2_set_endianness(marian, M2_LE);
+	case SERAPH_WR_DMA_ENABLE:
+		if (val && !sim->dma) {
+			sim->dma = true;
+			sim->origin = ktime_get();
+			sim->origin_frames = 0;
+			sim->periods = 0;
+			hrtimer_start(&sim->timer, marian_sim_period_time(sim, 1),
+				      HRTIMER_MODE_ABS_HARD);
+		} else if (!val) {
+			// The timer sees this and stops, it may be the caller
+			sim->dma = false;
+		}
 		break;
 	}
-	mutex_unlock(&marian->reg_mutex);
+	spin_unlock_irqrestore(&sim->lock, flags);
 }
 
-static int snd_marian_hw_params(struct snd_pcm_substream *substream,
-				struct snd_pcm_hw_params *params)
+static int marian_sim_create(struct marian_card *marian)
 {
-	struct marian_card *marian = snd_pcm_substream_chip(substream);
-
-	mutex_lock(&marian->reg_mutex);
-
-	marian_m2_set_speedmode(marian, params_rate(params));
+	struct marian_sim *sim;
 
-	marian_generic_set_dco(marian, params_rate(params));
-	mutex_unlock(&marian->reg_mutex);
+	sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+	if (!sim)
+		return -ENOMEM;
 
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
-		snd_pcm_set_runtime_buffer(substream, &marian->playback_buf);
-	else
-		snd_pcm_set_runtime_buffer(substream, &marian->capture_buf);
+	sim->marian = marian;
+	sim->rate_mhz = M2_SIM_RATE_MHZ;
+	spin_lock_init(&sim->lock);
+	INIT_WORK(&sim->irq_work, marian_sim_irq_work);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&sim->timer, marian_sim_period, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+#else
+	hrtimer_init(&sim->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+	sim->timer.function = marian_sim_period;
+#endif
 
-	marian_m2_constraints(marian, substream, params);
+	marian->sim = sim;
 
 	return 0;
 }
 
-static int marian_m2_prepare(struct snd_pcm_substream *substream)
+static void marian_card_init(struct marian_card *marian, struct snd_card *card, unsigned int idx)
 {
-	struct marian_card *marian = snd_pcm_substream_chip(substream);
-	u32 mask = 0xFFFFFFFF;
-
-	mutex_lock(&marian->reg_mutex);
-	iowrite32(mask, marian->iobase + 0x20);
-	iowrite32(mask, marian->iobase + 0x24);
-	iowrite32(mask, marian->iobase + 0x28);
-	iowrite32(mask, marian->iobase + 0x2C);
-	iowrite32(mask, marian->iobase + 0x30);
-	iowrite32(mask, marian->iobase + 0x34);
-	iowrite32(mask, marian->iobase + 0x38);
-	iowrite32(mask, marian->iobase + 0x3C);
-	mutex_unlock(&marian->reg_mutex);
-
-	return 0;
+	marian->card = card;
+	marian->pcm = NULL;
+	marian->pci = NULL;
+	marian->port = 0;
+	marian->iobase = NULL;
+	marian->sim = NULL;
+	marian->irq = -1;
+	marian->idx = idx;
+	mutex_init(&marian->reg_mutex);
+	spin_lock_init(&marian->spi_lock);
+	mutex_init(&marian->freq_mutex);
+	spin_lock_init(&marian->lock);
+	INIT_DELAYED_WORK(&marian->monitor_work, marian_monitor_work);
+	INIT_DELAYED_WORK(&marian->clock_watchdog, marian_clock_watchdog);
+	INIT_DELAYED_WORK(&marian->sync_work, marian_sync_work);
+	INIT_WORK(&marian->meter_work, marian_meter_work);
+	INIT_WORK(&marian->preview_work, marian_preview_work);
+	INIT_WORK(&marian->export_work, marian_export_work);
+	marian->fence_context = dma_fence_context_alloc(1);
 }
 
-// atomic by default, no need for locking here
-static int snd_marian_trigger(struct snd_pcm_substream *substream, int cmd)
+// Everything past the bus specific setup, the registers have to be reachable
+static int marian_card_setup(struct marian_card *marian, struct device *dev)
 {
-	struct marian_card *marian = snd_pcm_substream_chip(substream);
-	int irq_flags;
+	struct snd_card *card = marian->card;
+	struct snd_info_entry *entry;
+	unsigned int len;
+	int err;
 
-	switch (cmd) {
-	case SNDRV_PCM_TRIGGER_START:
-		irq_flags = M2_DISABLE_PLAY_IRQ;
-		if (marian->loopback)
-			irq_flags |= M2_ENABLE_LOOPBACK;
+	strscpy(card->driver, "MARIAN FPGA", sizeof(card->driver));
+	strscpy(card->shortname, M2_CARD_NAME, sizeof(card->shortname));
 
-		iowrite32(0x3, marian->iobase + SERAPH_WR_DMA_ENABLE);
-		iowrite32(irq_flags, marian->iobase + SERAPH_WR_IE_ENABLE);
-		break;
-	case SNDRV_PCM_TRIGGER_STOP:
-		irq_flags = M2_DISABLE_PLAY_IRQ | M2_DISABLE_CAPT_IRQ;
-		iowrite32(irq_flags, marian->iobase + SERAPH_WR_IE_ENABLE);
-		iowrite32(0x0, marian->iobase + SERAPH_WR_DMA_ENABLE);
-
-		// unarm channels to inhibit playback from the FPGA's internal buffer
-		iowrite32(0, marian->iobase + 0x08);
-		iowrite32(0, marian->iobase + 0x0C);
-		iowrite32(0, marian->iobase + 0x20);
-		iowrite32(0, marian->iobase + 0x24);
-		iowrite32(0, marian->iobase + 0x28);
-		iowrite32(0, marian->iobase + 0x2C);
-		iowrite32(0, marian->iobase + 0x30);
-		iowrite32(0, marian->iobase + 0x34);
-		iowrite32(0, marian->iobase + 0x38);
-		iowrite32(0, marian->iobase + 0x3C);
-		break;
-	default:
-		return -EINVAL;
-	}
+	snd_card_set_dev(card, dev);
 
-	return 0;
-}
+	marian->status = (struct marian_hwdep_status *)get_zeroed_page(GFP_KERNEL);
+	if (!marian->status)
+		return -ENOMEM;
+	marian->status->version = MARIAN_HWDEP_VERSION;
 
-static snd_pcm_uframes_t snd_marian_hw_pointer(struct snd_pcm_substream *substream)
-{
-	struct marian_card *marian = snd_pcm_substream_chip(substream);
+	err = snd_pcm_new(card, M2_CARD_NAME, 0, M2_PLAYBACK_SUBSTREAMS, M2_CAPTURE_SUBSTREAMS,
+			  &marian->pcm);
+	if (err < 0)
+		return err;
+	marian->pcm->private_data = marian;
+	snd_pcm_set_ops(marian->pcm, SNDRV_PCM_STREAM_PLAYBACK, &snd_marian_playback_ops);
+	snd_pcm_set_ops(marian->pcm, SNDRV_PCM_STREAM_CAPTURE, &snd_marian_capture_ops);
 
-	return ioread32(marian->iobase + SERAPH_RD_HWPOINTER);
-}
+	err = snd_pcm_new(card, M2_CARD_NAME " Preview", 1, 0, 1, &marian->preview_pcm);
+	if (err < 0)
+		return err;
+	marian->preview_pcm->private_data = marian;
+	snd_pcm_set_ops(marian->preview_pcm, SNDRV_PCM_STREAM_CAPTURE, &marian_preview_ops);
 
-static const struct snd_pcm_ops snd_marian_playback_ops = {
-	.open = snd_marian_playback_open,
-	.close = snd_marian_playback_release,
-	.hw_params = snd_marian_hw_params,
-	.prepare = marian_m2_prepare,
-	.trigger = snd_marian_trigger,
-	.pointer = snd_marian_hw_pointer,
-};
+	marian->dma_mem = kzalloc(sizeof(*marian->dma_mem), GFP_KERNEL);
+	if (!marian->dma_mem)
+		return -ENOMEM;
+	kref_init(&marian->dma_mem->ref);
+	mutex_init(&marian->dma_mem->lock);
+	INIT_LIST_HEAD(&marian->dma_mem->exports);
 
-static const struct snd_pcm_ops snd_marian_capture_ops = {
-	.open = snd_marian_capture_open,
-	.close = snd_marian_capture_release,
-	.hw_params = snd_marian_hw_params,
-	.prepare = marian_m2_prepare,
-	.trigger = snd_marian_trigger,
-	.pointer = snd_marian_hw_pointer,
-};
+	len = PAGE_ALIGN(M2_DMA_BUFSIZE);
+	err = snd_dma_alloc_pages(SNDRV_DMA_TYPE_CONTINUOUS, dev,
+				  M2_DMA_BUFSIZE, &marian->dma_mem->buf);
+	if (err < 0) {
+		dev_err(card->dev, "Could not allocate %d Bytes (%d)\n", len, err);
+		return err;
+	}
+	marian->dmabuf = marian->dma_mem->buf;
 
-static void construct_playback_buffer(struct marian_card *marian)
-{
-	marian->playback_buf = marian->dmabuf;
-	marian->playback_buf.area += SUBSTREAM_BUF_SIZE;
-	marian->playback_buf.addr += SUBSTREAM_BUF_SIZE;
-	marian->playback_buf.bytes = SUBSTREAM_BUF_SIZE;
-}
+	/*
+	 * The page allocator hands out power-of-two blocks aligned to their
+	 * size, which makes each half of the ring one huge page for mmap. This
+	 * isn't enforced, a buffer that isn't aligned is only mapped in small
+	 * pages.
+	 */
+	if (!IS_ALIGNED(page_to_phys(virt_to_page(marian->dmabuf.area)), PMD_SIZE))
+		dev_info(card->dev, "DMA buffer not huge page aligned, mmap uses small pages\n");
 
-static void construct_capture_buffer(struct marian_card *marian)
-{
-	marian->capture_buf = marian->dmabuf;
-	marian->capture_buf.bytes = SUBSTREAM_BUF_SIZE;
-}
+	marian_write(marian, SERAPH_WR_DMA_ADR, (u32)marian->dmabuf.addr);
 
-static int marian_m2_init(struct marian_card *marian)
-{
-	// reset DMA engine
-	iowrite32(0x00000000, marian->iobase);
+	// Set 'block' count to buffer_frames/16 to set channel 'buffers' count (16 samples each)
+	marian_write(marian, SERAPH_WR_DMA_BLOCKS, SUBSTREAM_BUF_SIZE / M2_FRAME_SIZE / 16);
 
-	// disable play interrupt
-	iowrite32(M2_DISABLE_PLAY_IRQ, marian->iobase + SERAPH_WR_IE_ENABLE);
+	construct_capture_buffer(marian);
+	construct_playback_buffer(marian);
 
-	marian_generic_set_speedmode(marian, RATE_SLOW);
+	err = snd_dma_alloc_pages(SNDRV_DMA_TYPE_VMALLOC, NULL, M2_PREVIEW_BUF_SIZE,
+				  &marian->preview_buf);
+	if (err < 0)
+		return err;
 
-	// init internal clock and set it as clock source
-	marian_m2_set_clock_source(marian, 1);
+	if (!snd_card_proc_new(card, "status", &entry))
+		snd_info_set_text_ops(entry, marian, snd_marian_proc_status);
+	if (!snd_card_proc_new(card, "ports.in", &entry))
+		snd_info_set_text_ops(entry, marian, snd_marian_proc_ports_in);
+	if (!snd_card_proc_new(card, "ports.out", &entry))
+		snd_info_set_text_ops(entry, marian, snd_marian_proc_ports_out);
+	if (!snd_card_proc_new(card, "status.bin", &entry)) {
+		entry->content = SNDRV_INFO_CONTENT_DATA;
+		entry->private_data = marian;
+		entry->c.ops = &marian_status_bin_ops;
+		entry->size = sizeof(struct marian_hwdep_status);
+		entry->mode = S_IFREG | 0444;
+	}
 
-	// init SPI clock divider
-	iowrite32(0x1F, marian->iobase + MARIAN_SPI_CLOCK_DIVIDER);
+	marian_m2_init(marian);
+	marian_m2_create_controls(marian);
 
-	marian->shadow_40 = 0x00;
-	marian->shadow_41 = (1 << M2_TX_ENABLE);
-	marian->shadow_42 = (1 << M2_PORT1_MODE) | (1 << M2_PORT2_MODE);
+	if (hwdep_enable) {
+		err = marian_hwdep_create(marian);
+		if (err < 0)
+			return err;
+	}
 
-	marian->is_controls_initialized = false;
+	err = marian_timer_create(marian);
+	if (err < 0)
+		return err;
 
-	marian_m2_spi_write(marian, 0x40, marian->shadow_40);
-	marian_m2_spi_write(marian, 0x41, marian->shadow_41);
-	marian_m2_spi_write(marian, 0x42, marian->shadow_42);
+	err = marian_rec_create(marian);
+	if (err < 0)
+		return err;
 
-	return 0;
+	schedule_delayed_work(&marian->monitor_work, 0);
+
+	return snd_card_register(card);
 }
 
 static int snd_marian_create(struct snd_card *card, struct pci_dev *pci, unsigned int idx)
 {
-	struct snd_info_entry *entry;
 	struct marian_card *marian = card->private_data;
 	int err;
 	unsigned int len;
 
-	marian->card = card;
-	marian->pcm = NULL;
+	marian_card_init(marian, card, idx);
 	marian->pci = pci;
-	marian->port = 0;
-	marian->iobase = NULL;
-	marian->irq = -1;
-	marian->idx = idx;
-	mutex_init(&marian->reg_mutex);
-	spin_lock_init(&marian->spi_lock);
-	mutex_init(&marian->freq_mutex);
 
 	err = pci_enable_device(pci);
 	if (err < 0)
@@ -1304,7 +5513,8 @@ static int snd_marian_create(struct snd_card *card, struct pci_dev *pci, unsigne
 		return -EBUSY;
 	}
 
-	if (request_irq(pci->irq, snd_marian_interrupt, IRQF_SHARED, "marian", marian)) {
+	if (request_threaded_irq(pci->irq, snd_marian_interrupt, marian_irq_thread, IRQF_SHARED,
+				 "marian", marian)) {
 		dev_err(&pci->dev, "unable to grab IRQ %d\n", pci->irq);
 		return -EBUSY;
 	}
@@ -1312,66 +5522,26 @@ static int snd_marian_create(struct snd_card *card, struct pci_dev *pci, unsigne
 
 	card->private_free = snd_marian_card_free;
 
-	strscpy(card->driver, "MARIAN FPGA", sizeof(card->driver));
-	strscpy(card->shortname, M2_CARD_NAME, sizeof(card->shortname));
 	sprintf(card->longname, "%s PCIe audio at 0x%lx, irq %d",
-		card->shortname, marian->port, marian->irq);
-
-	snd_card_set_dev(card, &pci->dev);
-
-	err = snd_pcm_new(card, M2_CARD_NAME, 0, 1, 1, &marian->pcm);
-	if (err < 0)
-		return err;
-	marian->pcm->private_data = marian;
-	snd_pcm_set_ops(marian->pcm, SNDRV_PCM_STREAM_PLAYBACK, &snd_marian_playback_ops);
-	snd_pcm_set_ops(marian->pcm, SNDRV_PCM_STREAM_CAPTURE, &snd_marian_capture_ops);
-
-	len = PAGE_ALIGN(M2_DMA_BUFSIZE);
-	err = snd_dma_alloc_pages(SNDRV_DMA_TYPE_CONTINUOUS, &pci->dev,
-				  M2_DMA_BUFSIZE, &marian->dmabuf);
-	if (err < 0) {
-		dev_err(card->dev, "Could not allocate %d Bytes (%d)\n", len, err);
-
-		snd_dma_free_pages(&marian->dmabuf);
-		return err;
-	}
-
-	iowrite32((u32)marian->dmabuf.addr, marian->iobase + SERAPH_WR_DMA_ADR);
-
-	// Set 'block' count to buffer_frames/16 to set channel 'buffers' count (16 samples each)
-	iowrite32(SUBSTREAM_BUF_SIZE / M2_FRAME_SIZE / 16, marian->iobase + SERAPH_WR_DMA_BLOCKS);
-
-	construct_capture_buffer(marian);
-	construct_playback_buffer(marian);
-
-	if (!snd_card_proc_new(card, "status", &entry))
-		snd_info_set_text_ops(entry, marian, snd_marian_proc_status);
-	if (!snd_card_proc_new(card, "ports.in", &entry))
-		snd_info_set_text_ops(entry, marian, snd_marian_proc_ports_in);
-	if (!snd_card_proc_new(card, "ports.out", &entry))
-		snd_info_set_text_ops(entry, marian, snd_marian_proc_ports_out);
+		M2_CARD_NAME, marian->port, marian->irq);
 
-	marian_m2_init(marian);
-	marian_m2_create_controls(marian);
-
-	return snd_card_register(card);
+	return marian_card_setup(marian, &pci->dev);
 }
 
 static int snd_marian_m2_probe(struct pci_dev *pci, const struct pci_device_id *pci_id)
 {
-	static unsigned int dev;
 	struct snd_card *card;
 	int err;
 
-	if (dev >= SNDRV_CARDS)
+	if (marian_devs >= SNDRV_CARDS)
 		return -ENODEV;
 
-	err = snd_card_new(&pci->dev, index[dev], id[dev],
+	err = snd_card_new(&pci->dev, index[marian_devs], id[marian_devs],
 			   THIS_MODULE, sizeof(struct marian_card), &card);
 	if (err < 0)
 		return err;
 
-	err = snd_marian_create(card, pci, dev);
+	err = snd_marian_create(card, pci, marian_devs);
 	if (err < 0) {
 		snd_card_free(card);
 		return err;
@@ -1379,7 +5549,7 @@ static int snd_marian_m2_probe(struct pci_dev *pci, const struct pci_device_id *
 
 	pci_set_drvdata(pci, card);
 
-	dev++;
+	marian_devs++;
 
 	return 0;
 }
@@ -1397,8 +5567,126 @@ static struct pci_driver marian_driver = {
 	.remove = snd_marian_m2_remove,
 };
 
-module_pci_driver(marian_driver);
+static int snd_marian_sim_probe(struct platform_device *pdev)
+{
+	struct marian_card *marian;
+	struct snd_card *card;
+	int err;
+
+	if (marian_devs >= SNDRV_CARDS)
+		return -ENODEV;
+
+	err = snd_card_new(&pdev->dev, index[marian_devs], id[marian_devs],
+			   THIS_MODULE, sizeof(struct marian_card), &card);
+	if (err < 0)
+		return err;
+
+	marian = card->private_data;
+	marian_card_init(marian, card, marian_devs);
+	card->private_free = snd_marian_card_free;
+
+	err = marian_sim_create(marian);
+	if (err < 0)
+		goto error;
+
+	sprintf(card->longname, "%s software model %d", M2_CARD_NAME, pdev->id);
+
+	err = marian_card_setup(marian, &pdev->dev);
+	if (err < 0)
+		goto error;
+
+	platform_set_drvdata(pdev, card);
+
+	marian_devs++;
+
+	return 0;
+
+error:
+	snd_card_free(card);
+	return err;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+static void snd_marian_sim_remove(struct platform_device *pdev)
+{
+	snd_card_free(platform_get_drvdata(pdev));
+}
+#else
+static int snd_marian_sim_remove(struct platform_device *pdev)
+{
+	snd_card_free(platform_get_drvdata(pdev));
+	return 0;
+}
+#endif
+
+static struct platform_driver marian_sim_driver = {
+	.driver = {
+		.name = "marian-sim",
+	},
+	.probe = snd_marian_sim_probe,
+	.remove = snd_marian_sim_remove,
+};
+
+static struct platform_device *marian_sim_devices[SNDRV_CARDS];
+
+static void marian_sim_unregister(void)
+{
+	int i;
+
+	for (i = 0; i < SNDRV_CARDS; i++) {
+		if (marian_sim_devices[i])
+			platform_device_unregister(marian_sim_devices[i]);
+	}
+
+	platform_driver_unregister(&marian_sim_driver);
+}
+
+static int __init marian_module_init(void)
+{
+	struct platform_device *pdev;
+	int err, i;
+
+	err = pci_register_driver(&marian_driver);
+	if (err < 0 || sim_cards <= 0)
+		return err;
+
+	err = platform_driver_register(&marian_sim_driver);
+	if (err < 0)
+		goto err_pci;
+
+	for (i = 0; i < sim_cards && i < SNDRV_CARDS; i++) {
+		pdev = platform_device_register_simple("marian-sim", i, NULL, 0);
+		if (IS_ERR(pdev)) {
+			err = PTR_ERR(pdev);
+			marian_sim_unregister();
+			goto err_pci;
+		}
+		marian_sim_devices[i] = pdev;
+	}
+
+	return 0;
+
+err_pci:
+	pci_unregister_driver(&marian_driver);
+	return err;
+}
+
+static void __exit marian_module_exit(void)
+{
+	if (sim_cards > 0)
+		marian_sim_unregister();
+
+	pci_unregister_driver(&marian_driver);
+}
+
+module_init(marian_module_init);
+module_exit(marian_module_exit);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#else
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
 MODULE_AUTHOR("Florin Faber, Ivan Orlov");
 MODULE_DESCRIPTION("MARIAN Seraph M2");
 MODULE_LICENSE("GPL");
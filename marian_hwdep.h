@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: GPL-2.0-only WITH Linux-syscall-note */
+/*
+ *   Userspace interface of the MARIAN Seraph hwdep device
+ *
+ *   The hwdep device (/dev/snd/hwC<card>D0, loaded with hwdep=1) gives one
+ *   client direct access to the DMA buffer the card streams from and to, and
+ *   to a status page the interrupt handler updates once per period. The same
+ *   page can be mapped or read by any number of monitors from
+ *   /proc/asound/card<card>/status.bin, with or without hwdep=1. Streams
+ *   are still configured and started through the PCM device; a client that
+ *   moves its data through this interface instead should set the PCM
+ *   stop_threshold to the boundary, so ALSA doesn't report xruns while nobody
+ *   advances the application pointer.
+ *
+ *   mmap offsets:
+ *     MARIAN_HWDEP_MMAP_STATUS   one page, struct marian_hwdep_status, read only
+ *     MARIAN_HWDEP_MMAP_DMA      the whole DMA buffer, see struct marian_hwdep_info
+ *
+ *   The DMA buffer has to be mapped shared. On kernels from 6.12 on that
+ *   support PMD mappings of raw PFNs, it is mapped with 2 MiB pages where
+ *   transparent huge pages are not disabled and the mapping address is 2 MiB
+ *   aligned; the kernel does not align it by itself for this device. Mapping
+ *   the PCM device's buffer through ALSA always uses small pages.
+ *
+ *   Period interrupts are delivered through poll() (POLLIN), read() of a
+ *   __u64 period counter, or an eventfd set with MARIAN_HWDEP_IOCTL_EVENTFD.
+ *
+ *   MARIAN_HWDEP_IOCTL_START starts every prepared PCM substream of the card
+ *   at a given time, see struct marian_hwdep_start.
+ *
+ *   MARIAN_HWDEP_IOCTL_EXPORT hands out the playback or capture ring as a
+ *   dma-buf, for other processes and drivers, see struct marian_hwdep_export.
+ */
+
+#ifndef __MARIAN_HWDEP_H
+#define __MARIAN_HWDEP_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MARIAN_HWDEP_VERSION		5
+
+#define MARIAN_HWDEP_MMAP_STATUS	0x00000000
+#define MARIAN_HWDEP_MMAP_DMA		0x00100000
+
+/*
+ * Written by the interrupt handler at every period and by the clock monitor
+ * every 250 ms. seq is odd while an update is in progress: read it, copy the
+ * fields, and retry if seq was odd or has changed in the meantime. Settings
+ * changed through controls show up at the next of either update.
+ */
+struct marian_hwdep_status {
+	__u32 version;		/* MARIAN_HWDEP_VERSION */
+	__u32 seq;
+	__u64 periods;		/* period interrupts since the card was created */
+	__u64 frames;		/* frames since the DMA engine was started */
+	__s64 tstamp_ns;	/* CLOCK_MONOTONIC of the last period interrupt */
+	__u32 hw_pointer;	/* buffer position read at that interrupt, frames */
+	__u32 running;		/* DMA engine started */
+	__u64 irqs;		/* interrupt handler calls, shared line included */
+	__u64 xruns;		/* streams stopped at a period interrupt or on a rate change */
+	__s64 monitor_tstamp_ns; /* CLOCK_MONOTONIC of the last clock monitor pass */
+	__u32 rate_mhz;		/* nominal sample rate, millihertz, 0 if unknown */
+	__u32 clock_source;	/* 1 DCO, 2 sync bus, 4 MADI input 1, 5 MADI input 2 */
+	__u32 dco_mhz;		/* internal oscillator, millihertz */
+	__u32 ext_rate;		/* external clock, Hz, 0 if internal or unlocked */
+	__s64 drift_ppb;	/* sample clock against CLOCK_MONOTONIC */
+	__u32 sync[2];		/* per MADI input: 0 no signal, 1 lock, 2 sync */
+	__u32 input_channels[2]; /* 56 or 64, as detected */
+	__u32 input_frame[2];	/* 48 or 96 (kHz frame), as detected */
+	__u32 output_channels[2];
+	__u32 output_frame[2];
+	__u32 input_rate[2];	/* measured, Hz, 0 without signal */
+	__u32 firmware;		/* card firmware build */
+	__u32 fpga_firmware;	/* MADI FPGA firmware */
+	__u32 redundant_port;	/* MADI input capture is taken from, 0 if not redundant */
+	__u32 reserved0;
+	__u64 switchovers;	/* changes of that input since the card was created */
+	__u32 reserved[4];
+};
+
+/*
+ * Layout of the DMA mapping. Channels are not interleaved: every channel
+ * slot owns channel_bytes bytes holding buffer_frames samples, capture slots
+ * start at capture_offset and playback slots at playback_offset.
+ */
+struct marian_hwdep_info {
+	__u32 version;		/* MARIAN_HWDEP_VERSION */
+	__u32 channels;		/* channel slots per direction */
+	__u32 period_frames;
+	__u32 buffer_frames;
+	__u32 sample_bytes;
+	__u32 channel_bytes;
+	__u32 capture_offset;
+	__u32 playback_offset;
+	__u32 dma_bytes;	/* length of the MARIAN_HWDEP_MMAP_DMA mapping */
+	__u32 reserved[7];
+};
+
+/*
+ * Timed start. Prepare the PCM substreams with the start threshold above
+ * the buffer size, so nothing starts on its own, then call this ioctl: it
+ * blocks until the time has come and starts every substream of the card
+ * that is prepared, linked groups as a whole.
+ *
+ * The start time is either tstamp_ns, in CLOCK_MONOTONIC, or if that is 0
+ * a card frame, counted like frames + hw_pointer % period_frames of the
+ * status page; the latter needs the DMA engine running already. Substreams
+ * joining a running engine were prepared at the position it had then, and
+ * what is prefilled goes from there. Each of them is started once the engine
+ * gets back to that position, within one turn of the ring after the start
+ * time, so the prefill is played in order; neither pointer is moved. The
+ * time and frame returned are those of the first substream started.
+ */
+struct marian_hwdep_start {
+	__s64 tstamp_ns;	/* in: start time, out: when the substreams were started */
+	__u64 frame;		/* in: start frame if tstamp_ns is 0, out: card frame they started at */
+	__u32 groups;		/* out: substreams or linked groups started */
+	__u32 reserved[5];
+};
+
+/*
+ * Export of a ring as a dma-buf. It is the memory the card streams from or
+ * to, laid out like that half of the DMA mapping, and stays valid for as
+ * long as the dma-buf is open, even past the removal of the card; it just
+ * isn't streamed to or from any more then, and its fences stay signalled.
+ *
+ * Every period boundary signals a dma-fence on the dma-buf's reservation
+ * object, so importing drivers can wait for periods the usual way. For
+ * userspace, poll() on the dma-buf fd waits for the next boundary: POLLIN
+ * on the capture ring, where the card is the writer, POLLOUT on the
+ * playback ring, where it is a reader. Which period has completed comes
+ * from the status page: the fence of a period is put on the rings just
+ * after the one before it is signalled, so poll() right at a boundary may
+ * find the ring ready for the same period twice. Fences only exist while
+ * the DMA engine runs, and are signalled when a stream stops: an idle ring
+ * polls ready.
+ */
+struct marian_hwdep_export {
+	__u32 stream;		/* in: 0 playback, 1 capture, as SNDRV_PCM_STREAM_* */
+	__u32 flags;		/* in: 0 or O_CLOEXEC */
+	__s32 fd;		/* out: the dma-buf */
+	__u32 reserved[5];
+};
+
+#define MARIAN_HWDEP_IOCTL_INFO		_IOR('M', 0x00, struct marian_hwdep_info)
+/* Signal an eventfd at every period interrupt, -1 to detach it */
+#define MARIAN_HWDEP_IOCTL_EVENTFD	_IOW('M', 0x01, __s32)
+#define MARIAN_HWDEP_IOCTL_START	_IOWR('M', 0x02, struct marian_hwdep_start)
+#define MARIAN_HWDEP_IOCTL_EXPORT	_IOWR('M', 0x03, struct marian_hwdep_export)
+
+#endif /* __MARIAN_HWDEP_H */
@@ -1,58 +1,348 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Control path benchmark for the MARIAN Seraph driver
+ *
+ * Enumerates the controls of a card and times snd_ctl_elem_read() of every
+ * one of them, many of which go out to the SPI bus or measure a frequency in
+ * the driver. With -w, writing the value just read back is timed as well,
+ * which runs the put path without changing anything. With -e, the named
+ * control is toggled between its current value and a neighbouring one, and
+ * the time from the write to the value notification is measured. It is
+ * restored at the end. A notification not there within a second counts as
+ * a timeout; if the first one times out, the control is reported as not
+ * notifying instead of waiting out every write.
+ *
+ * With -S, soak (built next to this tool) streams in duplex on the card for
+ * the given number of seconds, so the numbers include contention with the
+ * interrupt handler and the streaming paths.
+ *
+ * Prints one JSON line per control, times in microseconds.
+ *
+ *   controls [-D ctl] [-n count] [-w] [-e control] [-S seconds]
+ *
+ * Build: gcc -O2 -Wall -o controls controls.c -lasound
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <alsa/asoundlib.h>
 
-#define CLOCK_SRC_ID 12
+struct stats {
+	double *v;
+	unsigned int n;
+};
 
-int main(void)
+static int64_t now_ns(void)
 {
-	int err, count, i;
-	snd_ctl_t *ctl;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_stats(const char *key, struct stats *s)
+{
+	double sum = 0;
+	unsigned int i;
+
+	if (!s->n) {
+		printf(",\"%s\":null", key);
+		return;
+	}
+
+	qsort(s->v, s->n, sizeof(*s->v), cmp_double);
+	for (i = 0; i < s->n; i++)
+		sum += s->v[i];
+
+	printf(",\"%s\":{\"n\":%u,\"mean\":%.1f,\"min\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}",
+	       key, s->n, sum / s->n, s->v[0], s->v[s->n / 2], s->v[s->n * 99 / 100],
+	       s->v[s->n - 1]);
+}
+
+static const char *type_name(snd_ctl_elem_type_t type)
+{
+	switch (type) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+		return "boolean";
+	case SND_CTL_ELEM_TYPE_INTEGER:
+		return "integer";
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+		return "integer64";
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		return "enumerated";
+	case SND_CTL_ELEM_TYPE_BYTES:
+		return "bytes";
+	default:
+		return "other";
+	}
+}
+
+// Second value for the notification test: a neighbour of element 0's current value
+static int toggle_value(snd_ctl_elem_info_t *info, snd_ctl_elem_value_t *value)
+{
+	long v, min, max;
+
+	switch (snd_ctl_elem_info_get_type(info)) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+		snd_ctl_elem_value_set_boolean(value, 0, !snd_ctl_elem_value_get_boolean(value, 0));
+		return 0;
+	case SND_CTL_ELEM_TYPE_INTEGER:
+		v = snd_ctl_elem_value_get_integer(value, 0);
+		min = snd_ctl_elem_info_get_min(info);
+		max = snd_ctl_elem_info_get_max(info);
+		if (min == max)
+			return -EINVAL;
+		snd_ctl_elem_value_set_integer(value, 0, v < max ? v + 1 : v - 1);
+		return 0;
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		if (snd_ctl_elem_info_get_items(info) < 2)
+			return -EINVAL;
+		v = snd_ctl_elem_value_get_enumerated(value, 0);
+		snd_ctl_elem_value_set_enumerated(value, 0,
+						  (v + 1) % snd_ctl_elem_info_get_items(info));
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+// Waits for a value event on numid, returns its arrival time or -1 on timeout
+static int64_t wait_event(snd_ctl_t *ctl, unsigned int numid, int timeout_ms)
+{
+	snd_ctl_event_t *event;
+	struct pollfd pfd;
+	int64_t deadline = now_ns() + (int64_t)timeout_ms * 1000000, t;
+
+	snd_ctl_event_alloca(&event);
+	snd_ctl_poll_descriptors(ctl, &pfd, 1);
+
+	for (;;) {
+		while (snd_ctl_read(ctl, event) > 0) {
+			t = now_ns();
+			if (snd_ctl_event_get_type(event) == SND_CTL_EVENT_ELEM &&
+			    (snd_ctl_event_elem_get_mask(event) & SND_CTL_EVENT_MASK_VALUE) &&
+			    snd_ctl_event_elem_get_numid(event) == numid)
+				return t;
+		}
+
+		t = now_ns();
+		if (t >= deadline || poll(&pfd, 1, (deadline - t) / 1000000 + 1) <= 0)
+			return -1;
+	}
+}
+
+// Number of writes whose notification timed out, -EINVAL if the value can't toggle
+static int measure_events(snd_ctl_t *ctl, snd_ctl_elem_info_t *info,
+			  snd_ctl_elem_value_t *orig, unsigned int count, struct stats *s)
+{
+	snd_ctl_elem_value_t *other, *v;
+	unsigned int numid = snd_ctl_elem_info_get_numid(info), i, timeouts = 0;
+	snd_ctl_event_t *event;
+	int64_t t0, t;
+
+	snd_ctl_elem_value_alloca(&other);
+	snd_ctl_elem_value_copy(other, orig);
+	if (toggle_value(info, other) < 0)
+		return -EINVAL;
+
+	snd_ctl_event_alloca(&event);
+	snd_ctl_subscribe_events(ctl, 1);
+
+	// Drop whatever was queued before the first write
+	while (snd_ctl_read(ctl, event) > 0)
+		;
+
+	for (i = 0; i < count; i++) {
+		v = i & 1 ? orig : other;
+		t0 = now_ns();
+		if (snd_ctl_elem_write(ctl, v) < 0)
+			break;
+		t = wait_event(ctl, numid, 1000);
+		if (t < 0) {
+			timeouts++;
+			// Not a notifying control, the other writes would time out too
+			if (!s->n)
+				break;
+			continue;
+		}
+		s->v[s->n++] = (t - t0) / 1000.0;
+	}
+
+	snd_ctl_elem_write(ctl, orig);
+	snd_ctl_subscribe_events(ctl, 0);
+
+	return timeouts;
+}
+
+static pid_t start_soak(const char *ctl_name, unsigned int seconds)
+{
+	char device[128], duration[16];
+	pid_t pid;
+
+	// The PCM is device 0 of the card the control device names
+	snprintf(device, sizeof(device), strchr(ctl_name, '=') ? "%s,DEV=0" : "%s,0", ctl_name);
+	snprintf(duration, sizeof(duration), "%u", seconds);
+
+	pid = fork();
+	if (!pid) {
+		if (!freopen("/dev/null", "w", stdout))
+			_exit(127);
+		execl("./soak", "soak", "-D", device, "-m", "duplex", "-c", "128", "-p", "2048",
+		      "-r", "48000", "-d", duration, (char *)NULL);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-D ctl] [-n count] [-w] [-e control] [-S seconds]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = "hw:0", *event_name = NULL, *name;
+	unsigned int count = 200, stream = 0, timeouts, n, i, j;
+	snd_ctl_elem_value_t *value;
 	snd_ctl_elem_list_t *list;
-	const char *name;
+	snd_ctl_elem_info_t *info;
 	snd_ctl_elem_id_t *id;
-	snd_ctl_elem_value_t *clock_src_val;
+	struct stats get, put, notify;
+	snd_ctl_t *ctl;
+	int writes = 0, measured, opt, err;
+	pid_t soak = -1;
+	int64_t t0;
 
-	err = snd_ctl_open(&ctl, "hw:CARD=M2", SND_CTL_NONBLOCK);
+	while ((opt = getopt(argc, argv, "D:n:we:S:")) != -1) {
+		switch (opt) {
+		case 'D':
+			device = optarg;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			writes = 1;
+			break;
+		case 'e':
+			event_name = optarg;
+			break;
+		case 'S':
+			stream = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
 
-	if (err) {
-		printf("Failed to open control: %s\n", snd_strerror(err));
-		return -1;
+	err = snd_ctl_open(&ctl, device, SND_CTL_NONBLOCK);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", device, snd_strerror(err));
+		return 1;
 	}
 
-	snd_ctl_elem_list_malloc(&list);
+	snd_ctl_elem_list_alloca(&list);
+	snd_ctl_elem_info_alloca(&info);
+	snd_ctl_elem_value_alloca(&value);
+	snd_ctl_elem_id_alloca(&id);
 
 	snd_ctl_elem_list(ctl, list);
-	count = snd_ctl_elem_list_get_count(list);
+	n = snd_ctl_elem_list_get_count(list);
+	if (snd_ctl_elem_list_alloc_space(list, n) < 0 || snd_ctl_elem_list(ctl, list) < 0) {
+		fprintf(stderr, "%s: cannot list controls\n", device);
+		return 1;
+	}
 
-	snd_ctl_elem_list_alloc_space(list, count);
-	snd_ctl_elem_list(ctl, list);
+	get.v = calloc(count, sizeof(double));
+	put.v = calloc(count, sizeof(double));
+	notify.v = calloc(count, sizeof(double));
+	if (!get.v || !put.v || !notify.v)
+		return 1;
 
-	for (i = 0; i < count; i++) {
-		name = snd_ctl_elem_list_get_name(list, i);
-		printf("%d Control: %s\n", i, name);
+	if (stream) {
+		soak = start_soak(device, stream);
+		// Let the streams get going before anything is measured
+		sleep(1);
 	}
 
-	snd_ctl_elem_id_malloc(&id);
+	for (i = 0; i < n; i++) {
+		snd_ctl_elem_list_get_id(list, i, id);
+		snd_ctl_elem_info_set_id(info, id);
+		if (snd_ctl_elem_info(ctl, info) < 0 || snd_ctl_elem_info_is_inactive(info))
+			continue;
+
+		name = snd_ctl_elem_id_get_name(id);
+		get.n = put.n = notify.n = 0;
+		measured = 0;
+		timeouts = 0;
+		snd_ctl_elem_value_set_id(value, id);
 
-	snd_ctl_elem_list_get_id(list, CLOCK_SRC_ID, id);
+		if (snd_ctl_elem_info_is_readable(info)) {
+			for (j = 0; j < count; j++) {
+				t0 = now_ns();
+				if (snd_ctl_elem_read(ctl, value) < 0)
+					break;
+				get.v[get.n++] = (now_ns() - t0) / 1000.0;
+			}
+		}
 
-	snd_ctl_elem_value_malloc(&clock_src_val);
+		if (writes && get.n && snd_ctl_elem_info_is_writable(info)) {
+			for (j = 0; j < count; j++) {
+				t0 = now_ns();
+				if (snd_ctl_elem_write(ctl, value) < 0)
+					break;
+				put.v[put.n++] = (now_ns() - t0) / 1000.0;
+			}
+		}
 
-	snd_ctl_elem_value_set_id(clock_src_val, id);
-	err = snd_ctl_elem_read(ctl, clock_src_val);
-	if (err) {
-		printf("Error during reading: %s\n", snd_strerror(err));
-		goto out;
+		if (event_name && !strcmp(name, event_name) && get.n &&
+		    snd_ctl_elem_info_is_writable(info)) {
+			err = measure_events(ctl, info, value, count, &notify);
+			measured = err >= 0;
+			timeouts = measured ? err : 0;
+		}
+
+		printf("{\"device\":\"%s\",\"streaming\":%s,\"numid\":%u,\"name\":\"%s\",\"index\":%u"
+		       ",\"type\":\"%s\",\"count\":%u,\"volatile\":%s",
+		       device, stream ? "true" : "false", snd_ctl_elem_info_get_numid(info), name,
+		       snd_ctl_elem_info_get_index(info),
+		       type_name(snd_ctl_elem_info_get_type(info)), snd_ctl_elem_info_get_count(info),
+		       snd_ctl_elem_info_is_volatile(info) ? "true" : "false");
+		print_stats("get_us", &get);
+		print_stats("put_us", &put);
+		print_stats("notify_us", &notify);
+		if (measured)
+			printf(",\"notify_timeouts\":%u,\"notifies\":%s", timeouts,
+			       notify.n ? "true" : "false");
+		printf("}\n");
+		fflush(stdout);
 	}
-	unsigned int clock_source = snd_ctl_elem_value_get_enumerated(clock_src_val, CLOCK_SRC_ID);
-	printf("Clock source: %u\n", clock_source);
 
-	snd_ctl_elem_value_set_enumerated(clock_src_val, CLOCK_SRC_ID, )
+	if (soak > 0) {
+		kill(soak, SIGTERM);
+		waitpid(soak, NULL, 0);
+	}
 
-out:
-	snd_ctl_elem_value_free(clock_src_val);
-	snd_ctl_elem_id_free(id);
 	snd_ctl_elem_list_free_space(list);
-	snd_ctl_elem_list_free(list);
+	snd_ctl_close(ctl);
+
 	return 0;
 }
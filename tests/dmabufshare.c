@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * dma-buf export check for the MARIAN Seraph driver
+ *
+ * Exports the capture and playback rings through the hwdep device, maps
+ * both dma-bufs and checks they are the memory of the hwdep DMA mapping,
+ * not a copy: a marker written through one shows through the other. Then
+ * sleeps in poll() on the capture dma-buf for a number of periods, the way
+ * another process would follow the card, and prints one JSON line with the
+ * wakeups and the jitter of the wakeup against the period timestamp. Every
+ * wakeup has to find a new period on the status page.
+ *
+ *   dmabufshare [-H hwdep] [-n periods]
+ *
+ * Something has to stream meanwhile, arecord on the card for instance. The
+ * module has to be loaded with hwdep=1.
+ *
+ * Build: gcc -O2 -Wall -I.. -o dmabufshare dmabufshare.c ../lib/marian_ring.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/marian_ring.h"
+
+#define MARKER	0x4d324442
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int export_ring(struct marian_ring *ring, unsigned int stream)
+{
+	struct marian_hwdep_export req;
+
+	memset(&req, 0, sizeof(req));
+	req.stream = stream;
+	req.flags = O_CLOEXEC;
+	if (ioctl(ring->fd, MARIAN_HWDEP_IOCTL_EXPORT, &req) < 0)
+		return -1;
+
+	return req.fd;
+}
+
+// Write through the dma-buf, read through the hwdep mapping, in the last frame of a slot
+static int shared(volatile int32_t *exported, volatile int32_t *mapped, size_t frames)
+{
+	int32_t old = exported[frames - 1];
+	int same;
+
+	exported[frames - 1] = MARKER;
+	same = mapped[frames - 1] == MARKER;
+	exported[frames - 1] = old;
+
+	return same;
+}
+
+int main(int argc, char **argv)
+{
+	const char *hwdep = "/dev/snd/hwC0D0";
+	unsigned int periods = 200, i, wakeups = 0, missed = 0, timeouts = 0;
+	int64_t t, late, late_sum = 0, late_max = 0;
+	struct marian_hwdep_status st;
+	struct marian_ring ring;
+	int32_t *capture, *playback;
+	uint64_t last = 0;
+	size_t frames, bytes;
+	struct pollfd pfd;
+	int cfd, pfd_fd, opt, ok, n;
+
+	while ((opt = getopt(argc, argv, "H:n:")) != -1) {
+		switch (opt) {
+		case 'H':
+			hwdep = optarg;
+			break;
+		case 'n':
+			periods = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-H hwdep] [-n periods]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (marian_ring_open(&ring, hwdep) < 0) {
+		perror(hwdep);
+		return 1;
+	}
+
+	cfd = export_ring(&ring, 1);
+	pfd_fd = export_ring(&ring, 0);
+	if (cfd < 0 || pfd_fd < 0) {
+		perror("MARIAN_HWDEP_IOCTL_EXPORT");
+		return 1;
+	}
+
+	bytes = (size_t)ring.info.buffer_frames * ring.info.channels * ring.info.sample_bytes;
+	capture = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, cfd, 0);
+	playback = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, pfd_fd, 0);
+	if (capture == MAP_FAILED || playback == MAP_FAILED) {
+		perror("mmap dma-buf");
+		return 1;
+	}
+
+	frames = ring.info.channel_bytes / ring.info.sample_bytes;
+	ok = shared(capture, marian_ring_capture(&ring, 0, 0), frames) &&
+	     shared(playback, marian_ring_playback(&ring, 0, 0), frames);
+
+	pfd.fd = cfd;
+	pfd.events = POLLIN;
+	marian_ring_status(&ring, &st);
+	last = st.periods;
+
+	for (i = 0; i < periods; i++) {
+		n = poll(&pfd, 1, 1000);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			timeouts++;
+			break;
+		}
+		t = now_ns();
+		wakeups++;
+
+		marian_ring_status(&ring, &st);
+		if (st.periods == last)
+			missed++;
+		last = st.periods;
+
+		late = t - st.tstamp_ns;
+		late_sum += late;
+		if (late > late_max)
+			late_max = late;
+	}
+
+	printf("{\"shared\":%s,\"periods\":%u,\"wakeups\":%u,\"no_period\":%u,\"timeouts\":%u"
+	       ",\"wake_mean_us\":%.1f,\"wake_max_us\":%.1f}\n",
+	       ok ? "true" : "false", periods, wakeups, missed, timeouts,
+	       wakeups ? late_sum / 1000.0 / wakeups : 0.0, late_max / 1000.0);
+
+	munmap(capture, bytes);
+	munmap(playback, bytes);
+	close(cfd);
+	close(pfd_fd);
+	marian_ring_close(&ring);
+
+	return ok && !timeouts && !missed ? 0 : 1;
+}
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Clock failover check on a real card. Slaves the card to MADI input 1 with
+# failover on, streams in duplex and asks for the input 1 cable to be pulled
+# and plugged back. Prints every change of the clock source as it happens
+# and fails if the stream saw an xrun or the card didn't go back to input 1.
+# Usage: ./failover.sh [card] [rate], e.g. ./failover.sh M2 48000
+
+card=${1:-M2}
+rate=${2:-48000}
+seconds=60
+
+[ soak -nt soak.c ] || gcc -O2 -Wall -o soak soak.c -lasound || exit 1
+
+mixer() {
+	amixer -q -c "$card" cset name="$1" "$2"
+}
+
+source_now() {
+	amixer -c "$card" cget name='Sample Clock Source' | sed -n "s/.*: values=\([0-9]*\).*/\1/p"
+}
+
+mixer 'Sample Clock Priority' 'Input Port 1,Input Port 2,Sync Bus,Internal' || exit 1
+mixer 'Sample Clock Source' 'Input Port 1' || exit 1
+mixer 'Sample Clock Failover Switch' on || exit 1
+sleep 1
+
+out=$(mktemp)
+./soak -D "hw:CARD=$card,DEV=0" -m duplex -c 128 -p 2048 -r "$rate" -d "$seconds" > "$out" &
+pid=$!
+trap 'kill $pid 2>/dev/null; rm -f "$out"; mixer "Sample Clock Failover Switch" off' EXIT
+
+echo "Pull the cable of MADI input 1, wait a few seconds, then plug it back in."
+last=$(source_now)
+echo "$(date +%T) source $last"
+while kill -0 "$pid" 2>/dev/null; do
+	cur=$(source_now)
+	if [ "$cur" != "$last" ]; then
+		echo "$(date +%T) source $cur"
+		last=$cur
+	fi
+	sleep 0.1
+done
+
+status=0
+xruns=$(tail -n 1 "$out" | sed -n 's/.*"xruns":\([0-9]*\).*/\1/p')
+echo "xruns: ${xruns:-?}"
+[ "$xruns" = 0 ] || status=1
+# Enum item 2 is Input Port 1
+[ "$last" = 2 ] || { echo "did not fail back to input 1"; status=1; }
+exit $status
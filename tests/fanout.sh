@@ -0,0 +1,24 @@
+#!/bin/bash
+# Run several capture readers on the same card at once, one per capture
+# subdevice, and check that every one of them streams on its own.
+# Usage: ./fanout.sh card readers [soak options], e.g. ./fanout.sh M2sim 4 -d 30
+
+card=${1:?card}
+readers=${2:?readers}
+shift 2
+
+[ soak -nt soak.c ] || gcc -O2 -Wall -o soak soak.c -lasound || exit 1
+
+pids=()
+for ((i = 0; i < readers; i++)); do
+	./soak -D "hw:CARD=$card,DEV=0,SUBDEV=$i" -m capture -c 128 -p 2048 "$@" &
+	pids+=($!)
+	# Stagger the starts so readers join an engine that is already running
+	sleep 0.5
+done
+
+status=0
+for pid in "${pids[@]}"; do
+	wait "$pid" || status=1
+done
+exit $status
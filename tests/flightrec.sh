@@ -0,0 +1,36 @@
+#!/bin/bash
+# Flight recorder check. Rearms the recorder of a card, forces a capture
+# overrun by stopping the capturing process for a second, and checks that
+# the recorder froze with the xrun as one of its last events. Prints the
+# tail of the dump. Needs root for debugfs.
+# Usage: ./flightrec.sh card_number [card], e.g. ./flightrec.sh 1 M2sim
+
+number=${1:?card number}
+card=${2:-M2}
+events=/sys/kernel/debug/marian-card$number/events
+
+[ -w "$events" ] || { echo "$events: not there or not writable" >&2; exit 1; }
+
+[ soak -nt soak.c ] || gcc -O2 -Wall -o soak soak.c -lasound || exit 1
+
+echo 1 > "$events"
+
+# The hw device only takes non-interleaved access, which soak uses
+./soak -D "hw:CARD=$card,DEV=0" -m capture -c 128 -p 2048 -r 48000 -d 10 > /dev/null &
+pid=$!
+sleep 1
+kill -STOP $pid
+sleep 1
+kill -CONT $pid
+sleep 0.5
+kill $pid
+wait $pid 2>/dev/null
+
+status=0
+head -n 1 "$events"
+head -n 1 "$events" | grep -q frozen || { echo "recorder not frozen"; status=1; }
+grep -q ' xrun ' "$events" || { echo "no xrun event recorded"; status=1; }
+tail -n 20 "$events"
+
+echo 1 > "$events"
+exit $status
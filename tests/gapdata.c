@@ -0,0 +1,348 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Test data generator and gap verifier for the MARIAN Seraph driver
+ *
+ * Every channel file holds the ASCII records "|00000000", "|00000001", ...
+ * packed back to back, so any dropped or repeated audio shows up as a break
+ * in the counter once the recording is read back. The counter wraps from
+ * 99999999 to 0, which is not a break. Files are streamed through a fixed
+ * size block per worker thread, so memory use does not depend on the
+ * recording length.
+ *
+ *   gapdata gen [-c channels] [-d dir] [-j threads] rate seconds
+ *       writes dir/out.wav.0 .. dir/out.wav.N for play_ni.sh
+ *   gapdata verify [-c channels] [-d dir] [-j threads] [-f name]
+ *       checks dir/rec.wav.0 .. dir/rec.wav.N from record_ni.sh
+ *
+ * Build: gcc -O2 -Wall -pthread -o gapdata gapdata.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECORD		9
+#define BLOCK		(RECORD * 65536)
+#define SAMPLE_BYTES	4
+// The eight digit counter wraps to 0 after this many records
+#define WRAP		100000000
+
+struct job {
+	const char *dir;
+	const char *name;
+	unsigned int channels;
+	uint64_t bytes;
+	unsigned int next;
+	unsigned long total_gaps;
+	int failed;
+	pthread_mutex_t lock;
+};
+
+static int next_channel(struct job *job)
+{
+	int ch = -1;
+
+	pthread_mutex_lock(&job->lock);
+	if (job->next < job->channels)
+		ch = job->next++;
+	pthread_mutex_unlock(&job->lock);
+
+	return ch;
+}
+
+static int open_channel(struct job *job, int ch, int flags)
+{
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s.%d", job->dir, job->name, ch);
+	fd = open(path, flags, 0644);
+	if (fd < 0) {
+		pthread_mutex_lock(&job->lock);
+		perror(path);
+		job->failed = 1;
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	return fd;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Step the eight ASCII digits of a record in place */
+static void increment(char *digits)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		if (digits[i] != '9') {
+			digits[i]++;
+			return;
+		}
+		digits[i] = '0';
+	}
+}
+
+static void *gen_worker(void *arg)
+{
+	struct job *job = arg;
+	char *buf = malloc(BLOCK);
+	char record[RECORD];
+	uint64_t left, len, i;
+	int ch, fd;
+
+	while ((ch = next_channel(job)) >= 0) {
+		fd = open_channel(job, ch, O_WRONLY | O_CREAT | O_TRUNC);
+		if (fd < 0)
+			continue;
+
+		memcpy(record, "|00000000", RECORD);
+
+		/*
+		 * Whole records up to the file size, then the head of record 0
+		 * as gendata.py used to pad it.
+		 */
+		left = job->bytes - job->bytes % RECORD;
+		while (left) {
+			len = left < BLOCK ? left : BLOCK;
+			for (i = 0; i < len; i += RECORD) {
+				memcpy(buf + i, record, RECORD);
+				increment(record + 1);
+			}
+			if (write_all(fd, buf, len))
+				break;
+			left -= len;
+		}
+
+		if (!left)
+			left = write_all(fd, "|00000000", job->bytes % RECORD);
+
+		if (left || close(fd)) {
+			pthread_mutex_lock(&job->lock);
+			fprintf(stderr, "channel %d: write failed: %s\n", ch, strerror(errno));
+			job->failed = 1;
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Eight ASCII digits checked and converted as one little endian word, see
+ * "Parsing Gigabytes of JSON per Second" (Langdale, Lemire).
+ */
+static inline int eight_digits(uint64_t v)
+{
+	return ((v & 0xf0f0f0f0f0f0f0f0ULL) |
+		(((v + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4)) ==
+		0x3333333333333333ULL;
+}
+
+static inline uint32_t parse_eight_digits(uint64_t v)
+{
+	const uint64_t mask = 0x000000ff000000ffULL;
+	const uint64_t mul1 = 100 + (1000000ULL << 32);
+	const uint64_t mul2 = 1 + (10000ULL << 32);
+
+	v -= 0x3030303030303030ULL;
+	v = v * 10 + (v >> 8);
+	return (((v & mask) * mul1) + (((v >> 16) & mask) * mul2)) >> 32;
+}
+
+static void *verify_worker(void *arg)
+{
+	struct job *job = arg;
+	char *buf = malloc(BLOCK + RECORD);
+	unsigned long numbers, gaps;
+	int64_t prev, skipped, first, missing;
+	uint64_t base, v;
+	size_t carry, len;
+	char *p, *q, *end;
+	ssize_t n;
+	int ch, fd;
+
+	while ((ch = next_channel(job)) >= 0) {
+		fd = open_channel(job, ch, O_RDONLY);
+		if (fd < 0)
+			continue;
+
+		numbers = gaps = 0;
+		skipped = 0;
+		prev = first = -1;
+		base = 0;
+		carry = 0;
+
+		for (;;) {
+			n = read(fd, buf + carry, BLOCK);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+
+			len = carry + n;
+			p = buf;
+			end = buf + len;
+
+			/* glibc memchr scans with SSE2/AVX2 or NEON */
+			while ((q = memchr(p, '|', end - p))) {
+				if (end - q < RECORD)
+					break;
+
+				memcpy(&v, q + 1, sizeof(v));
+				if (!eight_digits(v)) {
+					p = q + 1;
+					continue;
+				}
+
+				v = parse_eight_digits(v);
+				if (prev < 0) {
+					first = v;
+				} else if ((int64_t)v != (prev + 1) % WRAP) {
+					missing = ((int64_t)v - prev - 1 + WRAP) % WRAP;
+					pthread_mutex_lock(&job->lock);
+					printf("channel %d: gap at byte %llu between %lld and %llu, %lld numbers missing\n",
+					       ch, (unsigned long long)(base + (q - buf)),
+					       (long long)prev, (unsigned long long)v,
+					       (long long)missing);
+					pthread_mutex_unlock(&job->lock);
+					gaps++;
+					skipped += missing;
+				}
+				prev = v;
+				numbers++;
+				p = q + RECORD;
+			}
+
+			// Keep a record cut by the block end for the next read
+			carry = q ? (size_t)(end - q) : 0;
+			memmove(buf, end - carry, carry);
+			base += len - carry;
+		}
+		close(fd);
+
+		pthread_mutex_lock(&job->lock);
+		if (n < 0) {
+			fprintf(stderr, "channel %d: read failed: %s\n", ch, strerror(errno));
+			job->failed = 1;
+		}
+		if (!numbers)
+			printf("channel %d: no numbers found\n", ch);
+		else
+			printf("channel %d: %lu numbers from %lld, %lu gaps, %lld numbers skipped\n",
+			       ch, numbers, (long long)first, gaps, (long long)skipped);
+		job->total_gaps += gaps;
+		if (!numbers)
+			job->failed = 1;
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s gen [-c channels] [-d dir] [-j threads] rate seconds\n"
+		"       %s verify [-c channels] [-d dir] [-j threads] [-f name]\n",
+		prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct job job = {
+		.dir = "data",
+		.channels = 128,
+	};
+	void *(*worker)(void *);
+	pthread_t *threads;
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int gen, opt, i;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	gen = !strcmp(argv[1], "gen");
+	if (!gen && strcmp(argv[1], "verify")) {
+		usage(argv[0]);
+		return 2;
+	}
+	job.name = gen ? "out.wav" : "rec.wav";
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "c:d:j:f:")) != -1) {
+		switch (opt) {
+		case 'c':
+			job.channels = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			job.dir = optarg;
+			break;
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			break;
+		case 'f':
+			job.name = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (gen) {
+		if (argc - optind != 2) {
+			usage(argv[0]);
+			return 2;
+		}
+		job.bytes = strtoull(argv[optind], NULL, 0) * SAMPLE_BYTES *
+			    strtoull(argv[optind + 1], NULL, 0);
+		worker = gen_worker;
+	} else {
+		worker = verify_worker;
+	}
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > job.channels)
+		nthreads = job.channels;
+
+	pthread_mutex_init(&job.lock, NULL);
+	threads = calloc(nthreads, sizeof(*threads));
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, worker, &job);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	if (!gen)
+		printf("%lu gaps in %u channels\n", job.total_gaps, job.channels);
+
+	return job.failed || job.total_gaps ? 1 : 0;
+}
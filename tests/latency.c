@@ -0,0 +1,483 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Round trip latency measurement for the MARIAN Seraph driver
+ *
+ * Turns on the card's loopback, plays an MLS sequence (or a single impulse)
+ * on the selected channels and finds it in the capture by cross-correlation.
+ * Playback and capture are linked, so both stream positions count from the
+ * same start and a sample written at playback position p that comes back at
+ * capture position c has travelled c - p frames more than the buffer
+ * positions account for. Per channel, rate and period size it prints one
+ * JSON line with:
+ *
+ *   latency      c - p, latency hidden from the stream positions
+ *   reported     snd_pcm_delay() of the playback for the first signal frame
+ *   round_trip   reported + latency, frames from writing the signal to it
+ *                arriving in the capture buffer
+ *   capture_delay snd_pcm_delay() of the capture at the same moment
+ *
+ * If the driver reports its delays correctly, latency is 0.
+ *
+ * Against the software model (insmod marian.ko sim=1 id=M2sim):
+ *   ./latency -D hw:CARD=M2sim,DEV=0 -K hw:CARD=M2sim
+ *
+ * Build: gcc -O2 -Wall -o latency latency.c -lasound -lm
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <alsa/asoundlib.h>
+
+#define MAX_LIST	16
+#define MLS_ORDER	15
+#define MLS_LENGTH	((1 << MLS_ORDER) - 1)
+#define AMPLITUDE	(1 << 30)
+
+struct list {
+	unsigned int v[MAX_LIST];
+	int n;
+};
+
+struct config {
+	const char *device;
+	const char *ctl;
+	struct list rates;
+	struct list periods;
+	unsigned int channels;
+	unsigned char selected[256];
+	int impulse;
+};
+
+static int parse_list(const char *arg, struct list *list)
+{
+	char *copy = strdup(arg), *tok, *save = NULL;
+
+	list->n = 0;
+	for (tok = strtok_r(copy, ",", &save); tok && list->n < MAX_LIST;
+	     tok = strtok_r(NULL, ",", &save))
+		list->v[list->n++] = strtoul(tok, NULL, 0);
+
+	free(copy);
+	return list->n ? 0 : -1;
+}
+
+// "0,63-64,127" style channel selection
+static int parse_channels(const char *arg, unsigned char *selected)
+{
+	char *copy = strdup(arg), *tok, *save = NULL, *dash;
+	unsigned int from, to;
+	int n = 0;
+
+	memset(selected, 0, 256);
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		from = to = strtoul(tok, NULL, 0);
+		dash = strchr(tok, '-');
+		if (dash)
+			to = strtoul(dash + 1, NULL, 0);
+		for (; from <= to && from < 256; from++, n++)
+			selected[from] = 1;
+	}
+
+	free(copy);
+	return n ? 0 : -1;
+}
+
+static int set_loopback(const char *name, int on, int *old)
+{
+	snd_ctl_elem_value_t *val;
+	snd_ctl_t *ctl;
+	int err;
+
+	err = snd_ctl_open(&ctl, name, 0);
+	if (err < 0)
+		return err;
+
+	snd_ctl_elem_value_alloca(&val);
+	snd_ctl_elem_value_set_interface(val, SND_CTL_ELEM_IFACE_PCM);
+	snd_ctl_elem_value_set_name(val, "Loopback Switch");
+
+	err = snd_ctl_elem_read(ctl, val);
+	if (err >= 0) {
+		if (old)
+			*old = snd_ctl_elem_value_get_boolean(val, 0);
+		snd_ctl_elem_value_set_boolean(val, 0, on);
+		err = snd_ctl_elem_write(ctl, val);
+	}
+
+	snd_ctl_close(ctl);
+	return err;
+}
+
+// Maximum length sequence from the x^15 + x^14 + 1 LFSR, as +-1
+static void make_mls(float *sig)
+{
+	unsigned int lfsr = 1, bit, i;
+
+	for (i = 0; i < MLS_LENGTH; i++) {
+		sig[i] = (lfsr & 1) ? 1.0f : -1.0f;
+		bit = (lfsr ^ (lfsr >> 1)) & 1;
+		lfsr = (lfsr >> 1) | (bit << (MLS_ORDER - 1));
+	}
+}
+
+// In place iterative radix-2 FFT, inverse when dir is -1 (unscaled)
+static void fft(double *re, double *im, size_t n, int dir)
+{
+	size_t i, j, k, len;
+	double ang, wr, wi, cr, ci, tr, ti, t;
+
+	for (i = 1, j = 0; i < n; i++) {
+		for (k = n >> 1; j & k; k >>= 1)
+			j ^= k;
+		j |= k;
+		if (i < j) {
+			t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+
+	for (len = 2; len <= n; len <<= 1) {
+		ang = dir * -2 * M_PI / len;
+		wr = cos(ang);
+		wi = sin(ang);
+		for (i = 0; i < n; i += len) {
+			cr = 1;
+			ci = 0;
+			for (j = 0; j < len / 2; j++) {
+				k = i + j + len / 2;
+				tr = re[k] * cr - im[k] * ci;
+				ti = re[k] * ci + im[k] * cr;
+				re[k] = re[i + j] - tr;
+				im[k] = im[i + j] - ti;
+				re[i + j] += tr;
+				im[i + j] += ti;
+				t = cr * wr - ci * wi;
+				ci = cr * wi + ci * wr;
+				cr = t;
+			}
+		}
+	}
+}
+
+/*
+ * Position of the signal in the capture, -1 if the best match is too weak to
+ * be the signal. *inverted tells whether it came back with flipped polarity.
+ */
+static long locate(const int32_t *cap, size_t frames, const float *sig, size_t len,
+		   int *inverted)
+{
+	size_t n = 1, i;
+	double *re, *im, *sre, *sim, best = 0, energy = len, r, t;
+	long pos = -1;
+
+	while (n < frames + len)
+		n <<= 1;
+
+	re = calloc(n, sizeof(*re));
+	im = calloc(n, sizeof(*im));
+	sre = calloc(n, sizeof(*sre));
+	sim = calloc(n, sizeof(*sim));
+
+	for (i = 0; i < frames; i++)
+		re[i] = cap[i] / (double)AMPLITUDE;
+	for (i = 0; i < len; i++)
+		sre[i] = sig[i];
+
+	fft(re, im, n, 1);
+	fft(sre, sim, n, 1);
+
+	// Capture times the conjugate of the signal gives the cross-correlation
+	for (i = 0; i < n; i++) {
+		t = re[i] * sre[i] + im[i] * sim[i];
+		im[i] = im[i] * sre[i] - re[i] * sim[i];
+		re[i] = t;
+	}
+	fft(re, im, n, -1);
+
+	for (i = 0; i < frames; i++) {
+		r = re[i] / n;
+		if (fabs(r) > fabs(best)) {
+			best = r;
+			pos = i;
+		}
+	}
+
+	*inverted = best < 0;
+	if (fabs(best) < energy / 4)
+		pos = -1;
+
+	free(re);
+	free(im);
+	free(sre);
+	free(sim);
+	return pos;
+}
+
+static int setup(snd_pcm_t *pcm, unsigned int channels, unsigned int rate,
+		 snd_pcm_uframes_t period)
+{
+	snd_pcm_uframes_t buffer = period * 2;
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	int err;
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_sw_params_alloca(&sw);
+
+	err = snd_pcm_hw_params_any(pcm, hw);
+	if (err < 0)
+		return err;
+
+	snd_pcm_hw_params_set_rate_resample(pcm, hw, 0);
+
+	err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_NONINTERLEAVED);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S32_LE);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_channels(pcm, hw, channels);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_rate(pcm, hw, rate, 0);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_period_size(pcm, hw, period, 0);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params(pcm, hw);
+	if (err < 0)
+		return err;
+
+	snd_pcm_sw_params_current(pcm, sw);
+	snd_pcm_sw_params_set_start_threshold(pcm, sw, buffer * 2);
+
+	return snd_pcm_sw_params(pcm, sw);
+}
+
+static void measure(struct config *cfg, unsigned int rate, unsigned int period)
+{
+	const float *sig;
+	float *mls = NULL;
+	float one = 1.0f;
+	size_t siglen, total, start, written = 0, captured = 0, f, i;
+	snd_pcm_t *play = NULL, *capt = NULL;
+	snd_pcm_sframes_t pdelay = 0, cdelay = 0, n;
+	void **pbufs, **cbufs;
+	int32_t *silence, *scratch, *out, **store;
+	unsigned int ch;
+	long pos;
+	int err, inverted;
+
+	if (cfg->impulse) {
+		sig = &one;
+		siglen = 1;
+	} else {
+		mls = malloc(MLS_LENGTH * sizeof(*mls));
+		make_mls(mls);
+		sig = mls;
+		siglen = MLS_LENGTH;
+	}
+
+	/*
+	 * Silence while the buffer fills and one more period, then the signal
+	 * and a second of capture for it to come back in.
+	 */
+	start = period * 3;
+	total = start + siglen + rate;
+	total += period - total % period;
+
+	pbufs = calloc(cfg->channels, sizeof(*pbufs));
+	cbufs = calloc(cfg->channels, sizeof(*cbufs));
+	store = calloc(cfg->channels, sizeof(*store));
+	silence = calloc(period, sizeof(*silence));
+	scratch = calloc(period, sizeof(*scratch));
+	out = calloc(period, sizeof(*out));
+
+	for (ch = 0; ch < cfg->channels; ch++) {
+		pbufs[ch] = cfg->selected[ch] ? out : silence;
+		if (cfg->selected[ch])
+			store[ch] = calloc(total, sizeof(**store));
+	}
+
+	err = snd_pcm_open(&play, cfg->device, SND_PCM_STREAM_PLAYBACK, 0);
+	if (err >= 0)
+		err = snd_pcm_open(&capt, cfg->device, SND_PCM_STREAM_CAPTURE, 0);
+	if (err >= 0)
+		err = setup(play, cfg->channels, rate, period);
+	if (err >= 0)
+		err = setup(capt, cfg->channels, rate, period);
+	if (err >= 0)
+		err = snd_pcm_link(play, capt);
+	if (err >= 0)
+		err = snd_pcm_prepare(play);
+	if (err < 0)
+		goto fail;
+
+	while (captured < total) {
+		for (i = 0; i < period; i++) {
+			f = written + i;
+			out[i] = f >= start && f - start < siglen ? sig[f - start] * AMPLITUDE : 0;
+		}
+
+		if (written <= start && start < written + period) {
+			snd_pcm_delay(play, &pdelay);
+			snd_pcm_delay(capt, &cdelay);
+			pdelay += start - written;
+		}
+
+		n = snd_pcm_writen(play, pbufs, period);
+		if (n < 0) {
+			err = n;
+			goto fail;
+		}
+		written += n;
+
+		// The first two periods fill the buffer, the link starts capture too
+		if (written < period * 2)
+			continue;
+		if (written == period * 2) {
+			err = snd_pcm_start(play);
+			if (err < 0)
+				goto fail;
+		}
+
+		for (ch = 0; ch < cfg->channels; ch++)
+			cbufs[ch] = cfg->selected[ch] ? store[ch] + captured : scratch;
+
+		n = snd_pcm_readn(capt, cbufs, period);
+		if (n < 0) {
+			err = n;
+			goto fail;
+		}
+		captured += n;
+	}
+
+	for (ch = 0; ch < cfg->channels; ch++) {
+		if (!cfg->selected[ch])
+			continue;
+
+		pos = locate(store[ch], captured, sig, siglen, &inverted);
+		printf("{\"device\":\"%s\",\"rate\":%u,\"period\":%u,\"channel\":%u,\"signal\":\"%s\"",
+		       cfg->device, rate, period, ch, cfg->impulse ? "impulse" : "mls");
+		if (pos < 0)
+			printf(",\"error\":\"signal not found\"}\n");
+		else
+			printf(",\"latency\":%ld,\"reported\":%ld,\"round_trip\":%ld"
+			       ",\"capture_delay\":%ld,\"inverted\":%s}\n",
+			       pos - (long)start, (long)pdelay, pos - (long)start + (long)pdelay,
+			       (long)cdelay, inverted ? "true" : "false");
+	}
+	goto out;
+
+fail:
+	printf("{\"device\":\"%s\",\"rate\":%u,\"period\":%u,\"error\":\"%s\"}\n",
+	       cfg->device, rate, period, snd_strerror(err));
+out:
+	fflush(stdout);
+	if (play) {
+		snd_pcm_drop(play);
+		snd_pcm_close(play);
+	}
+	if (capt) {
+		snd_pcm_drop(capt);
+		snd_pcm_close(capt);
+	}
+	for (ch = 0; ch < cfg->channels; ch++)
+		free(store[ch]);
+	free(store);
+	free(pbufs);
+	free(cbufs);
+	free(silence);
+	free(scratch);
+	free(out);
+	free(mls);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -D device    PCM device (default hw:CARD=M2,DEV=0)\n"
+		"  -K device    control device for the loopback switch (default hw:CARD=M2)\n"
+		"  -r rates     comma separated (default 44100,48000,88200,96000)\n"
+		"  -p periods   period sizes in frames (default 2048)\n"
+		"  -n channels  stream channel count (default 128)\n"
+		"  -c channels  channels to measure, e.g. 0,63-64 (default 0,63,64,127)\n"
+		"  -i           play a single impulse instead of an MLS sequence\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct config cfg = {
+		.device = "hw:CARD=M2,DEV=0",
+		.ctl = "hw:CARD=M2",
+		.channels = 128,
+	};
+	int r, p, opt, err, old = 0;
+
+	parse_list("44100,48000,88200,96000", &cfg.rates);
+	parse_list("2048", &cfg.periods);
+	parse_channels("0,63,64,127", cfg.selected);
+
+	while ((opt = getopt(argc, argv, "D:K:r:p:n:c:ih")) != -1) {
+		switch (opt) {
+		case 'D':
+			cfg.device = optarg;
+			break;
+		case 'K':
+			cfg.ctl = optarg;
+			break;
+		case 'r':
+		case 'p':
+			if (parse_list(optarg, opt == 'r' ? &cfg.rates : &cfg.periods)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n':
+			cfg.channels = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			if (parse_channels(optarg, cfg.selected)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'i':
+			cfg.impulse = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!cfg.channels || cfg.channels > 256) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	err = set_loopback(cfg.ctl, 1, &old);
+	if (err < 0) {
+		fprintf(stderr, "%s: cannot enable loopback: %s\n", cfg.ctl, snd_strerror(err));
+		return 1;
+	}
+
+	for (r = 0; r < cfg.rates.n; r++)
+		for (p = 0; p < cfg.periods.n; p++)
+			measure(&cfg, cfg.rates.v[r], cfg.periods.v[p]);
+
+	set_loopback(cfg.ctl, old, NULL);
+
+	return 0;
+}
@@ -0,0 +1,86 @@
+#!/bin/bash
+# Find the smallest period size that streams without xruns under load.
+# Steps down through the power-of-two period sizes the device offers (two
+# periods per buffer) and soaks each one in duplex while CPU and disk
+# workers run, stopping at the first size that xruns. Prints the soak line
+# of every step, then the winner as JACK and PipeWire settings together
+# with the headroom left between the worst wakeup and the period.
+# Usage: ./minlat.sh [-D device] [-r rate] [-d seconds] [-c cpu workers] [-i io workers]
+
+device=hw:CARD=M2,DEV=0
+rate=48000
+seconds=60
+cpu=$(nproc)
+io=1
+
+while getopts D:r:d:c:i: opt; do
+	case $opt in
+	D) device=$OPTARG ;;
+	r) rate=$OPTARG ;;
+	d) seconds=$OPTARG ;;
+	c) cpu=$OPTARG ;;
+	i) io=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+
+[ soak -nt soak.c ] || gcc -O2 -Wall -o soak soak.c -lasound || exit 1
+
+hw=$(aplay -D "$device" --dump-hw-params -d 1 -f S32_LE -r "$rate" /dev/zero 2>&1)
+pmin=$(echo "$hw" | sed -n 's/^PERIOD_SIZE: *[[(]\([0-9]*\).*/\1/p')
+pmax=$(echo "$hw" | sed -n 's/^PERIOD_SIZE: *[[(][0-9]* \([0-9]*\).*/\1/p')
+pmin=${pmin:-$(echo "$hw" | sed -n 's/^PERIOD_SIZE: *\([0-9]*\)$/\1/p')}
+pmax=${pmax:-$pmin}
+if [ -z "$pmin" ]; then
+	echo "$device: cannot read the period sizes at $rate Hz" >&2
+	exit 1
+fi
+
+pids=()
+tmp=$(mktemp -d)
+trap 'kill "${pids[@]}" 2>/dev/null; wait; rm -rf "$tmp"' EXIT
+
+for ((i = 0; i < cpu; i++)); do
+	while :; do :; done &
+	pids+=($!)
+done
+for ((i = 0; i < io; i++)); do
+	while :; do
+		dd if=/dev/zero of="$tmp/io$i" bs=1M count=64 conv=fsync status=none
+	done &
+	pids+=($!)
+done
+
+best=
+best_line=
+for ((p = 1; p * 2 <= pmax; p *= 2)); do :; done
+for (( ; p >= pmin && p >= 1; p /= 2)); do
+	line=$(./soak -D "$device" -m duplex -r "$rate" -p "$p" -d "$seconds" | tail -n 1)
+	echo "$line"
+
+	xruns=$(echo "$line" | sed -n 's/.*"xruns":\([0-9]*\).*/\1/p')
+	[ "$xruns" = 0 ] || break
+	best=$p
+	best_line=$line
+done
+
+if [ -z "$best" ]; then
+	echo "no period size between $pmin and $pmax ran without xruns" >&2
+	exit 1
+fi
+
+wake_max=$(echo "$best_line" | sed -n 's/.*"wake_us":{[^}]*"max":\([0-9.]*\)}.*/\1/p')
+period_us=$(awk -v p="$best" -v r="$rate" 'BEGIN { printf "%.0f", p * 1e6 / r }')
+headroom_us=$(awk -v a="$period_us" -v b="$wake_max" 'BEGIN { printf "%.0f", a - b }')
+
+cat <<EOF
+{"device":"$device","rate":$rate,"period":$best,"periods":2,"latency_us":$((period_us * 2)),"worst_wake_us":$wake_max,"headroom_us":$headroom_us,"cpu_workers":$cpu,"io_workers":$io,"seconds":$seconds}
+# JACK
+jackd -d alsa -d $device -r $rate -p $best -n 2
+# PipeWire, in the api.alsa node rule for this card
+api.alsa.period-size = $best
+api.alsa.period-num = 2
+api.alsa.headroom = 0
+default.clock.rate = $rate
+default.clock.quantum = $best
+EOF
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Play from several clients on the same card at once: subdevice 0 writes the
+# DMA buffer, the others are mixed into it by the driver. Every client must
+# stream on its own, and killing one must not stop the others.
+# Usage: ./mixclients.sh card clients [soak options], e.g. ./mixclients.sh M2sim 4 -d 30
+
+card=${1:?card}
+clients=${2:?clients}
+shift 2
+
+[ soak -nt soak.c ] || gcc -O2 -Wall -o soak soak.c -lasound || exit 1
+
+pids=()
+for ((i = 0; i < clients; i++)); do
+	./soak -D "hw:CARD=$card,DEV=0,SUBDEV=$i" -m playback -c 128 -p 2048 "$@" &
+	pids+=($!)
+	sleep 0.5
+done
+
+status=0
+for pid in "${pids[@]}"; do
+	wait "$pid" || status=1
+done
+exit $status
@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Status sampler for MARIAN Seraph cards
+ *
+ * Maps /proc/asound/card<N>/status.bin of every Seraph card once and prints
+ * one JSON line per card and sample, without entering the kernel after the
+ * setup. Rates and counters come straight from the driver's status page.
+ *
+ *   mstat [-i interval_ms] [-n samples]
+ *
+ * Build: gcc -O2 -Wall -I.. -o mstat mstat.c ../lib/marian_ring.c
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/marian_ring.h"
+
+#define MAX_CARDS	32
+
+struct card {
+	int number;
+	const struct marian_hwdep_status *page;
+};
+
+static int map_cards(struct card *cards)
+{
+	char path[64];
+	void *p;
+	int i, fd, n = 0;
+
+	for (i = 0; i < MAX_CARDS; i++) {
+		snprintf(path, sizeof(path), "/proc/asound/card%d/status.bin", i);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+
+		p = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) {
+			perror(path);
+			continue;
+		}
+
+		cards[n].number = i;
+		cards[n].page = p;
+		n++;
+	}
+
+	return n;
+}
+
+static void print_card(const struct card *card)
+{
+	struct marian_hwdep_status st;
+	int p;
+
+	marian_status_read(card->page, &st);
+	if (st.version != MARIAN_HWDEP_VERSION) {
+		printf("{\"card\":%d,\"error\":\"status version %u\"}\n", card->number, st.version);
+		return;
+	}
+
+	printf("{\"card\":%d,\"time\":%ld,\"running\":%u,\"periods\":%llu,\"frames\":%llu"
+	       ",\"hw_pointer\":%u,\"irqs\":%llu,\"xruns\":%llu,\"clock_source\":%u"
+	       ",\"rate_mhz\":%u,\"dco_mhz\":%u,\"ext_rate\":%u,\"drift_ppb\":%lld"
+	       ",\"firmware\":\"%08x\",\"fpga_firmware\":\"%02x\",\"redundant_port\":%u"
+	       ",\"switchovers\":%llu,\"ports\":[",
+	       card->number, (long)time(NULL), st.running, (unsigned long long)st.periods,
+	       (unsigned long long)st.frames, st.hw_pointer, (unsigned long long)st.irqs,
+	       (unsigned long long)st.xruns, st.clock_source, st.rate_mhz, st.dco_mhz,
+	       st.ext_rate, (long long)st.drift_ppb, st.firmware, st.fpga_firmware,
+	       st.redundant_port, (unsigned long long)st.switchovers);
+
+	for (p = 0; p < 2; p++)
+		printf("%s{\"sync\":%u,\"in_channels\":%u,\"in_frame\":%u,\"in_rate\":%u"
+		       ",\"out_channels\":%u,\"out_frame\":%u}",
+		       p ? "," : "", st.sync[p], st.input_channels[p], st.input_frame[p],
+		       st.input_rate[p], st.output_channels[p], st.output_frame[p]);
+
+	printf("]}\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct card cards[MAX_CARDS];
+	unsigned int interval = 1000, samples = 1, i;
+	int n, c, opt;
+
+	while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			samples = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-i interval_ms] [-n samples]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	n = map_cards(cards);
+	if (!n) {
+		fprintf(stderr, "no MARIAN cards found\n");
+		return 1;
+	}
+
+	// 0 samples means until interrupted
+	for (i = 0; !samples || i < samples; i++) {
+		if (i)
+			usleep(interval * 1000);
+		for (c = 0; c < n; c++)
+			print_card(&cards[c]);
+		fflush(stdout);
+	}
+
+	return 0;
+}
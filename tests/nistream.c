@@ -0,0 +1,517 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Multichannel recorder and player for the MARIAN Seraph driver
+ *
+ * Streams the PCM's mmapped non-interleaved buffer to or from one raw file
+ * per channel (name.0 .. name.N, the layout of arecord/aplay -I) with
+ * io_uring and O_DIRECT, so the page cache and the plug layer stay out of
+ * the way.
+ *
+ * By default every channel goes through two preallocated, aligned batch
+ * buffers of -b periods. While one batch fills from (or drains to) the DMA
+ * buffer, the other is on its way to (or from) disk, so a disk stall of up to
+ * a whole batch is absorbed. With -b 0 the I/O is issued straight on the DMA
+ * buffer without any copy, each period is committed once its I/O completes
+ * and the disk has to keep up within a single period.
+ *
+ *   nistream record [-D device] [-r rate] [-c channels] [-b periods] -d seconds name
+ *   nistream play [-D device] [-r rate] [-c channels] [-b periods] name
+ *
+ * Build: gcc -O2 -Wall -o nistream nistream.c -lasound -luring
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <alsa/asoundlib.h>
+#include <liburing.h>
+
+#define PERIOD		2048
+#define SAMPLE_BYTES	4
+#define PERIOD_BYTES	(PERIOD * SAMPLE_BYTES)
+#define ALIGN		4096
+
+struct batch {
+	char *buf;
+	unsigned int fill;
+	unsigned int pending;
+	off_t pos;
+};
+
+struct job {
+	snd_pcm_t *pcm;
+	struct io_uring ring;
+	int *fds;
+	unsigned int channels;
+	unsigned int rate;
+	unsigned int periods;	/* per batch, 0 for zero copy */
+	size_t batch_bytes;	/* per channel */
+	struct batch batch[2];
+	int cur;
+	uint64_t total;		/* periods to stream */
+	uint64_t done;
+	off_t pos;		/* file offset of the next zero copy period */
+	unsigned long xruns;
+	unsigned long stalls;
+};
+
+static int open_files(struct job *job, const char *name, int record)
+{
+	char path[4096];
+	unsigned int ch;
+	int flags = record ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+	struct stat st;
+
+	job->fds = calloc(job->channels, sizeof(*job->fds));
+
+	for (ch = 0; ch < job->channels; ch++) {
+		snprintf(path, sizeof(path), "%s.%u", name, ch);
+		job->fds[ch] = open(path, flags | O_DIRECT, 0644);
+		if (job->fds[ch] < 0 && errno == EINVAL) {
+			if (!ch)
+				fprintf(stderr, "%s: no O_DIRECT support, using the page cache\n", path);
+			job->fds[ch] = open(path, flags, 0644);
+		}
+		if (job->fds[ch] < 0) {
+			perror(path);
+			return -1;
+		}
+
+		if (record) {
+			// Allocate up front so writes do not wait for block allocation
+			if (fallocate(job->fds[ch], 0, 0, job->total * PERIOD_BYTES) &&
+			    errno != EOPNOTSUPP)
+				perror(path);
+		} else if (!fstat(job->fds[ch], &st) &&
+			   (!ch || (uint64_t)st.st_size / PERIOD_BYTES < job->total)) {
+			job->total = st.st_size / PERIOD_BYTES;
+		}
+	}
+
+	return 0;
+}
+
+static int setup_pcm(struct job *job, const char *device, int record)
+{
+	snd_pcm_uframes_t buffer = PERIOD * 2;
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	int err;
+
+	err = snd_pcm_open(&job->pcm, device,
+			   record ? SND_PCM_STREAM_CAPTURE : SND_PCM_STREAM_PLAYBACK, 0);
+	if (err < 0)
+		return err;
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_sw_params_alloca(&sw);
+
+	err = snd_pcm_hw_params_any(job->pcm, hw);
+	if (err < 0)
+		return err;
+	snd_pcm_hw_params_set_rate_resample(job->pcm, hw, 0);
+	err = snd_pcm_hw_params_set_access(job->pcm, hw, SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_format(job->pcm, hw, SND_PCM_FORMAT_S32_LE);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_channels(job->pcm, hw, job->channels);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_rate(job->pcm, hw, job->rate, 0);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_period_size(job->pcm, hw, PERIOD, 0);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_buffer_size_near(job->pcm, hw, &buffer);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params(job->pcm, hw);
+	if (err < 0)
+		return err;
+
+	snd_pcm_sw_params_current(job->pcm, sw);
+	snd_pcm_sw_params_set_avail_min(job->pcm, sw, PERIOD);
+	snd_pcm_sw_params_set_start_threshold(job->pcm, sw, buffer * 2);
+
+	return snd_pcm_sw_params(job->pcm, sw);
+}
+
+static int setup_batches(struct job *job)
+{
+	struct iovec iov[2];
+	int i, err;
+
+	if (!job->periods)
+		return 0;
+
+	job->batch_bytes = (size_t)job->periods * PERIOD_BYTES;
+
+	for (i = 0; i < 2; i++) {
+		err = posix_memalign((void **)&job->batch[i].buf, ALIGN,
+				     job->batch_bytes * job->channels);
+		if (err)
+			return -err;
+		memset(job->batch[i].buf, 0, job->batch_bytes * job->channels);
+		iov[i].iov_base = job->batch[i].buf;
+		iov[i].iov_len = job->batch_bytes * job->channels;
+	}
+
+	// Fixed buffers are pinned once instead of on every request
+	return io_uring_register_buffers(&job->ring, iov, 2);
+}
+
+static int queue_io(struct job *job, int record, int fd, void *buf, size_t len, off_t pos,
+		    int fixed, uintptr_t tag)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&job->ring);
+
+	if (!sqe) {
+		io_uring_submit(&job->ring);
+		sqe = io_uring_get_sqe(&job->ring);
+		if (!sqe)
+			return -EBUSY;
+	}
+
+	if (fixed >= 0 && record)
+		io_uring_prep_write_fixed(sqe, fd, buf, len, pos, fixed);
+	else if (fixed >= 0)
+		io_uring_prep_read_fixed(sqe, fd, buf, len, pos, fixed);
+	else if (record)
+		io_uring_prep_write(sqe, fd, buf, len, pos);
+	else
+		io_uring_prep_read(sqe, fd, buf, len, pos);
+
+	io_uring_sqe_set_data(sqe, (void *)tag);
+	return 0;
+}
+
+/* Reap completions, waiting until batch (or the zero copy requests, -1) is idle */
+static int reap(struct job *job, int wait_for, unsigned int *zc_pending)
+{
+	struct io_uring_cqe *cqe;
+	uintptr_t tag;
+	int err;
+
+	for (;;) {
+		if (wait_for >= 0 && !job->batch[wait_for].pending)
+			wait_for = -2;
+		if (wait_for == -1 && !*zc_pending)
+			wait_for = -2;
+
+		if (wait_for == -2)
+			err = io_uring_peek_cqe(&job->ring, &cqe);
+		else
+			err = io_uring_wait_cqe(&job->ring, &cqe);
+		if (err == -EAGAIN)
+			return 0;
+		if (err < 0)
+			return err;
+
+		if (cqe->res < 0) {
+			fprintf(stderr, "I/O failed: %s\n", strerror(-cqe->res));
+			io_uring_cqe_seen(&job->ring, cqe);
+			return cqe->res;
+		}
+
+		tag = (uintptr_t)io_uring_cqe_get_data(cqe);
+		if (tag < 2)
+			job->batch[tag].pending--;
+		else
+			(*zc_pending)--;
+		io_uring_cqe_seen(&job->ring, cqe);
+	}
+}
+
+static char *area_ptr(const snd_pcm_channel_area_t *area, snd_pcm_uframes_t offset)
+{
+	return (char *)area->addr + (area->first + offset * area->step) / 8;
+}
+
+/* Queue one I/O per channel for a whole batch */
+static int queue_batch(struct job *job, int record, int idx)
+{
+	struct batch *b = &job->batch[idx];
+	unsigned int ch;
+	int err;
+
+	for (ch = 0; ch < job->channels; ch++) {
+		err = queue_io(job, record, job->fds[ch], b->buf + ch * job->batch_bytes,
+			       job->batch_bytes, b->pos, idx, idx);
+		if (err < 0)
+			return err;
+	}
+	b->pending = job->channels;
+
+	return io_uring_submit(&job->ring);
+}
+
+/* Move one period between the DMA buffer and its place in the disk pipeline */
+static int transfer_period(struct job *job, int record)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames = PERIOD;
+	struct batch *b = &job->batch[job->cur];
+	unsigned int zc_pending = 0, ch;
+	char *slot;
+	int err;
+
+	err = snd_pcm_mmap_begin(job->pcm, &areas, &offset, &frames);
+	if (err < 0)
+		return err;
+	if (frames != PERIOD)
+		return -EIO;
+
+	if (!job->periods) {
+		// Zero copy, the period stays owned by us until the disk is done with it
+		for (ch = 0; ch < job->channels; ch++) {
+			err = queue_io(job, record, job->fds[ch], area_ptr(&areas[ch], offset),
+				       PERIOD_BYTES, job->pos, -1, 2);
+			if (err < 0)
+				return err;
+		}
+		zc_pending = job->channels;
+		err = io_uring_submit(&job->ring);
+		if (err < 0)
+			return err;
+		err = reap(job, -1, &zc_pending);
+		if (err < 0)
+			return err;
+		job->pos += PERIOD_BYTES;
+	} else {
+		for (ch = 0; ch < job->channels; ch++) {
+			slot = b->buf + ch * job->batch_bytes + b->fill * PERIOD_BYTES;
+			if (record)
+				memcpy(slot, area_ptr(&areas[ch], offset), PERIOD_BYTES);
+			else
+				memcpy(area_ptr(&areas[ch], offset), slot, PERIOD_BYTES);
+		}
+	}
+
+	err = snd_pcm_mmap_commit(job->pcm, offset, frames);
+	if (err < 0)
+		return err;
+
+	job->done++;
+	if (!job->periods || ++b->fill < job->periods)
+		return 0;
+
+	/*
+	 * Batch complete: send it to disk (record) or refill it from disk (play)
+	 * and carry on with the other one, which has had a whole batch worth of
+	 * time for its I/O.
+	 */
+	b->fill = 0;
+	if (record || b->pos + 2 * job->batch_bytes < job->total * PERIOD_BYTES) {
+		if (!record)
+			b->pos += 2 * job->batch_bytes;
+		err = queue_batch(job, record, job->cur);
+		if (err < 0)
+			return err;
+		if (record)
+			job->batch[job->cur ^ 1].pos = b->pos + job->batch_bytes;
+	}
+
+	job->cur ^= 1;
+	if (job->batch[job->cur].pending)
+		job->stalls++;
+	return reap(job, job->cur, &zc_pending);
+}
+
+static int stream(struct job *job, int record)
+{
+	snd_pcm_sframes_t avail;
+	unsigned int zc = 0;
+	int err, started = 0;
+
+	if (job->periods) {
+		// Playback reads both batches ahead, recording starts at offset 0
+		job->batch[0].pos = 0;
+		job->batch[1].pos = job->batch_bytes;
+		if (!record) {
+			err = queue_batch(job, record, 0);
+			if (err >= 0)
+				err = queue_batch(job, record, 1);
+			if (err >= 0)
+				err = reap(job, 0, &zc);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	if (record) {
+		err = snd_pcm_start(job->pcm);
+		if (err < 0)
+			return err;
+		started = 1;
+	}
+
+	while (job->done < job->total) {
+		avail = snd_pcm_avail_update(job->pcm);
+		if (avail >= 0 && avail < PERIOD) {
+			if (!started) {
+				err = snd_pcm_start(job->pcm);
+				if (err < 0)
+					return err;
+				started = 1;
+			}
+			err = snd_pcm_wait(job->pcm, 1000);
+			avail = err < 0 ? err : 0;
+		}
+		if (avail >= 0)
+			avail = transfer_period(job, record);
+
+		if (avail == -EPIPE || avail == -ESTRPIPE) {
+			job->xruns++;
+			fprintf(stderr, "xrun after %llu periods\n", (unsigned long long)job->done);
+			err = snd_pcm_recover(job->pcm, avail, 1);
+			if (err < 0)
+				return err;
+			started = 0;
+			if (record) {
+				err = snd_pcm_start(job->pcm);
+				if (err < 0)
+					return err;
+				started = 1;
+			}
+		} else if (avail < 0) {
+			return avail;
+		}
+	}
+
+	// Flush what is left of the last batch
+	if (record && job->periods && job->batch[job->cur].fill) {
+		struct batch *b = &job->batch[job->cur];
+		unsigned int ch;
+
+		for (ch = 0; ch < job->channels; ch++) {
+			err = queue_io(job, record, job->fds[ch], b->buf + ch * job->batch_bytes,
+				       (size_t)b->fill * PERIOD_BYTES, b->pos, job->cur, job->cur);
+			if (err < 0)
+				return err;
+		}
+		b->pending = job->channels;
+		io_uring_submit(&job->ring);
+	}
+	if (job->periods) {
+		err = reap(job, 0, &zc);
+		if (err >= 0)
+			err = reap(job, 1, &zc);
+		if (err < 0)
+			return err;
+	}
+
+	if (!record)
+		snd_pcm_drain(job->pcm);
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s record [options] -d seconds name\n"
+		"       %s play [options] name\n"
+		"  -D device    PCM device (default hw:CARD=M2,DEV=0)\n"
+		"  -r rate      sample rate (default 48000)\n"
+		"  -c channels  channel count (default 128)\n"
+		"  -b periods   periods per batch, 0 for zero copy (default 16)\n",
+		prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct job job = {
+		.channels = 128,
+		.rate = 48000,
+		.periods = 16,
+		.total = UINT64_MAX,
+	};
+	const char *device = "hw:CARD=M2,DEV=0";
+	unsigned int seconds = 0, ch;
+	int record, opt, err;
+
+	if (argc < 2 || (strcmp(argv[1], "record") && strcmp(argv[1], "play"))) {
+		usage(argv[0]);
+		return 2;
+	}
+	record = !strcmp(argv[1], "record");
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "D:r:c:b:d:")) != -1) {
+		switch (opt) {
+		case 'D':
+			device = optarg;
+			break;
+		case 'r':
+			job.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			job.channels = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			job.periods = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (optind != argc - 1 || !job.channels || (record && !seconds)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	if (record)
+		job.total = ((uint64_t)seconds * job.rate + PERIOD - 1) / PERIOD;
+
+	if (open_files(&job, argv[optind], record))
+		return 1;
+
+	// Room for both batches, or a period of zero copy requests, in flight
+	err = io_uring_queue_init(job.channels * 2, &job.ring, 0);
+	if (err < 0) {
+		fprintf(stderr, "io_uring: %s\n", strerror(-err));
+		return 1;
+	}
+
+	err = setup_batches(&job);
+	if (err < 0) {
+		fprintf(stderr, "batch buffers: %s\n", strerror(-err));
+		return 1;
+	}
+
+	err = setup_pcm(&job, device, record);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", device, snd_strerror(err));
+		return 1;
+	}
+
+	err = stream(&job, record);
+	if (err < 0)
+		fprintf(stderr, "stream: %s\n", snd_strerror(err));
+
+	fprintf(stderr, "%llu periods, %lu xruns, %lu disk stalls\n",
+		(unsigned long long)job.done, job.xruns, job.stalls);
+
+	snd_pcm_close(job.pcm);
+	io_uring_queue_exit(&job.ring);
+	for (ch = 0; ch < job.channels; ch++)
+		close(job.fds[ch]);
+
+	return err < 0 || job.xruns ? 1 : 0;
+}
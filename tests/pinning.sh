@@ -0,0 +1,31 @@
+#!/bin/bash
+# Start playback at one rate, then check that a capture stream opened next
+# to it is only offered that rate and format, and that asking for another
+# rate fails instead of reprogramming the running stream.
+# Usage: ./pinning.sh card [rate], e.g. ./pinning.sh M2sim 96000
+
+card=${1:?card}
+rate=${2:-96000}
+dev="hw:CARD=$card,DEV=0"
+
+[ soak -nt soak.c ] || gcc -O2 -Wall -o soak soak.c -lasound || exit 1
+
+./soak -D "$dev" -m playback -c 128 -p 2048 -r "$rate" -d 10 > /dev/null &
+pid=$!
+sleep 1
+
+status=0
+params=$(arecord -D "$dev" --dump-hw-params -d 1 -f S32_LE -c 128 -r "$rate" /dev/null 2>&1)
+echo "$params" | grep -E '^(RATE|FORMAT):'
+echo "$params" | grep -qE "^RATE: +$rate\$" || { echo "capture rate not pinned"; status=1; }
+
+# The rate rule leaves only the playing rate, so the request fails at refine
+# with EINVAL, before hw_params could answer EBUSY
+other=$((rate == 48000 ? 44100 : 48000))
+result=$(./soak -D "$dev" -m capture -c 128 -p 2048 -r "$other" -d 1)
+echo "$result"
+echo "$result" | grep -q '"error":"Invalid argument"' ||
+	{ echo "capture at $other Hz was not refused while playing at $rate Hz"; status=1; }
+
+wait "$pid" || status=1
+exit $status
@@ -1,3 +1,5 @@
 #!/bin/bash
+# Usage: ./play_ni.sh rate
 
-aplay -D hw:CARD=M2,DEV=0 -c 128 -I -r $1 -f S32_LE data/out.wav
+[ nistream -nt nistream.c ] || gcc -O2 -Wall -o nistream nistream.c -lasound -luring || exit 1
+./nistream play -D hw:CARD=M2,DEV=0 -c 128 -r $1 data/out.wav
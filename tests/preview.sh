@@ -0,0 +1,37 @@
+#!/bin/bash
+# Preview capture check. Records the full-rate capture with soak and the
+# preview device next to it for the same time, then checks that the full
+# recorder saw no xrun and that the preview delivered a quarter of the
+# frames at 16 bit, which is an eighth of the bytes.
+# Usage: ./preview.sh card [seconds] [rate], e.g. ./preview.sh M2sim 10 48000
+
+card=${1:?card}
+seconds=${2:-10}
+rate=${3:-48000}
+channels=128
+
+[ soak -nt soak.c ] || gcc -O2 -Wall -o soak soak.c -lasound || exit 1
+
+out=$(mktemp)
+trap 'rm -f "$out" "$out.preview"' EXIT
+
+./soak -D "hw:CARD=$card,DEV=0" -m capture -c $channels -p 2048 -r "$rate" -d "$seconds" > "$out" &
+pid=$!
+sleep 0.5
+
+arecord -q -D "hw:CARD=$card,DEV=1" -t raw -f S16_LE -c $channels -r $((rate / 4)) \
+	-d $((seconds - 1)) - | wc -c > "$out.preview"
+wait $pid
+
+status=0
+line=$(tail -n 1 "$out")
+echo "$line"
+echo "$line" | grep -q '"xruns":0' || status=1
+
+bytes=$(cat "$out.preview")
+expected=$(((seconds - 1) * rate / 4 * channels * 2))
+echo "preview: $bytes bytes, $expected expected"
+# arecord stops on a period boundary, allow one period either way
+[ $((bytes - expected)) -le $((512 * channels * 2)) ] && [ $((expected - bytes)) -le $((512 * channels * 2)) ] || status=1
+
+exit $status
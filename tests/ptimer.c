@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Period timer check for the MARIAN Seraph driver
+ *
+ * Opens the card timer the driver registers for its period interrupt, with
+ * no PCM open, and measures the tick interval against CLOCK_MONOTONIC. Prints
+ * one JSON line with the resolution the timer reports, the mean and worst
+ * interval, and the sample rate the mean works out to.
+ *
+ *   ptimer [-c card] [-n ticks]
+ *
+ * Build: gcc -O2 -Wall -o ptimer ptimer.c -lasound
+ */
+
+#include <getopt.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+
+#define PERIOD_FRAMES	2048
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int card = 0, ticks = 500, n = 0;
+	snd_timer_params_t *params;
+	snd_timer_info_t *info;
+	snd_timer_read_t tr;
+	snd_timer_t *timer;
+	struct pollfd pfd;
+	int64_t t, last = 0, first = 0, d, d_min = INT64_MAX, d_max = 0;
+	char name[128];
+	int opt, err;
+
+	while ((opt = getopt(argc, argv, "c:n:")) != -1) {
+		switch (opt) {
+		case 'c':
+			card = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			ticks = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-c card] [-n ticks]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	snprintf(name, sizeof(name), "hw:CLASS=%d,SCLASS=%d,CARD=%u,DEV=0,SUBDEV=0",
+		 SND_TIMER_CLASS_CARD, SND_TIMER_SCLASS_NONE, card);
+
+	err = snd_timer_open(&timer, name, SND_TIMER_OPEN_NONBLOCK);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", name, snd_strerror(err));
+		return 1;
+	}
+
+	snd_timer_info_alloca(&info);
+	snd_timer_params_alloca(&params);
+
+	snd_timer_info(timer, info);
+	snd_timer_params_set_auto_start(params, 1);
+	snd_timer_params_set_ticks(params, 1);
+	err = snd_timer_params(timer, params);
+	if (!err)
+		err = snd_timer_start(timer);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", name, snd_strerror(err));
+		return 1;
+	}
+
+	snd_timer_poll_descriptors(timer, &pfd, 1);
+
+	while (n <= ticks) {
+		if (poll(&pfd, 1, 1000) <= 0) {
+			fprintf(stderr, "%s: no tick within a second\n", name);
+			break;
+		}
+		t = now_ns();
+		while (snd_timer_read(timer, &tr, sizeof(tr)) == sizeof(tr))
+			;
+
+		if (n) {
+			d = t - last;
+			if (d < d_min)
+				d_min = d;
+			if (d > d_max)
+				d_max = d;
+		} else {
+			first = t;
+		}
+		last = t;
+		n++;
+	}
+
+	snd_timer_stop(timer);
+	snd_timer_close(timer);
+
+	if (n < 2)
+		return 1;
+
+	d = (last - first) / (n - 1);
+	printf("{\"timer\":\"%s\",\"resolution_ns\":%ld,\"ticks\":%u,\"interval_us\":"
+	       "{\"mean\":%.1f,\"min\":%.1f,\"max\":%.1f},\"rate\":%.3f}\n",
+	       name, snd_timer_info_get_resolution(info), n - 1, d / 1000.0, d_min / 1000.0,
+	       d_max / 1000.0, (double)PERIOD_FRAMES * (n - 1) * 1e9 / (last - first));
+
+	return n <= ticks;
+}
@@ -1,3 +1,5 @@
 #!/bin/bash
+# Usage: ./record_ni.sh rate seconds
 
-arecord --buffer-size 256000 -D hw:CARD=M2,DEV=0 -c 128 -I -r $1 -f S32_LE --duration=$2 data/rec.wav
+[ nistream -nt nistream.c ] || gcc -O2 -Wall -o nistream nistream.c -lasound -luring || exit 1
+./nistream record -D hw:CARD=M2,DEV=0 -c 128 -r $1 -d $2 data/rec.wav
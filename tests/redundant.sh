@@ -0,0 +1,45 @@
+#!/bin/bash
+# Redundant input mode. Checks that capture is offered one port's worth of
+# channels with the mode on, and records with them while watching the input
+# in use. On a real card, pull the cable of the input in use during the
+# recording: the other one should take over without an xrun, which mstat's
+# switchovers counter and the "Redundant Input Port" control show. The
+# switch itself has to refuse changes while capture is open.
+# Usage: ./redundant.sh card [seconds], e.g. ./redundant.sh M2sim 10
+
+card=${1:?card}
+seconds=${2:-10}
+dev="hw:CARD=$card,DEV=0"
+
+[ soak -nt soak.c ] || gcc -O2 -Wall -o soak soak.c -lasound || exit 1
+[ mstat -nt mstat.c ] || gcc -O2 -Wall -I.. -o mstat mstat.c ../lib/marian_ring.c || exit 1
+
+amixer -q -c "$card" cset name='Redundant Input Switch' on || exit 1
+trap 'amixer -q -c "$card" cset name="Redundant Input Switch" off' EXIT
+
+status=0
+params=$(arecord -D "$dev" --dump-hw-params -d 1 -f S32_LE /dev/null 2>&1)
+echo "$params" | grep -E '^CHANNELS:'
+echo "$params" | grep -qE '^CHANNELS: +(56|64)$' || { echo "capture not reduced to one port"; status=1; }
+
+amixer -c "$card" cget name='Redundant Input Port' | grep ': values='
+before=$(./mstat | grep -o '"switchovers":[0-9]*')
+
+out=$(mktemp)
+./soak -D "$dev" -m capture -c 64 -p 2048 -r 48000 -d "$seconds" > "$out" &
+soak=$!
+sleep 1
+if amixer -q -c "$card" cset name='Redundant Input Switch' off 2> /dev/null; then
+	echo "switch changed while capturing"
+	status=1
+fi
+wait $soak
+line=$(tail -n 1 "$out")
+rm -f "$out"
+echo "$line"
+echo "$line" | grep -q '"xruns":0' || status=1
+
+amixer -c "$card" cget name='Redundant Input Port' | grep ': values='
+echo "${before:-\"switchovers\":?} -> $(./mstat | grep -o '"switchovers":[0-9]*')"
+
+exit $status
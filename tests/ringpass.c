@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Passthrough over the hwdep DMA ring of the MARIAN Seraph driver
+ *
+ * Starts linked capture and playback on the PCM device with the stop
+ * threshold at the boundary, then copies every captured period of all
+ * channels to the playback half through lib/marian_ring, with no system call
+ * per period when spinning. Prints one JSON line with the wakeup latency
+ * after the period interrupt and the number of periods lost.
+ *
+ *   ringpass [-D pcm] [-H hwdep] [-r rate] [-d seconds] [-s]
+ *
+ * The module has to be loaded with hwdep=1.
+ *
+ * Build: gcc -O2 -Wall -I.. -o ringpass ringpass.c ../lib/marian_ring.c -lasound
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+
+#include "../lib/marian_ring.h"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int setup(snd_pcm_t *pcm, unsigned int rate, unsigned int channels)
+{
+	snd_pcm_uframes_t period = 2048, buffer = 4096, boundary;
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	int err;
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_sw_params_alloca(&sw);
+
+	err = snd_pcm_hw_params_any(pcm, hw);
+	if (err < 0)
+		return err;
+	snd_pcm_hw_params_set_rate_resample(pcm, hw, 0);
+	err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S32_LE);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_channels(pcm, hw, channels);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_rate(pcm, hw, rate, 0);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_period_size(pcm, hw, period, 0);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params(pcm, hw);
+	if (err < 0)
+		return err;
+
+	// Nobody moves the application pointer, so ALSA must not count xruns
+	snd_pcm_sw_params_current(pcm, sw);
+	snd_pcm_sw_params_get_boundary(sw, &boundary);
+	snd_pcm_sw_params_set_stop_threshold(pcm, sw, boundary);
+	snd_pcm_sw_params_set_start_threshold(pcm, sw, boundary);
+
+	return snd_pcm_sw_params(pcm, sw);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-D pcm] [-H hwdep] [-r rate] [-d seconds] [-s]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = "hw:0,0", *hwdep = "/dev/snd/hwC0D0";
+	unsigned int rate = 48000, seconds = 10, ch;
+	snd_pcm_t *capture, *playback;
+	struct marian_ring_period period;
+	struct marian_ring ring;
+	unsigned long periods = 0, lost = 0;
+	double wake, wake_sum = 0, wake_max = 0;
+	int64_t start, end;
+	int spin = 0, opt, err;
+
+	while ((opt = getopt(argc, argv, "D:H:r:d:s")) != -1) {
+		switch (opt) {
+		case 'D':
+			device = optarg;
+			break;
+		case 'H':
+			hwdep = optarg;
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			spin = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (marian_ring_open(&ring, hwdep) < 0) {
+		perror(hwdep);
+		return 1;
+	}
+
+	err = snd_pcm_open(&capture, device, SND_PCM_STREAM_CAPTURE, 0);
+	if (!err)
+		err = snd_pcm_open(&playback, device, SND_PCM_STREAM_PLAYBACK, 0);
+	if (!err)
+		err = setup(capture, rate, ring.info.channels);
+	if (!err)
+		err = setup(playback, rate, ring.info.channels);
+	if (!err)
+		err = snd_pcm_link(capture, playback);
+	if (!err)
+		err = snd_pcm_start(capture);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", device, snd_strerror(err));
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	start = now_ns();
+	end = start + (int64_t)seconds * 1000000000;
+
+	while (!stop && now_ns() < end) {
+		if (!marian_ring_next(&ring, &period)) {
+			if (!spin && marian_ring_wait(&ring, 1000) < 0 && errno != EINTR) {
+				perror("wait");
+				break;
+			}
+			continue;
+		}
+
+		wake = (now_ns() - period.tstamp_ns) / 1000.0;
+		wake_sum += wake;
+		if (wake > wake_max)
+			wake_max = wake;
+		periods++;
+		lost += period.lost;
+
+		for (ch = 0; ch < ring.info.channels; ch++)
+			memcpy(marian_ring_playback(&ring, ch, period.offset),
+			       marian_ring_capture(&ring, ch, period.offset),
+			       ring.info.period_frames * ring.info.sample_bytes);
+	}
+
+	snd_pcm_drop(capture);
+	snd_pcm_unlink(capture);
+	snd_pcm_close(playback);
+	snd_pcm_close(capture);
+	marian_ring_close(&ring);
+
+	printf("{\"device\":\"%s\",\"rate\":%u,\"wait\":\"%s\",\"seconds\":%.1f"
+	       ",\"periods\":%lu,\"lost\":%lu,\"wake_us\":{\"mean\":%.1f,\"max\":%.1f}}\n",
+	       device, rate, spin ? "spin" : "poll", (now_ns() - start) / 1e9,
+	       periods, lost, periods ? wake_sum / periods : 0.0, wake_max);
+
+	return lost ? 1 : 0;
+}
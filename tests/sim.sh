@@ -0,0 +1,12 @@
+#!/bin/bash
+# Soak the driver against the software model of the card, no hardware needed.
+# Usage (as root): ./sim.sh [soak options], e.g. ./sim.sh -d 10 -r 48000
+
+set -e
+make -C ..
+modprobe snd_pcm
+insmod ../marian.ko sim=1 hwdep=1 id=M2sim
+trap 'rmmod marian' EXIT
+
+[ soak -nt soak.c ] || gcc -O2 -Wall -o soak soak.c -lasound
+./soak -D hw:CARD=M2sim,DEV=0 "$@"
@@ -0,0 +1,533 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Soak test and benchmark for the MARIAN Seraph driver
+ *
+ * Opens the hw device directly with mmap non-interleaved access and runs
+ * every combination of rate, period size and channel count for a fixed time,
+ * repeating the sweep as often as asked. Each run prints one JSON object per
+ * line, so results can be collected and trended across driver versions.
+ *
+ * Build: gcc -O2 -Wall -o soak soak.c -lasound
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/utsname.h>
+#include <alsa/asoundlib.h>
+
+#define MAX_LIST	16
+#define HIST_US		100000
+
+enum {
+	MODE_CAPTURE,
+	MODE_PLAYBACK,
+	MODE_DUPLEX,
+};
+
+static const char * const mode_names[] = { "capture", "playback", "duplex" };
+
+struct list {
+	unsigned int v[MAX_LIST];
+	int n;
+};
+
+struct config {
+	const char *device;
+	struct list rates;
+	struct list periods;
+	struct list channels;
+	unsigned int duration;
+	unsigned int loops;
+	int mode;
+};
+
+struct stats {
+	unsigned long periods;
+	unsigned long xruns;
+	unsigned long ptr_regressions;
+	unsigned long ptr_jumps;
+	unsigned long wakeups;
+	double wake_sum;
+	double wake_max;
+	double interval_sum;
+	double interval_max;
+	double cpu_sum;
+	double cpu_max;
+	unsigned int *hist;
+	unsigned long hist_over;
+};
+
+struct stream {
+	snd_pcm_t *pcm;
+	snd_pcm_stream_t dir;
+	unsigned int channels;
+	snd_pcm_uframes_t period;
+	snd_pcm_uframes_t buffer;
+	// frames committed since start and the hardware position seen last
+	uint64_t committed;
+	int64_t last_pos;
+	uint32_t pattern;
+	volatile uint64_t sink;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static uint64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int parse_list(const char *arg, struct list *list)
+{
+	char *copy = strdup(arg), *tok, *save = NULL;
+
+	list->n = 0;
+	for (tok = strtok_r(copy, ",", &save); tok && list->n < MAX_LIST;
+	     tok = strtok_r(NULL, ",", &save))
+		list->v[list->n++] = strtoul(tok, NULL, 0);
+
+	free(copy);
+	return list->n ? 0 : -1;
+}
+
+static int setup(struct stream *st, unsigned int rate)
+{
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	int err;
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_sw_params_alloca(&sw);
+
+	err = snd_pcm_hw_params_any(st->pcm, hw);
+	if (err < 0)
+		return err;
+
+	snd_pcm_hw_params_set_rate_resample(st->pcm, hw, 0);
+
+	err = snd_pcm_hw_params_set_access(st->pcm, hw, SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_format(st->pcm, hw, SND_PCM_FORMAT_S32_LE);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_channels(st->pcm, hw, st->channels);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_rate(st->pcm, hw, rate, 0);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_period_size(st->pcm, hw, st->period, 0);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_buffer_size_near(st->pcm, hw, &st->buffer);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params(st->pcm, hw);
+	if (err < 0)
+		return err;
+
+	snd_pcm_sw_params_current(st->pcm, sw);
+	snd_pcm_sw_params_set_avail_min(st->pcm, sw, st->period);
+	snd_pcm_sw_params_set_start_threshold(st->pcm, sw, st->buffer * 2);
+	snd_pcm_sw_params_set_tstamp_mode(st->pcm, sw, SND_PCM_TSTAMP_ENABLE);
+	snd_pcm_sw_params_set_tstamp_type(st->pcm, sw, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+
+	return snd_pcm_sw_params(st->pcm, sw);
+}
+
+/*
+ * Capture reads every sample, playback writes a counter into every sample,
+ * so the CPU cost per period includes touching the whole period once.
+ */
+static void touch(struct stream *st, const snd_pcm_channel_area_t *areas,
+		  snd_pcm_uframes_t offset, snd_pcm_uframes_t frames)
+{
+	uint64_t sum = 0;
+	unsigned int ch;
+	snd_pcm_uframes_t i;
+	int32_t *p;
+
+	for (ch = 0; ch < st->channels; ch++) {
+		p = (int32_t *)((char *)areas[ch].addr + (areas[ch].first + offset * areas[ch].step) / 8);
+
+		if (st->dir == SND_PCM_STREAM_CAPTURE) {
+			for (i = 0; i < frames; i++)
+				sum += p[i];
+		} else {
+			for (i = 0; i < frames; i++)
+				p[i] = st->pattern + i;
+		}
+	}
+
+	st->pattern += frames;
+	st->sink += sum;
+}
+
+static int transfer(struct stream *st, snd_pcm_uframes_t want)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t done;
+	int err;
+
+	while (want > 0) {
+		frames = want;
+		err = snd_pcm_mmap_begin(st->pcm, &areas, &offset, &frames);
+		if (err < 0)
+			return err;
+
+		touch(st, areas, offset, frames);
+
+		done = snd_pcm_mmap_commit(st->pcm, offset, frames);
+		if (done < 0)
+			return done;
+
+		st->committed += done;
+		want -= done;
+	}
+
+	return 0;
+}
+
+static void check_pointer(struct stream *st, snd_pcm_uframes_t avail, struct stats *stats)
+{
+	int64_t pos;
+
+	if (st->dir == SND_PCM_STREAM_CAPTURE)
+		pos = st->committed + avail;
+	else
+		pos = st->committed - (st->buffer - avail);
+
+	if (st->last_pos >= 0) {
+		if (pos < st->last_pos)
+			stats->ptr_regressions++;
+		else if (pos - st->last_pos > (int64_t)st->buffer)
+			stats->ptr_jumps++;
+	}
+
+	st->last_pos = pos;
+}
+
+static int service(struct stream *st, struct stats *stats, uint64_t wake)
+{
+	snd_pcm_uframes_t avail;
+	snd_htimestamp_t ts;
+	uint64_t irq, cpu;
+	double lat, used;
+	int err;
+
+	err = snd_pcm_htimestamp(st->pcm, &avail, &ts);
+	if (err < 0)
+		return err;
+
+	// Time from the pointer update in the interrupt to this thread running
+	irq = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	if (irq && wake > irq) {
+		lat = (wake - irq) / 1000.0;
+		stats->wake_sum += lat;
+		stats->wakeups++;
+		if (lat > stats->wake_max)
+			stats->wake_max = lat;
+		if (lat < HIST_US)
+			stats->hist[(unsigned int)lat]++;
+		else
+			stats->hist_over++;
+	}
+
+	check_pointer(st, avail, stats);
+
+	if (avail < st->period)
+		return 0;
+
+	cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	err = transfer(st, avail - avail % st->period);
+	used = (now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu) / 1000.0;
+	if (err < 0)
+		return err;
+
+	stats->periods += avail / st->period;
+	stats->cpu_sum += used;
+	if (used > stats->cpu_max)
+		stats->cpu_max = used;
+
+	return 0;
+}
+
+/*
+ * Linked streams stop together on an xrun, so restart the whole group and
+ * count it once.
+ */
+static int recover(struct stream *streams, int n, int err, struct stats *stats)
+{
+	int i;
+
+	if (err != -EPIPE && err != -ESTRPIPE)
+		return err;
+
+	stats->xruns++;
+
+	for (i = 0; i < n; i++) {
+		snd_pcm_drop(streams[i].pcm);
+		err = snd_pcm_prepare(streams[i].pcm);
+		if (err < 0)
+			return err;
+
+		streams[i].committed = 0;
+		streams[i].last_pos = -1;
+
+		if (streams[i].dir == SND_PCM_STREAM_PLAYBACK) {
+			err = transfer(&streams[i], streams[i].buffer);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	return snd_pcm_start(streams[0].pcm);
+}
+
+static double percentile(struct stats *stats, double p)
+{
+	unsigned long want = stats->wakeups * p, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < HIST_US; i++) {
+		seen += stats->hist[i];
+		if (seen > want)
+			return i;
+	}
+
+	return HIST_US;
+}
+
+static void report(FILE *out, struct config *cfg, unsigned int rate, unsigned int period,
+		   unsigned int channels, const char *error, struct stats *stats, double secs)
+{
+	struct utsname uts;
+
+	uname(&uts);
+
+	fprintf(out, "{\"time\":%ld,\"kernel\":\"%s\",\"device\":\"%s\",\"mode\":\"%s\","
+		"\"rate\":%u,\"period\":%u,\"channels\":%u",
+		(long)time(NULL), uts.release, cfg->device, mode_names[cfg->mode],
+		rate, period, channels);
+
+	if (error) {
+		fprintf(out, ",\"error\":\"%s\"}\n", error);
+		fflush(out);
+		return;
+	}
+
+	fprintf(out, ",\"seconds\":%.1f,\"periods\":%lu,\"xruns\":%lu"
+		",\"ptr_regressions\":%lu,\"ptr_jumps\":%lu"
+		",\"wake_us\":{\"mean\":%.1f,\"p50\":%.0f,\"p99\":%.0f,\"p999\":%.0f,\"max\":%.1f}"
+		",\"interval_dev_us\":{\"mean\":%.1f,\"max\":%.1f}"
+		",\"cpu_us_per_period\":{\"mean\":%.1f,\"max\":%.1f}}\n",
+		secs, stats->periods, stats->xruns, stats->ptr_regressions, stats->ptr_jumps,
+		stats->wakeups ? stats->wake_sum / stats->wakeups : 0.0,
+		percentile(stats, 0.5), percentile(stats, 0.99), percentile(stats, 0.999),
+		stats->wake_max,
+		stats->wakeups > 1 ? stats->interval_sum / (stats->wakeups - 1) : 0.0,
+		stats->interval_max,
+		stats->periods ? stats->cpu_sum / stats->periods : 0.0, stats->cpu_max);
+	fflush(out);
+}
+
+static void run(FILE *out, struct config *cfg, unsigned int rate, unsigned int period,
+		unsigned int channels)
+{
+	struct stream streams[2];
+	struct stats stats;
+	uint64_t start, end, wake, prev = 0;
+	double ideal = period * 1e6 / rate, dev;
+	int n = 0, i, err;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.hist = calloc(HIST_US, sizeof(*stats.hist));
+	memset(streams, 0, sizeof(streams));
+
+	if (cfg->mode != MODE_PLAYBACK)
+		streams[n++].dir = SND_PCM_STREAM_CAPTURE;
+	if (cfg->mode != MODE_CAPTURE)
+		streams[n++].dir = SND_PCM_STREAM_PLAYBACK;
+
+	for (i = 0; i < n; i++) {
+		streams[i].channels = channels;
+		streams[i].period = period;
+		streams[i].buffer = period * 2;
+		streams[i].last_pos = -1;
+
+		err = snd_pcm_open(&streams[i].pcm, cfg->device, streams[i].dir, 0);
+		if (err < 0)
+			goto fail;
+		err = setup(&streams[i], rate);
+		if (err < 0)
+			goto fail;
+		err = snd_pcm_prepare(streams[i].pcm);
+		if (err < 0)
+			goto fail;
+		if (streams[i].dir == SND_PCM_STREAM_PLAYBACK) {
+			err = transfer(&streams[i], streams[i].buffer);
+			if (err < 0)
+				goto fail;
+		}
+	}
+
+	if (n == 2) {
+		err = snd_pcm_link(streams[0].pcm, streams[1].pcm);
+		if (err < 0)
+			goto fail;
+	}
+
+	err = snd_pcm_start(streams[0].pcm);
+	if (err < 0)
+		goto fail;
+
+	start = now_ns(CLOCK_MONOTONIC);
+	end = start + cfg->duration * 1000000000ULL;
+
+	while (!stop && (wake = now_ns(CLOCK_MONOTONIC)) < end) {
+		err = snd_pcm_wait(streams[0].pcm, 1000);
+		wake = now_ns(CLOCK_MONOTONIC);
+		if (err == -EINTR)
+			continue;
+
+		if (prev) {
+			dev = (wake - prev) / 1000.0 - ideal;
+			if (dev < 0)
+				dev = -dev;
+			stats.interval_sum += dev;
+			if (dev > stats.interval_max)
+				stats.interval_max = dev;
+		}
+		prev = wake;
+
+		for (i = 0; i < n && err >= 0; i++)
+			err = service(&streams[i], &stats, wake);
+
+		if (err < 0) {
+			err = recover(streams, n, err, &stats);
+			if (err < 0)
+				goto fail;
+			prev = 0;
+		}
+	}
+
+	report(out, cfg, rate, period, channels, NULL, &stats,
+	       (now_ns(CLOCK_MONOTONIC) - start) / 1e9);
+	goto out;
+
+fail:
+	report(out, cfg, rate, period, channels, snd_strerror(err), &stats, 0);
+out:
+	for (i = 0; i < n; i++) {
+		if (streams[i].pcm) {
+			snd_pcm_drop(streams[i].pcm);
+			snd_pcm_close(streams[i].pcm);
+		}
+	}
+	free(stats.hist);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -D device    PCM device (default hw:CARD=M2,DEV=0)\n"
+		"  -m mode      capture, playback or duplex (default duplex)\n"
+		"  -r rates     comma separated (default 44100,48000,88200,96000)\n"
+		"  -p periods   period sizes in frames (default 2048)\n"
+		"  -c channels  channel counts (default 128)\n"
+		"  -d seconds   duration of every run (default 60)\n"
+		"  -l loops     sweeps to run, 0 until interrupted (default 1)\n"
+		"  -o file      append results to file instead of stdout\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct config cfg = {
+		.device = "hw:CARD=M2,DEV=0",
+		.duration = 60,
+		.loops = 1,
+		.mode = MODE_DUPLEX,
+	};
+	FILE *out = stdout;
+	unsigned int loop;
+	int r, p, c, opt;
+
+	parse_list("44100,48000,88200,96000", &cfg.rates);
+	parse_list("2048", &cfg.periods);
+	parse_list("128", &cfg.channels);
+
+	while ((opt = getopt(argc, argv, "D:m:r:p:c:d:l:o:h")) != -1) {
+		switch (opt) {
+		case 'D':
+			cfg.device = optarg;
+			break;
+		case 'm':
+			for (cfg.mode = 0; cfg.mode <= MODE_DUPLEX; cfg.mode++)
+				if (!strcmp(optarg, mode_names[cfg.mode]))
+					break;
+			if (cfg.mode > MODE_DUPLEX) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'r':
+		case 'p':
+		case 'c':
+			if (parse_list(optarg, opt == 'r' ? &cfg.rates :
+				       opt == 'p' ? &cfg.periods : &cfg.channels)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'd':
+			cfg.duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			cfg.loops = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			out = fopen(optarg, "a");
+			if (!out) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	for (loop = 0; !stop && (!cfg.loops || loop < cfg.loops); loop++)
+		for (r = 0; !stop && r < cfg.rates.n; r++)
+			for (p = 0; !stop && p < cfg.periods.n; p++)
+				for (c = 0; !stop && c < cfg.channels.n; c++)
+					run(out, &cfg, cfg.rates.v[r], cfg.periods.v[p],
+					    cfg.channels.v[c]);
+
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
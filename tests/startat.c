@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Timed start check for the MARIAN Seraph driver
+ *
+ * Sets up duplex on the card with the start threshold at the boundary, so
+ * that neither direction starts on its own, links the two and asks the hwdep
+ * device to start them at a point in the future. Prints one JSON line with
+ * the requested and actual start time, the card frame it happened at and the
+ * trigger timestamps ALSA reports for both directions.
+ *
+ *   startat [-D pcm] [-H hwdep] [-t delay_ms] [-f frames]
+ *
+ * With -f, the start is requested in card frames from now instead, which
+ * needs the DMA engine running already: something else has to be streaming,
+ * on a mixed playback subdevice for instance.
+ *
+ * Build: gcc -O2 -Wall -I.. -o startat startat.c ../lib/marian_ring.c -lasound
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <alsa/asoundlib.h>
+
+#include "../lib/marian_ring.h"
+
+#define CHANNELS	128
+#define RATE		48000
+#define PERIOD_FRAMES	2048
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int setup(snd_pcm_t **pcm, const char *device, snd_pcm_stream_t stream)
+{
+	snd_pcm_uframes_t period = PERIOD_FRAMES, buffer = PERIOD_FRAMES * 2, boundary;
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	int err;
+
+	err = snd_pcm_open(pcm, device, stream, 0);
+	if (err < 0)
+		return err;
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_hw_params_any(*pcm, hw);
+	snd_pcm_hw_params_set_access(*pcm, hw, SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+	snd_pcm_hw_params_set_format(*pcm, hw, SND_PCM_FORMAT_S32_LE);
+	snd_pcm_hw_params_set_channels(*pcm, hw, CHANNELS);
+	snd_pcm_hw_params_set_rate(*pcm, hw, RATE, 0);
+	snd_pcm_hw_params_set_period_size_near(*pcm, hw, &period, NULL);
+	snd_pcm_hw_params_set_buffer_size_near(*pcm, hw, &buffer);
+	err = snd_pcm_hw_params(*pcm, hw);
+	if (err < 0)
+		return err;
+
+	snd_pcm_sw_params_alloca(&sw);
+	snd_pcm_sw_params_current(*pcm, sw);
+	snd_pcm_sw_params_get_boundary(sw, &boundary);
+	snd_pcm_sw_params_set_start_threshold(*pcm, sw, boundary);
+	snd_pcm_sw_params_set_tstamp_mode(*pcm, sw, SND_PCM_TSTAMP_ENABLE);
+	snd_pcm_sw_params_set_tstamp_type(*pcm, sw, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+	err = snd_pcm_sw_params(*pcm, sw);
+	if (err < 0)
+		return err;
+
+	return snd_pcm_prepare(*pcm);
+}
+
+// Fill the playback buffer with silence, so the start doesn't run into an xrun
+static int prefill(snd_pcm_t *pcm)
+{
+	static int32_t zero[PERIOD_FRAMES * 2];
+	void *bufs[CHANNELS];
+	snd_pcm_sframes_t n;
+	int ch;
+
+	for (ch = 0; ch < CHANNELS; ch++)
+		bufs[ch] = zero;
+
+	n = snd_pcm_mmap_writen(pcm, bufs, PERIOD_FRAMES * 2);
+	return n < 0 ? n : 0;
+}
+
+static int64_t trigger_ns(snd_pcm_t *pcm)
+{
+	snd_pcm_status_t *status;
+	snd_htimestamp_t ts;
+
+	snd_pcm_status_alloca(&status);
+	if (snd_pcm_status(pcm, status) < 0)
+		return 0;
+	snd_pcm_status_get_trigger_htstamp(status, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Card frame the engine is at, extrapolated from the last period interrupt
+static int64_t card_frame(int fd, struct marian_hwdep_status *st)
+{
+	const struct marian_hwdep_status *page;
+	int64_t frame;
+
+	page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, MARIAN_HWDEP_MMAP_STATUS);
+	if (page == MAP_FAILED)
+		return -1;
+
+	marian_status_read(page, st);
+	munmap((void *)page, sysconf(_SC_PAGESIZE));
+	if (!st->running || !st->rate_mhz)
+		return -1;
+
+	frame = st->frames + st->hw_pointer % PERIOD_FRAMES;
+	return frame + (now_ns() - st->tstamp_ns) * (int64_t)st->rate_mhz / 1000000000000LL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = "hw:CARD=M2,DEV=0", *hwdep = "/dev/snd/hwC0D0";
+	unsigned int delay_ms = 500, frames = 0;
+	struct marian_hwdep_status st;
+	struct marian_hwdep_start start;
+	snd_pcm_t *playback, *capture;
+	int64_t target, t0, t1, now_frame = 0;
+	int fd, opt, err;
+
+	while ((opt = getopt(argc, argv, "D:H:t:f:")) != -1) {
+		switch (opt) {
+		case 'D':
+			device = optarg;
+			break;
+		case 'H':
+			hwdep = optarg;
+			break;
+		case 't':
+			delay_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			frames = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-D pcm] [-H hwdep] [-t delay_ms] [-f frames]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+
+	fd = open(hwdep, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		perror(hwdep);
+		return 1;
+	}
+
+	err = setup(&playback, device, SND_PCM_STREAM_PLAYBACK);
+	if (!err)
+		err = setup(&capture, device, SND_PCM_STREAM_CAPTURE);
+	if (!err)
+		err = prefill(playback);
+	if (!err)
+		err = snd_pcm_link(playback, capture);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", device, snd_strerror(err));
+		return 1;
+	}
+
+	memset(&start, 0, sizeof(start));
+	if (frames) {
+		now_frame = card_frame(fd, &st);
+		if (now_frame < 0) {
+			fprintf(stderr, "%s: the DMA engine isn't running\n", hwdep);
+			return 1;
+		}
+		start.frame = now_frame + frames;
+		target = st.tstamp_ns + (int64_t)(start.frame - st.frames - st.hw_pointer % PERIOD_FRAMES) *
+			 1000000000000LL / st.rate_mhz;
+	} else {
+		target = now_ns() + (int64_t)delay_ms * 1000000;
+		start.tstamp_ns = target;
+	}
+
+	t0 = now_ns();
+	if (ioctl(fd, MARIAN_HWDEP_IOCTL_START, &start) < 0) {
+		perror("MARIAN_HWDEP_IOCTL_START");
+		return 1;
+	}
+	t1 = now_ns();
+
+	printf("{\"mode\":\"%s\",\"target_ns\":%lld,\"started_ns\":%lld,\"error_us\":%.1f"
+	       ",\"blocked_ms\":%.1f,\"frame\":%llu,\"requested_frame\":%llu,\"groups\":%u"
+	       ",\"playback_state\":\"%s\",\"capture_state\":\"%s\""
+	       ",\"playback_trigger_us\":%.1f,\"capture_trigger_us\":%.1f}\n",
+	       frames ? "frame" : "time", (long long)target, (long long)start.tstamp_ns,
+	       (start.tstamp_ns - target) / 1000.0, (t1 - t0) / 1e6,
+	       (unsigned long long)start.frame, frames ? (unsigned long long)(now_frame + frames) : 0ULL,
+	       start.groups, snd_pcm_state_name(snd_pcm_state(playback)),
+	       snd_pcm_state_name(snd_pcm_state(capture)),
+	       (trigger_ns(playback) - target) / 1000.0, (trigger_ns(capture) - target) / 1000.0);
+
+	snd_pcm_drop(playback);
+	snd_pcm_unlink(playback);
+	snd_pcm_close(playback);
+	snd_pcm_close(capture);
+	close(fd);
+
+	return start.groups ? 0 : 1;
+}
@@ -1,7 +1,7 @@
 #!/bin/bash
+# Soak the driver: ./test.sh [soak options], e.g. ./test.sh -d 3600 -l 0
+# Results are appended as JSON lines to results/soak-<kernel>.jsonl
 
-rm -rf data/rec.wav.*
-echo "Recording test sample..."
-./record_ni.sh $1 $2 &
-./play_ni.sh $1 &
-wait
+[ soak -nt soak.c ] || gcc -O2 -Wall -o soak soak.c -lasound || exit 1
+mkdir -p results
+exec ./soak -o "results/soak-$(uname -r).jsonl" "$@"
@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * dTLB cost of a period of DSP over the hwdep DMA mapping
+ *
+ * Maps the DMA buffer of the MARIAN Seraph hwdep device twice: once 2 MiB
+ * aligned, which the driver backs with huge pages, and once 4 KiB past that,
+ * which forces small pages. For each, it runs a period of work in the shape
+ * of a passthrough: read every capture channel and write every playback
+ * channel for one period. Between periods it walks a scratch buffer, like
+ * the rest of an audio engine would, so the TLB doesn't stay warm. Counts
+ * dTLB load and store misses of the period work only, through perf events,
+ * and prints one JSON line per mapping.
+ *
+ *   tlbbench [-H hwdep] [-n periods] [-w scratch_mib]
+ *
+ * Nothing needs to stream, and nothing should play: the playback half of
+ * the ring is overwritten. The module has to be loaded with hwdep=1.
+ *
+ * Build: gcc -O2 -Wall -I.. -o tlbbench tlbbench.c ../lib/marian_ring.c
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/marian_ring.h"
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int open_counter(uint64_t op)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8) |
+		      ((uint64_t)PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t read_counter(int fd)
+{
+	uint64_t v = 0;
+
+	if (fd < 0 || read(fd, &v, sizeof(v)) != sizeof(v))
+		return 0;
+	return v;
+}
+
+static void counters(int *fds, unsigned long req)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (fds[i] >= 0)
+			ioctl(fds[i], req, 0);
+}
+
+// One period of a passthrough, capture to playback, with a gain to keep it honest
+static void period_work(const struct marian_hwdep_info *info, uint8_t *dma, unsigned int offset)
+{
+	const int32_t *in;
+	int32_t *out;
+	unsigned int ch, i;
+
+	for (ch = 0; ch < info->channels; ch++) {
+		in = (const int32_t *)(dma + info->capture_offset + ch * info->channel_bytes) + offset;
+		out = (int32_t *)(dma + info->playback_offset + ch * info->channel_bytes) + offset;
+		for (i = 0; i < info->period_frames; i++)
+			out[i] = in[i] >> 1;
+	}
+}
+
+static void run(const char *name, const struct marian_hwdep_info *info, uint8_t *dma,
+		size_t skew, unsigned int periods, volatile uint8_t *scratch, size_t scratch_bytes)
+{
+	int fds[2] = { open_counter(PERF_COUNT_HW_CACHE_OP_READ),
+		       open_counter(PERF_COUNT_HW_CACHE_OP_WRITE) };
+	int64_t t, ns = 0;
+	size_t off;
+	unsigned int p;
+
+	// Fault everything in first, that isn't what is measured
+	period_work(info, dma, 0);
+	period_work(info, dma, info->period_frames);
+
+	counters(fds, PERF_EVENT_IOC_RESET);
+	for (p = 0; p < periods; p++) {
+		for (off = 0; off < scratch_bytes; off += 4096)
+			scratch[off]++;
+
+		counters(fds, PERF_EVENT_IOC_ENABLE);
+		t = now_ns();
+		period_work(info, dma, p & 1 ? info->period_frames : 0);
+		ns += now_ns() - t;
+		counters(fds, PERF_EVENT_IOC_DISABLE);
+	}
+
+	printf("{\"mapping\":\"%s\",\"skew\":%zu,\"periods\":%u,\"ns_per_period\":%.0f"
+	       ",\"dtlb_load_misses_per_period\":%.1f,\"dtlb_store_misses_per_period\":%.1f}\n",
+	       name, skew, periods, (double)ns / periods,
+	       fds[0] >= 0 ? (double)read_counter(fds[0]) / periods : -1.0,
+	       fds[1] >= 0 ? (double)read_counter(fds[1]) / periods : -1.0);
+
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+}
+
+int main(int argc, char **argv)
+{
+	const char *hwdep = "/dev/snd/hwC0D0";
+	unsigned int periods = 2000, scratch_mib = 64;
+	struct marian_hwdep_info info;
+	uint8_t *huge, *small, *scratch;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "H:n:w:")) != -1) {
+		switch (opt) {
+		case 'H':
+			hwdep = optarg;
+			break;
+		case 'n':
+			periods = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			scratch_mib = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-H hwdep] [-n periods] [-w scratch_mib]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+
+	fd = open(hwdep, O_RDWR | O_CLOEXEC);
+	if (fd < 0 || ioctl(fd, MARIAN_HWDEP_IOCTL_INFO, &info) < 0) {
+		perror(hwdep);
+		return 1;
+	}
+	if (info.version != MARIAN_HWDEP_VERSION) {
+		fprintf(stderr, "%s: interface version %u\n", hwdep, info.version);
+		return 1;
+	}
+
+	huge = marian_map_dma(fd, info.dma_bytes, 0);
+	small = marian_map_dma(fd, info.dma_bytes, 4096);
+	scratch = malloc((size_t)scratch_mib << 20);
+	if (huge == MAP_FAILED || small == MAP_FAILED || !scratch) {
+		perror("mmap");
+		return 1;
+	}
+	memset(scratch, 0, (size_t)scratch_mib << 20);
+
+	run("huge", &info, huge, 0, periods, scratch, (size_t)scratch_mib << 20);
+	run("small", &info, small, 4096, periods, scratch, (size_t)scratch_mib << 20);
+
+	munmap(huge, info.dma_bytes);
+	munmap(small, info.dma_bytes);
+	free(scratch);
+	close(fd);
+
+	return 0;
+}